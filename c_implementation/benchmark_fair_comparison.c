@@ -28,16 +28,25 @@ double benchmark_flowregex_traditional(const char* text, const char* pattern, in
     flowregex_t *regex = flowregex_create(pattern, &error);
     if (!regex) return -1.0;
     
+    // コンテキストを使い回し、ループ内でメモリ確保しない
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    if (!ctx) {
+        flowregex_destroy(regex);
+        return -1.0;
+    }
+    size_t text_len = strlen(text);
+    
     clock_t start = clock();
     
     for (int i = 0; i < iterations; i++) {
-        match_result_t *result = flowregex_match(regex, text, false);
+        match_result_t *result = flowregex_match_ctx(regex, ctx, text, text_len);
         if (result) {
             match_result_destroy(result);
         }
     }
     
     clock_t end = clock();
+    flowregex_ctx_destroy(ctx);
     flowregex_destroy(regex);
     
     return ((double)(end - start)) / CLOCKS_PER_SEC * 1000.0;
@@ -57,34 +66,26 @@ double benchmark_matchmask_optimized(const char* text, const char* pattern, int
         return -1.0;
     }
     
-    // 事前に初期ビットマスクを作成（再利用）
+    // マッチコンテキストを作成（初期マスク・作業用マスクを再利用）
     size_t text_len = strlen(text);
-    bitmask_t *initial_mask = bitmask_create(text_len + 1);
-    if (!initial_mask) {
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    if (!ctx) {
         flowregex_destroy(regex);
         optimized_text_destroy(opt_text);
         return -1.0;
     }
-    
-    // 全ての位置から開始可能に設定
-    for (size_t pos = 0; pos <= text_len; pos++) {
-        bitmask_set(initial_mask, pos);
-    }
+    flowregex_ctx_set_optimized_text(ctx, opt_text);
     
     clock_t start = clock();
     
     for (int i = 0; i < iterations; i++) {
-        // 正規表現要素を適用（OptimizedTextを渡す）
-        bitmask_t *result_mask = regex->root->apply(regex->root, initial_mask, text, false, opt_text);
-        
-        if (result_mask) {
-            bitmask_destroy(result_mask);
-        }
+        // 結果マスクはコンテキストが保持（ループ内でのメモリ確保なし）
+        flowregex_match_mask(regex, ctx, text, text_len);
     }
     
     clock_t end = clock();
     
-    bitmask_destroy(initial_mask);
+    flowregex_ctx_destroy(ctx);
     flowregex_destroy(regex);
     optimized_text_destroy(opt_text);
     
@@ -50,13 +50,11 @@ int main() {
     clock_t end = clock();
     double time1 = ((double)(end - start)) / CLOCKS_PER_SEC * 1000.0;
     
-    // 最適化処理（手動でapply関数を呼び出し）
+    // 最適化処理（OptimizedTextを設定したコンテキストで実行）
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    flowregex_ctx_set_optimized_text(ctx, opt_text);
     start = clock();
-    bitmask_t *initial_mask = bitmask_create(strlen(text) + 1);
-    for (size_t i = 0; i <= strlen(text); i++) {
-        bitmask_set(initial_mask, i);
-    }
-    bitmask_t *result_mask = regex->root->apply(regex->root, initial_mask, text, false, opt_text);
+    flowregex_match_mask(regex, ctx, text, strlen(text));
     end = clock();
     double time2 = ((double)(end - start)) / CLOCKS_PER_SEC * 1000.0;
     
@@ -70,8 +68,7 @@ int main() {
         match_result_destroy(result1);
     }
     
-    bitmask_destroy(initial_mask);
-    bitmask_destroy(result_mask);
+    flowregex_ctx_destroy(ctx);
     flowregex_destroy(regex);
     optimized_text_destroy(opt_text);
     
@@ -1,28 +1,405 @@
 #include "flowregex.h"
+#include "bitmask_simd.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+// A mask keeps its positions in whichever form its contents need least of,
+// and every function takes any mix of them:
+//   BITMASK_ARRAY  sorted positions, at most one per word of the mask (a
+//                  new or cleared mask is an empty one)
+//   BITMASK_RUNS   sorted runs [start, end), at most one per two words
+//   BITMASK_FULL   every position, nothing stored
+//   BITMASK_DENSE  words in blocks of BITMASK_BLOCK_WORDS, with a summary
+//                  bit per block. A clear bit means the block is zero
+//                  whatever its words hold, so zero regions are skipped and
+//                  nothing is zeroed up front.
+// A sparse mask that outgrows its limit turns dense; bitmask_sparse and
+// bitmask_optimize move dense ones back. Word operations run a block at a
+// time, reading a block of a sparse operand from a scratch copy, while steps
+// from a position array are taken per position, so for rare positions the
+// work and the memory follow them rather than the mask size. Dense storage,
+// once allocated, is kept across kinds for reuse.
+
 // Number of bits per uint64_t
 #define BITS_PER_WORD 64
 
+// Positions per dense block
+#define BLOCK_BITS (BITMASK_BLOCK_WORDS * BITS_PER_WORD)
+
+// Words of a block that is zero, and of one that is all ones
+static const uint64_t zero_block[BITMASK_BLOCK_WORDS];
+#define ONES_8 ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL
+static const uint64_t ones_block[BITMASK_BLOCK_WORDS] = {
+    ONES_8, ONES_8, ONES_8, ONES_8, ONES_8, ONES_8, ONES_8, ONES_8
+};
+
 // Calculate number of words needed for given bit count
 static size_t words_needed(size_t bits) {
     return (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
 }
 
+static size_t block_count(const bitmask_t *mask) {
+    return (mask->capacity + BITMASK_BLOCK_WORDS - 1) / BITMASK_BLOCK_WORDS;
+}
+
+// Words of block b that lie within the mask
+static size_t block_words(const bitmask_t *mask, size_t b) {
+    size_t rest = mask->capacity - b * BITMASK_BLOCK_WORDS;
+    return rest < BITMASK_BLOCK_WORDS ? rest : BITMASK_BLOCK_WORDS;
+}
+
+// Most positions of an ARRAY: past one per word the words are smaller
+static size_t sparse_limit(const bitmask_t *mask) {
+    return mask->capacity;
+}
+
+// Most runs of a RUNS mask (two entries each)
+static size_t run_limit(const bitmask_t *mask) {
+    return (mask->capacity + 1) / 2;
+}
+
+// Allocate word storage aligned for the SIMD kernels.
+// The allocation is rounded up to whole cache lines.
+static uint64_t *alloc_words(size_t words) {
+    size_t bytes = words * sizeof(uint64_t);
+    bytes = (bytes + BITMASK_ALIGNMENT - 1) / BITMASK_ALIGNMENT * BITMASK_ALIGNMENT;
+    if (bytes == 0) bytes = BITMASK_ALIGNMENT;
+    
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, BITMASK_ALIGNMENT, bytes) != 0) return NULL;
+    return ptr;
+}
+
+// Allocate the dense storage of mask: whole blocks, so that every block can
+// be read in place, and the summary. The words past capacity in the last
+// block are zeroed here and never written.
+static bool dense_storage(bitmask_t *mask) {
+    if (mask->bits) return true;
+    
+    size_t blocks = block_count(mask);
+    size_t summary_words = (blocks + 63) / 64;
+    mask->summary = calloc(summary_words ? summary_words : 1, sizeof(uint64_t));
+    mask->bits = alloc_words(blocks * BITMASK_BLOCK_WORDS);
+    if (!mask->summary || !mask->bits) {
+        free(mask->summary);
+        free(mask->bits);
+        mask->summary = NULL;
+        mask->bits = NULL;
+        return false;
+    }
+    memset(mask->bits + mask->capacity, 0,
+           (blocks * BITMASK_BLOCK_WORDS - mask->capacity) * sizeof(uint64_t));
+    return true;
+}
+
+static void mark_block(bitmask_t *mask, size_t b, bool live) {
+    if (live) {
+        mask->summary[b / 64] |= 1ULL << (b % 64);
+    } else {
+        mask->summary[b / 64] &= ~(1ULL << (b % 64));
+    }
+}
+
+// Make block b of a dense mask current and zero
+static void zero_block_words(bitmask_t *mask, size_t b) {
+    memset(mask->bits + b * BITMASK_BLOCK_WORDS, 0, BITMASK_BLOCK_WORDS * sizeof(uint64_t));
+    mark_block(mask, b, true);
+}
+
+static bool any_words(const uint64_t *words, size_t n) {
+    uint64_t any = 0;
+    for (size_t i = 0; i < n; i++) any |= words[i];
+    return any != 0;
+}
+
+// Set bits [from, to) of a word array
+static void fill_range(uint64_t *words, size_t from, size_t to) {
+    while (from < to) {
+        size_t w = from / BITS_PER_WORD;
+        size_t hi = to - w * BITS_PER_WORD < BITS_PER_WORD ? to - w * BITS_PER_WORD : BITS_PER_WORD;
+        uint64_t bits = hi == BITS_PER_WORD ? ~0ULL : (1ULL << hi) - 1;
+        words[w] |= bits & (~0ULL << (from % BITS_PER_WORD));
+        from = w * BITS_PER_WORD + hi;
+    }
+}
+
+static void dense_set(bitmask_t *mask, size_t pos) {
+    size_t b = pos / BLOCK_BITS;
+    if (!bitmask_block_live(mask, b)) zero_block_words(mask, b);
+    mask->bits[pos / BITS_PER_WORD] |= 1ULL << (pos % BITS_PER_WORD);
+}
+
+static void dense_set_range(bitmask_t *mask, size_t from, size_t to) {
+    while (from < to) {
+        size_t b = from / BLOCK_BITS;
+        size_t end = (b + 1) * BLOCK_BITS < to ? (b + 1) * BLOCK_BITS : to;
+        if (!bitmask_block_live(mask, b)) zero_block_words(mask, b);
+        fill_range(mask->bits, from, end);
+        from = end;
+    }
+}
+
+// Word w of a dense mask, zero past its end
+static uint64_t dense_word(const bitmask_t *mask, size_t w) {
+    if (w >= mask->capacity || !bitmask_block_live(mask, w / BITMASK_BLOCK_WORDS)) return 0;
+    return mask->bits[w];
+}
+
+// Index of the first position >= pos of an ARRAY
+static size_t array_search(const bitmask_t *mask, size_t pos) {
+    size_t lo = 0;
+    size_t hi = mask->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mask->items[mid] < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Index of the first run of a RUNS mask ending after pos
+static size_t runs_search(const bitmask_t *mask, size_t pos) {
+    size_t lo = 0;
+    size_t hi = mask->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mask->items[2 * mid + 1] <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool items_reserve(bitmask_t *mask, size_t n) {
+    if (n <= mask->room) return true;
+    
+    size_t room = mask->room ? mask->room * 2 : 8;
+    while (room < n) room *= 2;
+    size_t *items = realloc(mask->items, room * sizeof(size_t));
+    if (!items) return false;
+    
+    mask->items = items;
+    mask->room = room;
+    return true;
+}
+
+// Move mask to DENSE, keeping its contents
+static bool make_dense(bitmask_t *mask) {
+    if (mask->kind == BITMASK_DENSE) return true;
+    if (!dense_storage(mask)) return false;
+    
+    memset(mask->summary, 0, ((block_count(mask) + 63) / 64) * sizeof(uint64_t));
+    bitmask_kind_t kind = mask->kind;
+    mask->kind = BITMASK_DENSE;
+    if (kind == BITMASK_ARRAY) {
+        for (size_t i = 0; i < mask->count; i++) dense_set(mask, mask->items[i]);
+    } else if (kind == BITMASK_RUNS) {
+        for (size_t i = 0; i < mask->count; i++) {
+            dense_set_range(mask, mask->items[2 * i], mask->items[2 * i + 1]);
+        }
+    } else {
+        dense_set_range(mask, 0, mask->size);
+    }
+    return true;
+}
+
+// Make dest dense for a word operation that writes every block, keeping its
+// contents only when it is also an operand
+static bool dense_target(bitmask_t *dest, bool keep) {
+    if (keep) return make_dense(dest);
+    if (!dense_storage(dest)) return false;
+    dest->kind = BITMASK_DENSE;
+    return true;
+}
+
+// Move an ARRAY to RUNS, adjacent positions joined, or to DENSE when the
+// runs pass their limit
+static bool array_to_runs(bitmask_t *mask) {
+    size_t runs = 0;
+    for (size_t i = 0; i < mask->count; i++) {
+        if (i == 0 || mask->items[i] != mask->items[i - 1] + 1) runs++;
+    }
+    if (runs > run_limit(mask)) return make_dense(mask);
+    
+    size_t room = runs > 0 ? 2 * runs : 2;
+    size_t *items = malloc(room * sizeof(size_t));
+    if (!items) return false;
+    size_t r = 0;
+    for (size_t i = 0; i < mask->count; i++) {
+        if (i == 0 || mask->items[i] != mask->items[i - 1] + 1) items[2 * r++] = mask->items[i];
+        items[2 * r - 1] = mask->items[i] + 1;
+    }
+    free(mask->items);
+    mask->items = items;
+    mask->room = room;
+    mask->count = runs;
+    mask->kind = BITMASK_RUNS;
+    return true;
+}
+
+// Add [start, end) to a RUNS mask, joining the runs it meets
+static bool runs_add(bitmask_t *mask, size_t start, size_t end) {
+    size_t n = mask->count;
+    size_t i = n > 0 && mask->items[2 * n - 1] < start ? n : runs_search(mask, start);
+    // A run ending right at start is joined too
+    if (i > 0 && mask->items[2 * i - 1] == start) i--;
+    size_t j = i;
+    while (j < n && mask->items[2 * j] <= end) j++;
+    if (j > i) {
+        if (mask->items[2 * i] < start) start = mask->items[2 * i];
+        if (mask->items[2 * j - 1] > end) end = mask->items[2 * j - 1];
+    }
+    
+    size_t count = n - (j - i) + 1;
+    if (count > run_limit(mask)) {
+        if (!make_dense(mask)) return false;
+        dense_set_range(mask, start, end);
+        return true;
+    }
+    if (!items_reserve(mask, 2 * count)) return false;
+    memmove(mask->items + 2 * (i + 1), mask->items + 2 * j, 2 * (n - j) * sizeof(size_t));
+    mask->items[2 * i] = start;
+    mask->items[2 * i + 1] = end;
+    mask->count = count;
+    return true;
+}
+
+// Add pos to a mask being built in increasing order
+static bool append(bitmask_t *mask, size_t pos) {
+    if (pos >= mask->size) return true;
+    if (mask->kind == BITMASK_ARRAY) {
+        if (mask->count > 0 && mask->items[mask->count - 1] >= pos) return true;
+        if (mask->count < sparse_limit(mask)) {
+            if (!items_reserve(mask, mask->count + 1)) return false;
+            mask->items[mask->count++] = pos;
+            return true;
+        }
+    }
+    return bitmask_set(mask, pos);
+}
+
+// Add [start, end) to a mask being built in order: start is not below the
+// start of the last run added
+static bool append_run(bitmask_t *mask, size_t start, size_t end) {
+    if (end > mask->size) end = mask->size;
+    if (start >= end) return true;
+    if (mask->kind == BITMASK_ARRAY) {
+        if (end - start == 1) return append(mask, start);
+        if (!array_to_runs(mask)) return false;
+    }
+    
+    if (mask->kind == BITMASK_RUNS) {
+        size_t n = mask->count;
+        if (n > 0 && start <= mask->items[2 * n - 1]) {
+            if (end > mask->items[2 * n - 1]) mask->items[2 * n - 1] = end;
+            return true;
+        }
+        if (n < run_limit(mask)) {
+            if (!items_reserve(mask, 2 * n + 2)) return false;
+            mask->items[2 * n] = start;
+            mask->items[2 * n + 1] = end;
+            mask->count++;
+            return true;
+        }
+        if (!make_dense(mask)) return false;
+    }
+    if (mask->kind == BITMASK_DENSE) dense_set_range(mask, start, end);
+    return true;
+}
+
+// Empty mask shaped like dest, for building a result while dest is still
+// read as an operand; take() then hands its storage to dest
+static bitmask_t scratch_of(const bitmask_t *dest) {
+    bitmask_t scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    scratch.size = dest->size;
+    scratch.capacity = dest->capacity;
+    scratch.kind = BITMASK_ARRAY;
+    return scratch;
+}
+
+static void scratch_free(bitmask_t *scratch) {
+    free(scratch->bits);
+    free(scratch->summary);
+    free(scratch->items);
+}
+
+static void take(bitmask_t *dest, bitmask_t *scratch) {
+    free(dest->items);
+    dest->items = scratch->items;
+    dest->room = scratch->room;
+    dest->count = scratch->count;
+    dest->kind = scratch->kind;
+    if (scratch->kind == BITMASK_DENSE) {
+        free(dest->bits);
+        free(dest->summary);
+        dest->bits = scratch->bits;
+        dest->summary = scratch->summary;
+    } else {
+        free(scratch->bits);
+        free(scratch->summary);
+    }
+}
+
+// Block b of mask as words: in place for a dense block, shared for a whole
+// full one, otherwise written into tmp. NULL if the block is zero or lies
+// past the mask.
+static const uint64_t *read_block(const bitmask_t *mask, size_t b, uint64_t *tmp) {
+    size_t first = b * BLOCK_BITS;
+    if (first >= mask->size) return NULL;
+    size_t last = mask->size - first < BLOCK_BITS ? mask->size : first + BLOCK_BITS;
+    
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            return bitmask_block_live(mask, b) ? mask->bits + b * BITMASK_BLOCK_WORDS : NULL;
+        case BITMASK_FULL:
+            if (last - first == BLOCK_BITS) return ones_block;
+            memset(tmp, 0, BITMASK_BLOCK_WORDS * sizeof(uint64_t));
+            fill_range(tmp, 0, last - first);
+            return tmp;
+        case BITMASK_ARRAY: {
+            size_t i = array_search(mask, first);
+            if (i == mask->count || mask->items[i] >= last) return NULL;
+            memset(tmp, 0, BITMASK_BLOCK_WORDS * sizeof(uint64_t));
+            for (; i < mask->count && mask->items[i] < last; i++) {
+                size_t p = mask->items[i] - first;
+                tmp[p / BITS_PER_WORD] |= 1ULL << (p % BITS_PER_WORD);
+            }
+            return tmp;
+        }
+        case BITMASK_RUNS: {
+            size_t i = runs_search(mask, first);
+            if (i == mask->count || mask->items[2 * i] >= last) return NULL;
+            memset(tmp, 0, BITMASK_BLOCK_WORDS * sizeof(uint64_t));
+            for (; i < mask->count && mask->items[2 * i] < last; i++) {
+                size_t from = mask->items[2 * i] > first ? mask->items[2 * i] - first : 0;
+                size_t to = mask->items[2 * i + 1] < last ? mask->items[2 * i + 1] - first : last - first;
+                fill_range(tmp, from, to);
+            }
+            return tmp;
+        }
+    }
+    return NULL;
+}
+
 bitmask_t *bitmask_create(size_t size) {
     bitmask_t *mask = malloc(sizeof(bitmask_t));
     if (!mask) return NULL;
     
+    mask->bits = NULL;
     mask->size = size;
     mask->capacity = words_needed(size);
-    mask->bits = calloc(mask->capacity, sizeof(uint64_t));
-    
-    if (!mask->bits) {
-        free(mask);
-        return NULL;
-    }
+    mask->kind = BITMASK_ARRAY;
+    mask->summary = NULL;
+    mask->items = NULL;
+    mask->count = 0;
+    mask->room = 0;
     
     return mask;
 }
@@ -30,60 +407,346 @@ bitmask_t *bitmask_create(size_t size) {
 void bitmask_destroy(bitmask_t *mask) {
     if (mask) {
         free(mask->bits);
+        free(mask->summary);
+        free(mask->items);
         free(mask);
     }
 }
 
-void bitmask_set(bitmask_t *mask, size_t pos) {
-    if (!mask || pos >= mask->size) return;
+bool bitmask_set(bitmask_t *mask, size_t pos) {
+    if (!mask || pos >= mask->size) return true;
     
-    size_t word_idx = pos / BITS_PER_WORD;
-    size_t bit_idx = pos % BITS_PER_WORD;
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            dense_set(mask, pos);
+            return true;
+        case BITMASK_FULL:
+            return true;
+        case BITMASK_RUNS:
+            return runs_add(mask, pos, pos + 1);
+        case BITMASK_ARRAY:
+            break;
+    }
     
-    mask->bits[word_idx] |= (1ULL << bit_idx);
+    size_t n = mask->count;
+    size_t i = n == 0 || mask->items[n - 1] < pos ? n : array_search(mask, pos);
+    if (i < n && mask->items[i] == pos) return true;
+    if (n < sparse_limit(mask)) {
+        if (!items_reserve(mask, n + 1)) return false;
+        memmove(mask->items + i + 1, mask->items + i, (n - i) * sizeof(size_t));
+        mask->items[i] = pos;
+        mask->count++;
+        return true;
+    }
+    if (!make_dense(mask)) return false;
+    dense_set(mask, pos);
+    return true;
 }
 
-void bitmask_clear(bitmask_t *mask, size_t pos) {
-    if (!mask || pos >= mask->size) return;
+bool bitmask_clear(bitmask_t *mask, size_t pos) {
+    if (!mask || pos >= mask->size) return true;
     
-    size_t word_idx = pos / BITS_PER_WORD;
-    size_t bit_idx = pos % BITS_PER_WORD;
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            if (bitmask_block_live(mask, pos / BLOCK_BITS)) {
+                mask->bits[pos / BITS_PER_WORD] &= ~(1ULL << (pos % BITS_PER_WORD));
+            }
+            return true;
+        case BITMASK_ARRAY: {
+            size_t i = array_search(mask, pos);
+            if (i < mask->count && mask->items[i] == pos) {
+                memmove(mask->items + i, mask->items + i + 1, (mask->count - i - 1) * sizeof(size_t));
+                mask->count--;
+            }
+            return true;
+        }
+        case BITMASK_FULL:
+            if (!items_reserve(mask, 2)) return false;
+            mask->items[0] = 0;
+            mask->items[1] = mask->size;
+            mask->count = 1;
+            mask->kind = BITMASK_RUNS;
+            break;
+        case BITMASK_RUNS:
+            break;
+    }
     
-    mask->bits[word_idx] &= ~(1ULL << bit_idx);
+    size_t i = runs_search(mask, pos);
+    if (i == mask->count || mask->items[2 * i] > pos) return true;
+    size_t start = mask->items[2 * i];
+    size_t end = mask->items[2 * i + 1];
+    if (start == pos && end == pos + 1) {
+        memmove(mask->items + 2 * i, mask->items + 2 * i + 2, 2 * (mask->count - i - 1) * sizeof(size_t));
+        mask->count--;
+    } else if (start == pos) {
+        mask->items[2 * i]++;
+    } else if (end == pos + 1) {
+        mask->items[2 * i + 1]--;
+    } else if (mask->count < run_limit(mask)) {
+        // Split the run around pos
+        if (!items_reserve(mask, 2 * mask->count + 2)) return false;
+        memmove(mask->items + 2 * i + 2, mask->items + 2 * i, 2 * (mask->count - i) * sizeof(size_t));
+        mask->items[2 * i + 1] = pos;
+        mask->items[2 * i + 2] = pos + 1;
+        mask->count++;
+    } else {
+        if (!make_dense(mask)) return false;
+        mask->bits[pos / BITS_PER_WORD] &= ~(1ULL << (pos % BITS_PER_WORD));
+    }
+    return true;
 }
 
 bool bitmask_get(const bitmask_t *mask, size_t pos) {
     if (!mask || pos >= mask->size) return false;
     
-    size_t word_idx = pos / BITS_PER_WORD;
-    size_t bit_idx = pos % BITS_PER_WORD;
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            return bitmask_block_live(mask, pos / BLOCK_BITS) &&
+                   (mask->bits[pos / BITS_PER_WORD] & (1ULL << (pos % BITS_PER_WORD))) != 0;
+        case BITMASK_ARRAY: {
+            size_t i = array_search(mask, pos);
+            return i < mask->count && mask->items[i] == pos;
+        }
+        case BITMASK_RUNS: {
+            size_t i = runs_search(mask, pos);
+            return i < mask->count && mask->items[2 * i] <= pos;
+        }
+        case BITMASK_FULL:
+            return true;
+    }
+    return false;
+}
+
+// Set every position in [from, to)
+bool bitmask_set_range(bitmask_t *mask, size_t from, size_t to) {
+    if (!mask) return true;
+    if (to > mask->size) to = mask->size;
+    if (from >= to) return true;
     
-    return (mask->bits[word_idx] & (1ULL << bit_idx)) != 0;
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            dense_set_range(mask, from, to);
+            return true;
+        case BITMASK_FULL:
+            return true;
+        case BITMASK_ARRAY:
+            if (to - from == 1) return bitmask_set(mask, from);
+            if (!array_to_runs(mask)) return false;
+            if (mask->kind == BITMASK_DENSE) {
+                dense_set_range(mask, from, to);
+                return true;
+            }
+            break;
+        case BITMASK_RUNS:
+            break;
+    }
+    if (from == 0 && to == mask->size) {
+        bitmask_set_all(mask);
+        return true;
+    }
+    return runs_add(mask, from, to);
 }
 
-void bitmask_or(bitmask_t *dest, const bitmask_t *src) {
-    if (!dest || !src) return;
+// dest |= src
+bool bitmask_or(bitmask_t *dest, const bitmask_t *src) {
+    if (!dest || !src || dest == src || dest->kind == BITMASK_FULL) return true;
     
-    size_t min_capacity = dest->capacity < src->capacity ? dest->capacity : src->capacity;
+    switch (src->kind) {
+        case BITMASK_FULL:
+            return bitmask_set_range(dest, 0, src->size);
+        case BITMASK_RUNS:
+            for (size_t i = 0; i < src->count; i++) {
+                if (!bitmask_set_range(dest, src->items[2 * i], src->items[2 * i + 1])) return false;
+            }
+            return true;
+        case BITMASK_ARRAY:
+            if (dest->kind == BITMASK_ARRAY && dest->count > 0 && src->count > 0) {
+                // Merge the two arrays
+                bitmask_t merged = scratch_of(dest);
+                size_t i = 0;
+                size_t j = 0;
+                bool ok = true;
+                while (ok && (i < dest->count || j < src->count)) {
+                    if (j == src->count || (i < dest->count && dest->items[i] < src->items[j])) {
+                        ok = append(&merged, dest->items[i++]);
+                    } else {
+                        ok = append(&merged, src->items[j++]);
+                    }
+                }
+                if (!ok) {
+                    scratch_free(&merged);
+                    return false;
+                }
+                take(dest, &merged);
+                return true;
+            }
+            for (size_t i = 0; i < src->count; i++) {
+                if (!bitmask_set(dest, src->items[i])) return false;
+            }
+            return true;
+        case BITMASK_DENSE:
+            break;
+    }
     
-    for (size_t i = 0; i < min_capacity; i++) {
-        dest->bits[i] |= src->bits[i];
+    if (!make_dense(dest)) return false;
+    uint64_t tmp[BITMASK_BLOCK_WORDS];
+    for (size_t b = 0; b < block_count(dest); b++) {
+        const uint64_t *x = read_block(src, b, tmp);
+        if (!x) continue;
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        if (bitmask_block_live(dest, b)) {
+            bitmask_kernels.or_words(out, x, n);
+        } else {
+            bitmask_kernels.copy_words(out, x, n);
+            mark_block(dest, b, true);
+        }
     }
+    bitmask_trim(dest);
+    return true;
 }
 
-void bitmask_and(bitmask_t *dest, const bitmask_t *src) {
-    if (!dest || !src) return;
+// Keep the positions of an ARRAY dest that are (or, with invert, are not)
+// in src
+static void array_filter(bitmask_t *dest, const bitmask_t *src, bool invert) {
+    size_t kept = 0;
+    for (size_t i = 0; i < dest->count; i++) {
+        if (bitmask_get(src, dest->items[i]) != invert) dest->items[kept++] = dest->items[i];
+    }
+    dest->count = kept;
+}
+
+// dest &= src
+bool bitmask_and(bitmask_t *dest, const bitmask_t *src) {
+    if (!dest || !src || dest == src) return true;
     
-    size_t min_capacity = dest->capacity < src->capacity ? dest->capacity : src->capacity;
+    if (src->kind == BITMASK_FULL && src->size >= dest->size) return true;
+    if (dest->kind == BITMASK_FULL) return bitmask_copy_into(dest, src);
+    if (dest->kind == BITMASK_ARRAY) {
+        array_filter(dest, src, false);
+        return true;
+    }
+    if (src->kind == BITMASK_ARRAY) {
+        // The result is a subset of src
+        bitmask_t kept = scratch_of(dest);
+        for (size_t i = 0; i < src->count; i++) {
+            if (bitmask_get(dest, src->items[i]) && !append(&kept, src->items[i])) {
+                scratch_free(&kept);
+                return false;
+            }
+        }
+        take(dest, &kept);
+        return true;
+    }
     
-    for (size_t i = 0; i < min_capacity; i++) {
-        dest->bits[i] &= src->bits[i];
+    if (!make_dense(dest)) return false;
+    uint64_t tmp[BITMASK_BLOCK_WORDS];
+    for (size_t b = 0; b < block_count(dest); b++) {
+        if (!bitmask_block_live(dest, b)) continue;
+        const uint64_t *x = read_block(src, b, tmp);
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        if (x) bitmask_kernels.and_words(out, x, n);
+        mark_block(dest, b, x && any_words(out, n));
     }
+    return true;
+}
+
+// dest &= ~src
+bool bitmask_andnot(bitmask_t *dest, const bitmask_t *src) {
+    if (!dest || !src) return true;
     
-    // Clear remaining bits in dest if it's larger
-    for (size_t i = min_capacity; i < dest->capacity; i++) {
-        dest->bits[i] = 0;
+    if (dest == src || (src->kind == BITMASK_FULL && src->size >= dest->size)) {
+        bitmask_clear_all(dest);
+        return true;
+    }
+    if (dest->kind == BITMASK_ARRAY) {
+        array_filter(dest, src, true);
+        return true;
     }
+    if (src->kind == BITMASK_ARRAY) {
+        for (size_t i = 0; i < src->count; i++) {
+            if (!bitmask_clear(dest, src->items[i])) return false;
+        }
+        return true;
+    }
+    
+    if (!make_dense(dest)) return false;
+    uint64_t tmp[BITMASK_BLOCK_WORDS];
+    for (size_t b = 0; b < block_count(dest); b++) {
+        if (!bitmask_block_live(dest, b)) continue;
+        const uint64_t *x = read_block(src, b, tmp);
+        if (!x) continue;
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        bitmask_kernels.andnot_words(out, x, n);
+        mark_block(dest, b, any_words(out, n));
+    }
+    return true;
+}
+
+// Complement within the mask's size. The gaps of a sparse mask become its
+// runs.
+bool bitmask_not(bitmask_t *mask) {
+    if (!mask) return true;
+    
+    if (mask->kind == BITMASK_FULL) {
+        bitmask_clear_all(mask);
+        return true;
+    }
+    if (mask->kind == BITMASK_ARRAY && mask->count == 0) {
+        bitmask_set_all(mask);
+        return true;
+    }
+    if (mask->kind != BITMASK_DENSE && mask->count < run_limit(mask)) {
+        bitmask_t gaps = scratch_of(mask);
+        gaps.kind = BITMASK_RUNS;
+        bool array = mask->kind == BITMASK_ARRAY;
+        bool ok = true;
+        size_t from = 0;
+        for (size_t i = 0; ok && i < mask->count; i++) {
+            size_t start = array ? mask->items[i] : mask->items[2 * i];
+            ok = append_run(&gaps, from, start);
+            from = array ? start + 1 : mask->items[2 * i + 1];
+        }
+        if (!ok || !append_run(&gaps, from, mask->size)) {
+            scratch_free(&gaps);
+            return false;
+        }
+        take(mask, &gaps);
+        return true;
+    }
+    
+    if (!make_dense(mask)) return false;
+    for (size_t b = 0; b < block_count(mask); b++) {
+        uint64_t *words = mask->bits + b * BITMASK_BLOCK_WORDS;
+        if (!bitmask_block_live(mask, b)) zero_block_words(mask, b);
+        for (size_t i = 0; i < block_words(mask, b); i++) words[i] = ~words[i];
+    }
+    bitmask_trim(mask);
+    return true;
+}
+
+// Emptiness test, stops at the first set bit; zero blocks are skipped
+bool bitmask_any(const bitmask_t *mask) {
+    if (!mask) return false;
+    
+    switch (mask->kind) {
+        case BITMASK_FULL:
+            return mask->size > 0;
+        case BITMASK_ARRAY:
+        case BITMASK_RUNS:
+            return mask->count > 0;
+        case BITMASK_DENSE:
+            break;
+    }
+    for (size_t b = 0; b < block_count(mask); b++) {
+        if (bitmask_block_live(mask, b) &&
+            any_words(mask->bits + b * BITMASK_BLOCK_WORDS, block_words(mask, b))) {
+            return true;
+        }
+    }
+    return false;
 }
 
 bitmask_t *bitmask_copy(const bitmask_t *src) {
@@ -92,47 +755,800 @@ bitmask_t *bitmask_copy(const bitmask_t *src) {
     bitmask_t *copy = bitmask_create(src->size);
     if (!copy) return NULL;
     
-    memcpy(copy->bits, src->bits, src->capacity * sizeof(uint64_t));
-    
+    if (!bitmask_copy_into(copy, src)) {
+        bitmask_destroy(copy);
+        return NULL;
+    }
     return copy;
 }
 
+// Copy src into an existing mask, keeping src's representation where it
+// fits; positions past dest's size are dropped. Only the nonzero blocks of
+// a dense src are copied.
+bool bitmask_copy_into(bitmask_t *dest, const bitmask_t *src) {
+    if (!dest || !src || dest == src) return true;
+    
+    switch (src->kind) {
+        case BITMASK_FULL:
+            if (src->size >= dest->size) {
+                bitmask_set_all(dest);
+                return true;
+            }
+            bitmask_clear_all(dest);
+            return bitmask_set_range(dest, 0, src->size);
+        case BITMASK_ARRAY: {
+            size_t n = src->size > dest->size ? array_search(src, dest->size) : src->count;
+            if (n > sparse_limit(dest)) break;
+            if (!items_reserve(dest, n)) return false;
+            if (n > 0) memcpy(dest->items, src->items, n * sizeof(size_t));
+            dest->count = n;
+            dest->kind = BITMASK_ARRAY;
+            return true;
+        }
+        case BITMASK_RUNS: {
+            size_t n = src->size > dest->size ? runs_search(src, dest->size) : src->count;
+            size_t cut = n < src->count && src->items[2 * n] < dest->size;
+            if (n + cut > run_limit(dest)) break;
+            if (!items_reserve(dest, 2 * (n + cut))) return false;
+            if (n + cut > 0) memcpy(dest->items, src->items, 2 * (n + cut) * sizeof(size_t));
+            if (cut) dest->items[2 * n + 1] = dest->size;
+            dest->count = n + cut;
+            dest->kind = BITMASK_RUNS;
+            return true;
+        }
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    if (!dense_target(dest, false)) return false;
+    uint64_t tmp[BITMASK_BLOCK_WORDS];
+    for (size_t b = 0; b < block_count(dest); b++) {
+        const uint64_t *x = read_block(src, b, tmp);
+        if (x) bitmask_kernels.copy_words(dest->bits + b * BITMASK_BLOCK_WORDS, x, block_words(dest, b));
+        mark_block(dest, b, x != NULL);
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// dest = the window of src starting at from, moved down to 0
+bool bitmask_copy_range(bitmask_t *dest, const bitmask_t *src, size_t from) {
+    if (!dest || !src || dest == src) return true;
+    
+    size_t to = from + dest->size;
+    switch (src->kind) {
+        case BITMASK_FULL:
+            if (to <= src->size) {
+                bitmask_set_all(dest);
+                return true;
+            }
+            bitmask_clear_all(dest);
+            return from >= src->size || append_run(dest, 0, src->size - from);
+        case BITMASK_ARRAY:
+            bitmask_clear_all(dest);
+            for (size_t i = array_search(src, from); i < src->count && src->items[i] < to; i++) {
+                if (!append(dest, src->items[i] - from)) return false;
+            }
+            return true;
+        case BITMASK_RUNS:
+            bitmask_clear_all(dest);
+            for (size_t i = runs_search(src, from); i < src->count && src->items[2 * i] < to; i++) {
+                size_t start = src->items[2 * i] > from ? src->items[2 * i] - from : 0;
+                if (!append_run(dest, start, src->items[2 * i + 1] - from)) return false;
+            }
+            return true;
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    if (!dense_target(dest, false)) return false;
+    size_t first = from / BITS_PER_WORD;
+    size_t shift = from % BITS_PER_WORD;
+    for (size_t b = 0; b < block_count(dest); b++) {
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        uint64_t any = 0;
+        for (size_t i = 0; i < n; i++) {
+            size_t w = first + b * BITMASK_BLOCK_WORDS + i;
+            uint64_t word = dense_word(src, w) >> shift;
+            if (shift) word |= dense_word(src, w + 1) << (BITS_PER_WORD - shift);
+            out[i] = word;
+            any |= word;
+        }
+        mark_block(dest, b, any != 0);
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// dest |= src moved up by offset; positions past dest's size are dropped
+bool bitmask_or_at(bitmask_t *dest, const bitmask_t *src, size_t offset) {
+    if (!dest || !src || dest == src) return true;
+    
+    switch (src->kind) {
+        case BITMASK_FULL:
+            return bitmask_set_range(dest, offset, offset + src->size);
+        case BITMASK_RUNS:
+            for (size_t i = 0; i < src->count; i++) {
+                if (!bitmask_set_range(dest, src->items[2 * i] + offset, src->items[2 * i + 1] + offset)) {
+                    return false;
+                }
+            }
+            return true;
+        case BITMASK_ARRAY:
+            for (size_t i = 0; i < src->count && src->items[i] + offset < dest->size; i++) {
+                if (!bitmask_set(dest, src->items[i] + offset)) return false;
+            }
+            return true;
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    // A dense window is dense data: move dest to words rather than taking
+    // its positions one at a time
+    if (!make_dense(dest)) return false;
+    size_t first = offset / BITS_PER_WORD;
+    size_t shift = offset % BITS_PER_WORD;
+    for (size_t b = 0; b < block_count(src); b++) {
+        if (!bitmask_block_live(src, b)) continue;
+        for (size_t i = 0; i < block_words(src, b); i++) {
+            size_t w = b * BITMASK_BLOCK_WORDS + i;
+            uint64_t word = src->bits[w];
+            if (!word) continue;
+            if (first + w >= dest->capacity) break;
+            if (!bitmask_block_live(dest, (first + w) / BITMASK_BLOCK_WORDS)) {
+                zero_block_words(dest, (first + w) / BITMASK_BLOCK_WORDS);
+            }
+            dest->bits[first + w] |= word << shift;
+            if (shift && first + w + 1 < dest->capacity) {
+                if (!bitmask_block_live(dest, (first + w + 1) / BITMASK_BLOCK_WORDS)) {
+                    zero_block_words(dest, (first + w + 1) / BITMASK_BLOCK_WORDS);
+                }
+                dest->bits[first + w + 1] |= word >> (BITS_PER_WORD - shift);
+            }
+        }
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// Set every position 0..size-1
+void bitmask_set_all(bitmask_t *mask) {
+    if (!mask) return;
+    
+    mask->kind = BITMASK_FULL;
+    mask->count = 0;
+}
+
+// Steps from a position array, taken per position: dest = the positions
+// after those of from that are (or, with exclude, are not) in other. The
+// positions are written no further than they are read, so dest may be from.
+static bool shift_positions(bitmask_t *dest, const bitmask_t *from, const bitmask_t *other, bool exclude) {
+    bitmask_t scratch = scratch_of(dest);
+    bitmask_t *out = dest == other ? &scratch : dest;
+    const size_t *items = from->items;
+    size_t n = from->count;
+    
+    bitmask_clear_all(out);
+    for (size_t i = 0; i < n; i++) {
+        if (bitmask_get(other, items[i]) != exclude && !append(out, items[i] + 1)) {
+            scratch_free(&scratch);
+            return false;
+        }
+    }
+    if (out == &scratch) take(dest, &scratch);
+    return true;
+}
+
+// Word-parallel consuming step, a block at a time: dest = (src & match) <<
+// 1, or (src & ~match) << 1 with exclude. The bit shifted out of each block
+// is carried into the next one; blocks with no input are skipped.
+static bool shift_blocks(bitmask_t *dest, const bitmask_t *src, const bitmask_t *match, bool exclude) {
+    if (!dense_target(dest, dest == src || dest == match)) return false;
+    
+    uint64_t a[BITMASK_BLOCK_WORDS];
+    uint64_t m[BITMASK_BLOCK_WORDS];
+    uint64_t carry = 0;
+    for (size_t b = 0; b < block_count(dest); b++) {
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        const uint64_t *x = read_block(src, b, a);
+        const uint64_t *y = x ? read_block(match, b, m) : NULL;
+        if (x && !y && exclude) y = zero_block;
+        if (!y) {
+            if (carry) {
+                zero_block_words(dest, b);
+                out[0] = carry;
+            } else {
+                mark_block(dest, b, false);
+            }
+            carry = 0;
+            continue;
+        }
+        
+        // Read the outgoing carry first: out may alias x or y
+        uint64_t y_top = exclude ? ~y[BITMASK_BLOCK_WORDS - 1] : y[BITMASK_BLOCK_WORDS - 1];
+        uint64_t top = (x[BITMASK_BLOCK_WORDS - 1] & y_top) >> 63;
+        if (exclude) {
+            bitmask_kernels.andnot_shift_words(out, x, y, n);
+        } else {
+            bitmask_kernels.and_shift_words(out, x, y, n);
+        }
+        out[0] |= carry;
+        carry = top;
+        mark_block(dest, b, any_words(out, n));
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// Consuming step: dest = (src & match) << 1. With a position array on
+// either side it is taken per position.
+bool bitmask_and_shift(bitmask_t *dest, const bitmask_t *src, const bitmask_t *match) {
+    if (!dest || !src || !match) return true;
+    
+    if (src->kind == BITMASK_ARRAY) return shift_positions(dest, src, match, false);
+    if (match->kind == BITMASK_ARRAY) return shift_positions(dest, match, src, false);
+    return shift_blocks(dest, src, match, false);
+}
+
+// Same as bitmask_and_shift, but consumes positions NOT set in exclude
+bool bitmask_andnot_shift(bitmask_t *dest, const bitmask_t *src, const bitmask_t *exclude) {
+    if (!dest || !src || !exclude) return true;
+    
+    if (src->kind == BITMASK_ARRAY) return shift_positions(dest, src, exclude, true);
+    return shift_blocks(dest, src, exclude, true);
+}
+
+// First position at or after pos not in mask
+static size_t run_end(const bitmask_t *mask, size_t pos) {
+    switch (mask->kind) {
+        case BITMASK_FULL:
+            return pos > mask->size ? pos : mask->size;
+        case BITMASK_RUNS: {
+            size_t i = runs_search(mask, pos);
+            return i < mask->count && mask->items[2 * i] <= pos ? mask->items[2 * i + 1] : pos;
+        }
+        case BITMASK_ARRAY:
+            for (size_t i = array_search(mask, pos); i < mask->count && mask->items[i] == pos; i++) pos++;
+            return pos;
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    while (pos < mask->size) {
+        uint64_t rest = ~dense_word(mask, pos / BITS_PER_WORD) >> (pos % BITS_PER_WORD);
+        if (rest) return pos + (size_t)__builtin_ctzll(rest);
+        pos = (pos / BITS_PER_WORD + 1) * BITS_PER_WORD;
+    }
+    return pos;
+}
+
+// Closure of a single-character step over match (X* or X+). With M = match
+// and D = src & M, ((M + D) ^ M) sets every position from the first input
+// bit of each run of M through the position after the run, so dest = src |
+// ((M + D) ^ M), the addition carrying across words; X+ takes one more step
+// in the same pass.
+// Words with no input and no incoming run are skipped, and so are blocks.
+// From a position array each position walks its run of match instead and
+// the result is built as runs. dest may alias src.
+bool bitmask_closure(bitmask_t *dest, const bitmask_t *src, const bitmask_t *match, bool at_least_one) {
+    if (!dest || !src || !match) return true;
+    
+    if (src->kind == BITMASK_ARRAY) {
+        bitmask_t scratch = scratch_of(dest);
+        bitmask_t *out = dest == src || dest == match ? &scratch : dest;
+        size_t reach = 0;
+        bool ok = true;
+        
+        bitmask_clear_all(out);
+        for (size_t i = 0; ok && i < src->count; i++) {
+            size_t pos = src->items[i];
+            // Positions inside a run already walked add nothing
+            if (pos < reach) continue;
+            size_t end = run_end(match, pos);
+            reach = end + 1;
+            ok = append_run(out, at_least_one ? pos + 1 : pos, end + 1);
+        }
+        if (!ok) {
+            scratch_free(&scratch);
+            return false;
+        }
+        if (out == &scratch) take(dest, &scratch);
+        return true;
+    }
+    
+    if (!dense_target(dest, dest == src || dest == match)) return false;
+    uint64_t a[BITMASK_BLOCK_WORDS];
+    uint64_t m[BITMASK_BLOCK_WORDS];
+    uint64_t add_carry = 0;
+    uint64_t shift_carry = 0;
+    for (size_t b = 0; b < block_count(dest); b++) {
+        uint64_t *out = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        const uint64_t *x = read_block(src, b, a);
+        if (!x && add_carry == 0) {
+            if (shift_carry) {
+                zero_block_words(dest, b);
+                out[0] = shift_carry;
+            } else {
+                mark_block(dest, b, false);
+            }
+            shift_carry = 0;
+            continue;
+        }
+        if (!x) x = zero_block;
+        const uint64_t *y = read_block(match, b, m);
+        if (!y) y = zero_block;
+        
+        uint64_t any = 0;
+        for (size_t w = 0; w < n; w++) {
+            uint64_t in = x[w];
+            
+            if (in == 0 && add_carry == 0) {
+                out[w] = shift_carry;
+                any |= shift_carry;
+                shift_carry = 0;
+                continue;
+            }
+            
+            uint64_t mw = y[w];
+            uint64_t t = mw + (in & mw);
+            uint64_t c1 = t < mw;
+            uint64_t sum = t + add_carry;
+            add_carry = c1 | (sum < t);
+            
+            uint64_t star = in | (sum ^ mw);
+            if (at_least_one) {
+                uint64_t s = star & mw;
+                out[w] = (s << 1) | shift_carry;
+                shift_carry = s >> 63;
+            } else {
+                out[w] = star;
+            }
+            any |= out[w];
+        }
+        mark_block(dest, b, any != 0);
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// count and_shift steps over masks[0..count) (at most 64) without
+// intermediate masks: the mask is taken one block at a time and every step
+// runs over that block in L1, the bit shifted out of step k at the block's
+// top carried into the next block's step k. Only the last step writes dest,
+// which may alias src. A block with no bits coming in and no carries is
+// left zero without running the steps, so sparse inputs (prefiltered
+// starts) cost little more than a scan; from a position array the steps are
+// taken per position.
+bool bitmask_and_shift_string(bitmask_t *dest, const bitmask_t *src, const bitmask_t *const *masks, size_t count) {
+    if (!dest || !src || !masks || count == 0 || count > 64) return true;
+    
+    bool in_masks = false;
+    for (size_t k = 0; k < count; k++) in_masks |= dest == masks[k];
+    
+    if (src->kind == BITMASK_ARRAY) {
+        bitmask_t scratch = scratch_of(dest);
+        bitmask_t *out = in_masks ? &scratch : dest;
+        const size_t *items = src->items;
+        size_t n = src->count;
+        
+        bitmask_clear_all(out);
+        for (size_t i = 0; i < n; i++) {
+            size_t k = 0;
+            while (k < count && bitmask_get(masks[k], items[i] + k)) k++;
+            if (k == count && !append(out, items[i] + count)) {
+                scratch_free(&scratch);
+                return false;
+            }
+        }
+        if (out == &scratch) take(dest, &scratch);
+        return true;
+    }
+    
+    if (!dense_target(dest, in_masks || dest == src)) return false;
+    uint64_t in_block[BITMASK_BLOCK_WORDS];
+    uint64_t match_block[BITMASK_BLOCK_WORDS];
+    uint64_t block[BITMASK_BLOCK_WORDS];
+    uint64_t carry[64] = {0};
+    for (size_t b = 0; b < block_count(dest); b++) {
+        uint64_t *last = dest->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(dest, b);
+        const uint64_t *x = read_block(src, b, in_block);
+        uint64_t live = 0;
+        for (size_t k = 0; k < count; k++) live |= carry[k];
+        if (!x && !live) {
+            mark_block(dest, b, false);
+            continue;
+        }
+        if (!x) x = zero_block;
+        
+        for (size_t k = 0; k < count; k++) {
+            const uint64_t *in = k == 0 ? x : block;
+            uint64_t *out = k + 1 == count ? last : block;
+            const uint64_t *match = read_block(masks[k], b, match_block);
+            if (!match) match = zero_block;
+            uint64_t top = (in[n - 1] & match[n - 1]) >> 63;
+            bitmask_kernels.and_shift_words(out, in, match, n);
+            out[0] |= carry[k];
+            carry[k] = top;
+        }
+        mark_block(dest, b, any_words(last, n));
+    }
+    bitmask_trim(dest);
+    return true;
+}
+
+// One pass over text marking, in masks[k], the positions holding bytes[k].
+// The bytes must be distinct; every mask covers at least text_len bits.
+// The masks come out dense, their summaries marking the nonzero blocks.
+bool bitmask_match_bytes(bitmask_t *const *masks, const unsigned char *bytes, size_t count,
+                         const char *text, size_t text_len) {
+    if (!masks || !bytes || !text || count == 0 || count > 256) return true;
+    
+    uint64_t *out[256];
+    for (size_t k = 0; k < count; k++) {
+        if (!dense_target(masks[k], false)) return false;
+        out[k] = masks[k]->bits;
+    }
+    bitmask_kernels.match_bytes_words(out, bytes, count, (const unsigned char *)text, text_len);
+    
+    size_t words = (text_len + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    for (size_t k = 0; k < count; k++) {
+        bitmask_t *mask = masks[k];
+        if (mask->capacity > words) {
+            memset(mask->bits + words, 0, (mask->capacity - words) * sizeof(uint64_t));
+        }
+        for (size_t b = 0; b < block_count(mask); b++) {
+            mark_block(mask, b, any_words(mask->bits + b * BITMASK_BLOCK_WORDS, block_words(mask, b)));
+        }
+    }
+    return true;
+}
+
+// Words of text scanned by bitmask_find_string between density checks
+#define FIND_SEGMENT_WORDS 512
+
+// Mark in dest the positions where text holds s[0..n) and return how many
+// there are. Each 64-byte block compares the first and last byte of s and
+// goes on to the inner bytes only while some position survives, so text
+// without the fingerprint costs two compares per byte. Each segment's
+// occurrences are appended to dest as positions. With sparse > 0 the scan
+// gives up, returning SIZE_MAX with dest incomplete, as soon as the
+// occurrences so far average more than one per sparse positions; it does
+// the same if memory runs out.
+size_t bitmask_find_string(bitmask_t *dest, const char *text, size_t text_len,
+                           const unsigned char *s, size_t n, size_t sparse) {
+    if (!dest || !text || !s || n == 0) return 0;
+    
+    size_t words = (text_len + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    if (words > dest->capacity) return 0;
+    
+    const unsigned char *t = (const unsigned char *)text;
+    // The kernel also writes the words of the n - 1 bytes looked ahead
+    uint64_t *segment = malloc((FIND_SEGMENT_WORDS + (n + 62) / BITS_PER_WORD) * sizeof(uint64_t));
+    if (!segment) return SIZE_MAX;
+    size_t count = 0;
+    bool ok = true;
+    bitmask_clear_all(dest);
+    for (size_t w = 0; ok && w < words; w += FIND_SEGMENT_WORDS) {
+        size_t end = w + FIND_SEGMENT_WORDS < words ? w + FIND_SEGMENT_WORDS : words;
+        size_t start = w * BITS_PER_WORD;
+        size_t len = text_len - start;
+        // Enough text for the occurrences starting in this segment
+        if (len > (end - w) * BITS_PER_WORD + n - 1) len = (end - w) * BITS_PER_WORD + n - 1;
+        bitmask_kernels.match_string_words(segment, t + start, len, s, n);
+        
+        for (size_t i = 0; ok && i < end - w; i++) {
+            for (uint64_t word = segment[i]; ok && word; word &= word - 1) {
+                ok = append(dest, start + i * BITS_PER_WORD + (size_t)__builtin_ctzll(word));
+                count++;
+            }
+        }
+        if (sparse > 0 && count > end * BITS_PER_WORD / sparse + 8) ok = false;
+    }
+    free(segment);
+    return ok ? count : SIZE_MAX;
+}
+
+const char *bitmask_simd_level(void) {
+    return bitmask_kernels.name;
+}
+
+// Clear the unused bits past mask->size in the last word of a dense mask
+void bitmask_trim(bitmask_t *mask) {
+    if (!mask || mask->kind != BITMASK_DENSE || mask->capacity == 0) return;
+    
+    size_t tail = mask->size % BITS_PER_WORD;
+    if (tail != 0 && bitmask_block_live(mask, (mask->capacity - 1) / BITMASK_BLOCK_WORDS)) {
+        mask->bits[mask->capacity - 1] &= (1ULL << tail) - 1;
+    }
+}
+
+// Clear every position: the mask becomes an empty position array, its
+// dense storage kept for reuse
 void bitmask_clear_all(bitmask_t *mask) {
     if (!mask) return;
     
-    memset(mask->bits, 0, mask->capacity * sizeof(uint64_t));
+    mask->kind = BITMASK_ARRAY;
+    mask->count = 0;
 }
 
-int *bitmask_get_set_positions(const bitmask_t *mask, size_t *count) {
-    if (!mask || !count) return NULL;
+size_t bitmask_count(const bitmask_t *mask) {
+    if (!mask) return 0;
     
-    // First pass: count set bits
-    *count = 0;
-    for (size_t i = 0; i < mask->size; i++) {
-        if (bitmask_get(mask, i)) {
-            (*count)++;
+    size_t count = 0;
+    switch (mask->kind) {
+        case BITMASK_FULL:
+            return mask->size;
+        case BITMASK_ARRAY:
+            return mask->count;
+        case BITMASK_RUNS:
+            for (size_t i = 0; i < mask->count; i++) count += mask->items[2 * i + 1] - mask->items[2 * i];
+            return count;
+        case BITMASK_DENSE:
+            break;
+    }
+    for (size_t b = 0; b < block_count(mask); b++) {
+        if (!bitmask_block_live(mask, b)) continue;
+        count += bitmask_kernels.count_words(mask->bits + b * BITMASK_BLOCK_WORDS, block_words(mask, b));
+    }
+    return count;
+}
+
+// First set position at or after pos, or SIZE_MAX
+size_t bitmask_next(const bitmask_t *mask, size_t pos) {
+    if (!mask || pos >= mask->size) return SIZE_MAX;
+    
+    switch (mask->kind) {
+        case BITMASK_FULL:
+            return pos;
+        case BITMASK_ARRAY: {
+            size_t i = array_search(mask, pos);
+            return i < mask->count ? mask->items[i] : SIZE_MAX;
+        }
+        case BITMASK_RUNS: {
+            size_t i = runs_search(mask, pos);
+            if (i == mask->count) return SIZE_MAX;
+            return mask->items[2 * i] > pos ? mask->items[2 * i] : pos;
+        }
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    size_t w = pos / BITS_PER_WORD;
+    uint64_t word = dense_word(mask, w) & (~0ULL << (pos % BITS_PER_WORD));
+    if (!bitmask_block_live(mask, w / BITMASK_BLOCK_WORDS)) {
+        w = w / BITMASK_BLOCK_WORDS * BITMASK_BLOCK_WORDS + BITMASK_BLOCK_WORDS - 1;
+    }
+    while (!word) {
+        if (++w >= mask->capacity) return SIZE_MAX;
+        if (!bitmask_block_live(mask, w / BITMASK_BLOCK_WORDS)) {
+            w += BITMASK_BLOCK_WORDS - 1;
+            continue;
+        }
+        word = mask->bits[w];
+    }
+    return w * BITS_PER_WORD + (size_t)__builtin_ctzll(word);
+}
+
+// The words of mask, for code that reads or writes them directly (NULL if
+// memory ran out). The mask is left dense with every block current and
+// marked as possibly nonzero.
+uint64_t *bitmask_words(bitmask_t *mask) {
+    if (!mask || !make_dense(mask)) return NULL;
+    
+    for (size_t b = 0; b < block_count(mask); b++) {
+        if (!bitmask_block_live(mask, b)) zero_block_words(mask, b);
+    }
+    return mask->bits;
+}
+
+// Whether mask holds at most one position per word, so that steps from it
+// are cheaper taken per position. A dense mask that does is moved to a
+// position array; the count stops as soon as it passes the limit.
+bool bitmask_sparse(bitmask_t *mask) {
+    if (!mask) return false;
+    
+    size_t limit = sparse_limit(mask);
+    size_t count = 0;
+    switch (mask->kind) {
+        case BITMASK_ARRAY:
+            return true;
+        case BITMASK_FULL:
+            return false;
+        case BITMASK_RUNS:
+            for (size_t i = 0; i < mask->count && count <= limit; i++) {
+                count += mask->items[2 * i + 1] - mask->items[2 * i];
+            }
+            return count <= limit;
+        case BITMASK_DENSE:
+            break;
+    }
+    
+    for (size_t b = 0; b < block_count(mask); b++) {
+        if (!bitmask_block_live(mask, b)) continue;
+        count += bitmask_kernels.count_words(mask->bits + b * BITMASK_BLOCK_WORDS, block_words(mask, b));
+        if (count > limit) return false;
+    }
+    
+    if (!items_reserve(mask, count)) return false;
+    size_t n = 0;
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        mask->items[n++] = pos;
+    }
+    mask->count = n;
+    mask->kind = BITMASK_ARRAY;
+    return true;
+}
+
+// Move a dense mask to the smallest representation of its contents:
+// positions below one per word, runs below one per two words, or full.
+// The scan stops once both limits are passed; blocks found zero on the way
+// are dropped from the summary.
+void bitmask_optimize(bitmask_t *mask) {
+    if (!mask || mask->kind != BITMASK_DENSE) return;
+    
+    size_t count = 0;
+    size_t runs = 0;
+    uint64_t prev = 0;      // top bit of the word before
+    for (size_t b = 0; b < block_count(mask); b++) {
+        const uint64_t *words = mask->bits + b * BITMASK_BLOCK_WORDS;
+        size_t n = block_words(mask, b);
+        if (!bitmask_block_live(mask, b) || !any_words(words, n)) {
+            mark_block(mask, b, false);
+            prev = 0;
+            continue;
         }
+        count += bitmask_kernels.count_words(words, n);
+        runs += bitmask_kernels.count_runs(words, n, prev);
+        prev = words[n - 1] >> 63;
+        if (count > sparse_limit(mask) && runs > run_limit(mask)) return;
     }
     
+    if (count == mask->size) {
+        bitmask_set_all(mask);
+        return;
+    }
+    if (count <= sparse_limit(mask) && count <= 2 * runs) {
+        bitmask_sparse(mask);
+        return;
+    }
+    if (runs > run_limit(mask) || !items_reserve(mask, 2 * runs)) return;
+    
+    // Walk the run boundaries a word at a time
+    size_t r = 0;
+    bool open = false;
+    for (size_t w = 0; w < mask->capacity; w++) {
+        uint64_t word = dense_word(mask, w);
+        size_t bit = 0;
+        while (bit < BITS_PER_WORD) {
+            uint64_t rest = (open ? ~word : word) >> bit;
+            if (!rest) break;
+            bit += (size_t)__builtin_ctzll(rest);
+            if (open) {
+                mask->items[2 * r++ + 1] = w * BITS_PER_WORD + bit;
+            } else {
+                mask->items[2 * r] = w * BITS_PER_WORD + bit;
+            }
+            open = !open;
+        }
+    }
+    if (open) mask->items[2 * r++ + 1] = mask->size;
+    mask->count = r;
+    mask->kind = BITMASK_RUNS;
+}
+
+size_t *bitmask_get_set_positions(const bitmask_t *mask, size_t *count) {
+    if (!mask || !count) return NULL;
+    
+    *count = bitmask_count(mask);
     if (*count == 0) return NULL;
     
-    // Second pass: collect positions
-    int *positions = malloc(*count * sizeof(int));
+    size_t *positions = malloc(*count * sizeof(size_t));
     if (!positions) {
         *count = 0;
         return NULL;
     }
     
     size_t idx = 0;
-    for (size_t i = 0; i < mask->size; i++) {
-        if (bitmask_get(mask, i)) {
-            positions[idx++] = (int)i;
-        }
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        positions[idx++] = pos;
     }
     
     return positions;
 }
 
+// BitMask pool
+
+bitmask_pool_t *bitmask_pool_create(size_t size) {
+    bitmask_pool_t *pool = malloc(sizeof(bitmask_pool_t));
+    if (!pool) return NULL;
+    
+    pool->size = size;
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->free_capacity = 0;
+    pool->allocated = 0;
+    
+    return pool;
+}
+
+void bitmask_pool_destroy(bitmask_pool_t *pool) {
+    if (!pool) return;
+    
+    for (size_t i = 0; i < pool->free_count; i++) {
+        bitmask_destroy(pool->free_list[i]);
+    }
+    free(pool->free_list);
+    free(pool);
+}
+
+// Switch the pool to a new mask size; cached masks of another size are freed
+void bitmask_pool_reset(bitmask_pool_t *pool, size_t size) {
+    if (!pool || pool->size == size) return;
+    
+    for (size_t i = 0; i < pool->free_count; i++) {
+        bitmask_destroy(pool->free_list[i]);
+    }
+    pool->free_count = 0;
+    pool->size = size;
+}
+
+// Get a mask of the given size. The contents are undefined: callers must
+// overwrite it (or clear it) before reading.
+bitmask_t *bitmask_pool_acquire(bitmask_pool_t *pool, size_t size) {
+    if (pool && size == pool->size && pool->free_count > 0) {
+        return pool->free_list[--pool->free_count];
+    }
+    
+    bitmask_t *mask = bitmask_create(size);
+    if (mask && pool) pool->allocated++;
+    return mask;
+}
+
+bitmask_t *bitmask_pool_copy(bitmask_pool_t *pool, const bitmask_t *src) {
+    if (!src) return NULL;
+    
+    bitmask_t *copy = bitmask_pool_acquire(pool, src->size);
+    if (!copy) return NULL;
+    
+    if (!bitmask_copy_into(copy, src)) {
+        bitmask_pool_release(pool, copy);
+        return NULL;
+    }
+    return copy;
+}
+
+void bitmask_pool_release(bitmask_pool_t *pool, bitmask_t *mask) {
+    if (!mask) return;
+    
+    if (!pool || mask->size != pool->size) {
+        bitmask_destroy(mask);
+        return;
+    }
+    
+    if (pool->free_count == pool->free_capacity) {
+        size_t new_capacity = pool->free_capacity ? pool->free_capacity * 2 : 8;
+        bitmask_t **new_list = realloc(pool->free_list, new_capacity * sizeof(bitmask_t *));
+        if (!new_list) {
+            bitmask_destroy(mask);
+            return;
+        }
+        pool->free_list = new_list;
+        pool->free_capacity = new_capacity;
+    }
+    
+    pool->free_list[pool->free_count++] = mask;
+}
+
 #ifdef DEBUG
 void bitmask_print(const bitmask_t *mask, const char *label) {
     if (!mask) {
@@ -142,12 +1558,13 @@ void bitmask_print(const bitmask_t *mask, const char *label) {
     
     printf("%s: [", label ? label : "BitMask");
     bool first = true;
-    for (size_t i = 0; i < mask->size; i++) {
-        if (bitmask_get(mask, i)) {
-            if (!first) printf(", ");
-            printf("%zu", i);
-            first = false;
-        }
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        if (!first) printf(", ");
+        printf("%zu", pos);
+        first = false;
     }
     printf("]\n");
 }
@@ -0,0 +1,544 @@
+#include "bitmask_simd.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Scalar kernels (portable fallback)
+
+static void scalar_or_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dest[i] |= src[i];
+    }
+}
+
+static void scalar_and_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dest[i] &= src[i];
+    }
+}
+
+static void scalar_andnot_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dest[i] &= ~src[i];
+    }
+}
+
+static void scalar_copy_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    memcpy(dest, src, n * sizeof(uint64_t));
+}
+
+static void scalar_and_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t n) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = src[i] & match[i];
+        dest[i] = (x << 1) | carry;
+        carry = x >> 63;
+    }
+}
+
+static void scalar_andnot_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t n) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = src[i] & ~exclude[i];
+        dest[i] = (x << 1) | carry;
+        carry = x >> 63;
+    }
+}
+
+// Finish the low words of a shift kernel that was vectorized from the top down.
+// Words [1, i) are processed high to low so dest may alias src.
+static void scalar_and_shift_low(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t i) {
+    for (; i > 1; i--) {
+        uint64_t x = src[i - 1] & match[i - 1];
+        uint64_t prev = src[i - 2] & match[i - 2];
+        dest[i - 1] = (x << 1) | (prev >> 63);
+    }
+    dest[0] = (src[0] & match[0]) << 1;
+}
+
+static void scalar_andnot_shift_low(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t i) {
+    for (; i > 1; i--) {
+        uint64_t x = src[i - 1] & ~exclude[i - 1];
+        uint64_t prev = src[i - 2] & ~exclude[i - 2];
+        dest[i - 1] = (x << 1) | (prev >> 63);
+    }
+    dest[0] = (src[0] & ~exclude[0]) << 1;
+}
+
+// Byte-match words from word first_word on: one pass over the text, each
+// byte routed to its output through a 256-entry table
+static void scalar_match_bytes_from(uint64_t *const *out, const unsigned char *bytes, size_t count,
+                                    const unsigned char *text, size_t len, size_t first_word) {
+    size_t words = (len + 63) / 64;
+    if (first_word >= words) return;
+    
+    int16_t route[256];
+    memset(route, 0xff, sizeof(route));
+    for (size_t k = 0; k < count; k++) {
+        route[bytes[k]] = (int16_t)k;
+        memset(out[k] + first_word, 0, (words - first_word) * sizeof(uint64_t));
+    }
+    
+    for (size_t i = first_word * 64; i < len; i++) {
+        int16_t k = route[text[i]];
+        if (k >= 0) out[k][i >> 6] |= 1ULL << (i & 63);
+    }
+}
+
+static void scalar_match_bytes_words(uint64_t *const *out, const unsigned char *bytes, size_t count,
+                                     const unsigned char *text, size_t len) {
+    scalar_match_bytes_from(out, bytes, count, text, len, 0);
+}
+
+// String-match words from word first_word on
+static void scalar_match_string_from(uint64_t *out, const unsigned char *text, size_t len,
+                                     const unsigned char *s, size_t n, size_t first_word) {
+    size_t words = (len + 63) / 64;
+    if (first_word >= words) return;
+    memset(out + first_word, 0, (words - first_word) * sizeof(uint64_t));
+    
+    for (size_t i = first_word * 64; i + n <= len; i++) {
+        if (text[i] == s[0] && text[i + n - 1] == s[n - 1] && memcmp(text + i, s, n) == 0) {
+            out[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+}
+
+static void scalar_match_string_words(uint64_t *out, const unsigned char *text, size_t len,
+                                      const unsigned char *s, size_t n) {
+    scalar_match_string_from(out, text, len, s, n, 0);
+}
+
+static size_t scalar_count_words(const uint64_t *words, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (size_t)__builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+static size_t scalar_count_runs(const uint64_t *words, size_t n, uint64_t carry) {
+    size_t runs = 0;
+    for (size_t i = 0; i < n; i++) {
+        runs += (size_t)__builtin_popcountll(words[i] & ~((words[i] << 1) | carry));
+        carry = words[i] >> 63;
+    }
+    return runs;
+}
+
+bitmask_kernels_t bitmask_kernels = {
+    "scalar",
+    scalar_or_words,
+    scalar_and_words,
+    scalar_andnot_words,
+    scalar_copy_words,
+    scalar_and_shift_words,
+    scalar_andnot_shift_words,
+    scalar_match_bytes_words,
+    scalar_match_string_words,
+    scalar_count_words,
+    scalar_count_runs
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// SSE2 kernels (always available on x86-64)
+
+static void sse2_or_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dest + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(a, b));
+    }
+    scalar_or_words(dest + i, src + i, n - i);
+}
+
+static void sse2_and_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dest + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_and_si128(a, b));
+    }
+    scalar_and_words(dest + i, src + i, n - i);
+}
+
+static void sse2_andnot_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dest + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_andnot_si128(b, a));
+    }
+    scalar_andnot_words(dest + i, src + i, n - i);
+}
+
+static void sse2_copy_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    scalar_copy_words(dest + i, src + i, n - i);
+}
+
+static void sse2_and_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t n) {
+    size_t i = n;
+    while (i >= 2 + 1) {
+        i -= 2;
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)),
+                                  _mm_loadu_si128((const __m128i *)(match + i)));
+        __m128i prev = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i - 1)),
+                                     _mm_loadu_si128((const __m128i *)(match + i - 1)));
+        __m128i out = _mm_or_si128(_mm_slli_epi64(x, 1), _mm_srli_epi64(prev, 63));
+        _mm_storeu_si128((__m128i *)(dest + i), out);
+    }
+    if (n > 0) scalar_and_shift_low(dest, src, match, i);
+}
+
+static void sse2_andnot_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t n) {
+    size_t i = n;
+    while (i >= 2 + 1) {
+        i -= 2;
+        __m128i x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(exclude + i)),
+                                     _mm_loadu_si128((const __m128i *)(src + i)));
+        __m128i prev = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(exclude + i - 1)),
+                                        _mm_loadu_si128((const __m128i *)(src + i - 1)));
+        __m128i out = _mm_or_si128(_mm_slli_epi64(x, 1), _mm_srli_epi64(prev, 63));
+        _mm_storeu_si128((__m128i *)(dest + i), out);
+    }
+    if (n > 0) scalar_andnot_shift_low(dest, src, exclude, i);
+}
+
+// Byte compare + movemask over each 64-byte block; the last partial block
+// goes through the scalar router
+static void sse2_match_bytes_words(uint64_t *const *out, const unsigned char *bytes, size_t count,
+                                   const unsigned char *text, size_t len) {
+    size_t blocks = len / 64;
+    for (size_t w = 0; w < blocks; w++) {
+        const __m128i *p = (const __m128i *)(text + w * 64);
+        __m128i t0 = _mm_loadu_si128(p);
+        __m128i t1 = _mm_loadu_si128(p + 1);
+        __m128i t2 = _mm_loadu_si128(p + 2);
+        __m128i t3 = _mm_loadu_si128(p + 3);
+        for (size_t k = 0; k < count; k++) {
+            __m128i b = _mm_set1_epi8((char)bytes[k]);
+            uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t0, b));
+            uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t1, b));
+            uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t2, b));
+            uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t3, b));
+            out[k][w] = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+        }
+    }
+    scalar_match_bytes_from(out, bytes, count, text, len, blocks);
+}
+
+// Per 64-byte block: compare the first and the last byte of s at their
+// offsets, then the inner bytes while any position survives; blocks whose
+// last compare runs past the text go through the scalar loop
+static void sse2_match_string_words(uint64_t *out, const unsigned char *text, size_t len,
+                                    const unsigned char *s, size_t n) {
+    size_t blocks = len >= n - 1 ? (len - (n - 1)) / 64 : 0;
+    for (size_t w = 0; w < blocks; w++) {
+        const unsigned char *p = text + w * 64;
+        __m128i f = _mm_set1_epi8((char)s[0]);
+        __m128i l = _mm_set1_epi8((char)s[n - 1]);
+        __m128i m[4];
+        int any = 0;
+        for (int v = 0; v < 4; v++) {
+            m[v] = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * v)), f),
+                                 _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * v + n - 1)), l));
+            any |= _mm_movemask_epi8(m[v]);
+        }
+        for (size_t j = 1; any && j + 1 < n; j++) {
+            __m128i b = _mm_set1_epi8((char)s[j]);
+            any = 0;
+            for (int v = 0; v < 4; v++) {
+                m[v] = _mm_and_si128(m[v], _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * v + j)), b));
+                any |= _mm_movemask_epi8(m[v]);
+            }
+        }
+        uint64_t bits = 0;
+        for (int v = 0; any && v < 4; v++) {
+            bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(m[v]) << (16 * v);
+        }
+        out[w] = bits;
+    }
+    scalar_match_string_from(out, text, len, s, n, blocks);
+}
+
+// Counting kernels with the POPCNT instruction (every AVX2 CPU has it; the
+// portable build calls a library routine per word instead)
+
+__attribute__((target("popcnt")))
+static size_t popcnt_count_words(const uint64_t *words, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (size_t)_mm_popcnt_u64(words[i]);
+    }
+    return count;
+}
+
+__attribute__((target("popcnt")))
+static size_t popcnt_count_runs(const uint64_t *words, size_t n, uint64_t carry) {
+    size_t runs = 0;
+    for (size_t i = 0; i < n; i++) {
+        runs += (size_t)_mm_popcnt_u64(words[i] & ~((words[i] << 1) | carry));
+        carry = words[i] >> 63;
+    }
+    return runs;
+}
+
+// AVX2 kernels
+
+__attribute__((target("avx2")))
+static void avx2_or_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_or_si256(a, b));
+    }
+    scalar_or_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_and_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_and_si256(a, b));
+    }
+    scalar_and_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_andnot_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_andnot_si256(b, a));
+    }
+    scalar_andnot_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    scalar_copy_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_and_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t n) {
+    size_t i = n;
+    while (i >= 4 + 1) {
+        i -= 4;
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)),
+                                     _mm256_loadu_si256((const __m256i *)(match + i)));
+        __m256i prev = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i - 1)),
+                                        _mm256_loadu_si256((const __m256i *)(match + i - 1)));
+        __m256i out = _mm256_or_si256(_mm256_slli_epi64(x, 1), _mm256_srli_epi64(prev, 63));
+        _mm256_storeu_si256((__m256i *)(dest + i), out);
+    }
+    if (n > 0) scalar_and_shift_low(dest, src, match, i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_andnot_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t n) {
+    size_t i = n;
+    while (i >= 4 + 1) {
+        i -= 4;
+        __m256i x = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(exclude + i)),
+                                        _mm256_loadu_si256((const __m256i *)(src + i)));
+        __m256i prev = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(exclude + i - 1)),
+                                           _mm256_loadu_si256((const __m256i *)(src + i - 1)));
+        __m256i out = _mm256_or_si256(_mm256_slli_epi64(x, 1), _mm256_srli_epi64(prev, 63));
+        _mm256_storeu_si256((__m256i *)(dest + i), out);
+    }
+    if (n > 0) scalar_andnot_shift_low(dest, src, exclude, i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_match_bytes_words(uint64_t *const *out, const unsigned char *bytes, size_t count,
+                                   const unsigned char *text, size_t len) {
+    size_t blocks = len / 64;
+    for (size_t w = 0; w < blocks; w++) {
+        const __m256i *p = (const __m256i *)(text + w * 64);
+        __m256i lo = _mm256_loadu_si256(p);
+        __m256i hi = _mm256_loadu_si256(p + 1);
+        for (size_t k = 0; k < count; k++) {
+            __m256i b = _mm256_set1_epi8((char)bytes[k]);
+            uint64_t m_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, b));
+            uint64_t m_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, b));
+            out[k][w] = m_lo | (m_hi << 32);
+        }
+    }
+    scalar_match_bytes_from(out, bytes, count, text, len, blocks);
+}
+
+__attribute__((target("avx2")))
+static void avx2_match_string_words(uint64_t *out, const unsigned char *text, size_t len,
+                                    const unsigned char *s, size_t n) {
+    size_t blocks = len >= n - 1 ? (len - (n - 1)) / 64 : 0;
+    __m256i f = _mm256_set1_epi8((char)s[0]);
+    __m256i l = _mm256_set1_epi8((char)s[n - 1]);
+    for (size_t w = 0; w < blocks; w++) {
+        const unsigned char *p = text + w * 64;
+        __m256i lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), f),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + n - 1)), l));
+        __m256i hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), f),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32 + n - 1)), l));
+        for (size_t j = 1; j + 1 < n; j++) {
+            __m256i any = _mm256_or_si256(lo, hi);
+            if (_mm256_testz_si256(any, any)) break;
+            __m256i b = _mm256_set1_epi8((char)s[j]);
+            lo = _mm256_and_si256(lo, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + j)), b));
+            hi = _mm256_and_si256(hi, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32 + j)), b));
+        }
+        uint64_t m_lo = (uint32_t)_mm256_movemask_epi8(lo);
+        uint64_t m_hi = (uint32_t)_mm256_movemask_epi8(hi);
+        out[w] = m_lo | (m_hi << 32);
+    }
+    scalar_match_string_from(out, text, len, s, n, blocks);
+}
+
+// AVX-512 kernels
+
+__attribute__((target("avx512f")))
+static void avx512_or_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512((const void *)(dest + i));
+        __m512i b = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dest + i), _mm512_or_si512(a, b));
+    }
+    scalar_or_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_and_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512((const void *)(dest + i));
+        __m512i b = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dest + i), _mm512_and_si512(a, b));
+    }
+    scalar_and_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_andnot_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512((const void *)(dest + i));
+        __m512i b = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dest + i), _mm512_andnot_si512(b, a));
+    }
+    scalar_andnot_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_copy_words(uint64_t *dest, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_si512((void *)(dest + i), _mm512_loadu_si512((const void *)(src + i)));
+    }
+    scalar_copy_words(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_and_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t n) {
+    size_t i = n;
+    while (i >= 8 + 1) {
+        i -= 8;
+        __m512i x = _mm512_and_si512(_mm512_loadu_si512((const void *)(src + i)),
+                                     _mm512_loadu_si512((const void *)(match + i)));
+        __m512i prev = _mm512_and_si512(_mm512_loadu_si512((const void *)(src + i - 1)),
+                                        _mm512_loadu_si512((const void *)(match + i - 1)));
+        __m512i out = _mm512_or_si512(_mm512_slli_epi64(x, 1), _mm512_srli_epi64(prev, 63));
+        _mm512_storeu_si512((void *)(dest + i), out);
+    }
+    if (n > 0) scalar_and_shift_low(dest, src, match, i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_andnot_shift_words(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t n) {
+    size_t i = n;
+    while (i >= 8 + 1) {
+        i -= 8;
+        __m512i x = _mm512_andnot_si512(_mm512_loadu_si512((const void *)(exclude + i)),
+                                        _mm512_loadu_si512((const void *)(src + i)));
+        __m512i prev = _mm512_andnot_si512(_mm512_loadu_si512((const void *)(exclude + i - 1)),
+                                           _mm512_loadu_si512((const void *)(src + i - 1)));
+        __m512i out = _mm512_or_si512(_mm512_slli_epi64(x, 1), _mm512_srli_epi64(prev, 63));
+        _mm512_storeu_si512((void *)(dest + i), out);
+    }
+    if (n > 0) scalar_andnot_shift_low(dest, src, exclude, i);
+}
+
+// Pick the widest kernels the CPU supports, once, before main() runs.
+// FLOWREGEX_SIMD=scalar|sse2|avx2 caps the level (for testing and comparison).
+__attribute__((constructor))
+static void bitmask_kernels_init(void) {
+    __builtin_cpu_init();
+    
+    const char *cap = getenv("FLOWREGEX_SIMD");
+    int max_level = 3;
+    if (cap) {
+        if (strcmp(cap, "scalar") == 0) max_level = 0;
+        else if (strcmp(cap, "sse2") == 0) max_level = 1;
+        else if (strcmp(cap, "avx2") == 0) max_level = 2;
+    }
+    
+    if (max_level == 0) {
+        return;
+    } else if (max_level >= 3 && __builtin_cpu_supports("avx512f")) {
+        bitmask_kernels = (bitmask_kernels_t){
+            "avx512",
+            avx512_or_words,
+            avx512_and_words,
+            avx512_andnot_words,
+            avx512_copy_words,
+            avx512_and_shift_words,
+            avx512_andnot_shift_words,
+            avx2_match_bytes_words,     // byte compares need AVX-512BW
+            avx2_match_string_words,
+            popcnt_count_words,
+            popcnt_count_runs
+        };
+    } else if (max_level >= 2 && __builtin_cpu_supports("avx2")) {
+        bitmask_kernels = (bitmask_kernels_t){
+            "avx2",
+            avx2_or_words,
+            avx2_and_words,
+            avx2_andnot_words,
+            avx2_copy_words,
+            avx2_and_shift_words,
+            avx2_andnot_shift_words,
+            avx2_match_bytes_words,
+            avx2_match_string_words,
+            popcnt_count_words,
+            popcnt_count_runs
+        };
+    } else {
+        bitmask_kernels = (bitmask_kernels_t){
+            "sse2",
+            sse2_or_words,
+            sse2_and_words,
+            sse2_andnot_words,
+            sse2_copy_words,
+            sse2_and_shift_words,
+            sse2_andnot_shift_words,
+            sse2_match_bytes_words,
+            sse2_match_string_words,
+            scalar_count_words,
+            scalar_count_runs
+        };
+    }
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef BITMASK_SIMD_H
+#define BITMASK_SIMD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Alignment of bitmask word storage (one cache line / one AVX-512 vector)
+#define BITMASK_ALIGNMENT 64
+
+// Word-array kernels used by the bitmask primitives.
+// All arrays hold n words; in the shift kernels word i receives the top bit
+// of word i-1, and word 0 receives no carry.
+typedef struct {
+    const char *name;
+    void (*or_words)(uint64_t *dest, const uint64_t *src, size_t n);
+    void (*and_words)(uint64_t *dest, const uint64_t *src, size_t n);
+    void (*andnot_words)(uint64_t *dest, const uint64_t *src, size_t n);
+    void (*copy_words)(uint64_t *dest, const uint64_t *src, size_t n);
+    void (*and_shift_words)(uint64_t *dest, const uint64_t *src, const uint64_t *match, size_t n);
+    void (*andnot_shift_words)(uint64_t *dest, const uint64_t *src, const uint64_t *exclude, size_t n);
+    // For each of count distinct bytes, write the (len + 63) / 64 words of
+    // positions in text holding that byte into out[k]
+    void (*match_bytes_words)(uint64_t *const *out, const unsigned char *bytes, size_t count,
+                              const unsigned char *text, size_t len);
+    // Write the (len + 63) / 64 words of positions in text where the n
+    // bytes of s occur (n >= 1)
+    void (*match_string_words)(uint64_t *out, const unsigned char *text, size_t len,
+                               const unsigned char *s, size_t n);
+    // Number of set bits in the n words
+    size_t (*count_words)(const uint64_t *words, size_t n);
+    // Number of runs starting in the n words, carry being the top bit of
+    // the word before
+    size_t (*count_runs)(const uint64_t *words, size_t n, uint64_t carry);
+} bitmask_kernels_t;
+
+// Kernel table selected once at startup from the CPU features
+extern bitmask_kernels_t bitmask_kernels;
+
+#endif // BITMASK_SIMD_H
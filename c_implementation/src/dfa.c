@@ -0,0 +1,310 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Lazy DFA.
+//
+// The NFA of nfa.c steps a whole set of states per byte, and that set is
+// all it carries from one byte to the next. Each set that turns up is made
+// a DFA state the first time, with its transitions filled in as they are
+// taken (subset construction on demand), so a steady scan costs one table
+// lookup per byte whatever the pattern's loops and alternatives. Bytes that
+// enter the same NFA states share a column of the table.
+//
+// The cache is bounded (FLOWREGEX_DFA_BYTES) and flushed when it fills. A
+// text that keeps flushing it after only a few bytes per state would spend
+// its time building states, so the run gives up and the caller matches with
+// the program instead; the cache remembers that for the same pattern. It
+// lives in the context, keyed by the automaton, so threads matching one
+// pattern with their own contexts do not share it.
+
+#define DFA_UNKNOWN UINT32_MAX
+
+// Fewest bytes a cache fill must last for before another flush, per state
+#define DFA_BYTES_PER_STATE 16
+
+// Independent parts of the text stepped together: each lookup waits for the
+// one before it, so a single pass is bound by load latency (dfa_run spells
+// out the four lanes)
+#define DFA_LANES 4
+
+// Shortest part worth a lane, in bytes
+#define DFA_LANE_MIN 4096
+
+struct regex_dfa {
+    // The automaton the cache belongs to (its defining fields)
+    uint64_t nfa_bytes[256];
+    uint64_t nfa_follow[REGEX_NFA_MAX];
+    uint64_t nfa_first;
+    uint64_t nfa_last;
+    
+    uint8_t columns[256];       // column of each byte
+    unsigned char column_byte[256];     // a byte of each column
+    size_t shift;               // log2 of the row width
+    size_t capacity;            // states the cache holds
+    uint32_t *next;             // per state, per column: row of the next state, or DFA_UNKNOWN
+    uint64_t *sets;             // NFA states of each DFA state
+    uint8_t *accept;            // whether each DFA state ends a match
+    uint32_t *index;            // open addressing over sets, 2 * capacity slots of state + 1 (0: empty)
+    uint32_t *slots;            // index slot of each state
+    size_t count;
+    bool thrashed;              // gave up on this automaton
+};
+
+static uint64_t set_hash(uint64_t set) {
+    set ^= set >> 33;
+    set *= 0xff51afd7ed558ccdULL;
+    set ^= set >> 33;
+    return set;
+}
+
+// Rows are reset as states are added, so a flush only empties the index
+static void dfa_flush(regex_dfa_t *dfa) {
+    for (size_t state = 0; state < dfa->count; state++) dfa->index[dfa->slots[state]] = 0;
+    dfa->count = 0;
+}
+
+static bool dfa_matches(const regex_dfa_t *dfa, const regex_nfa_t *nfa) {
+    return dfa->nfa_first == nfa->first && dfa->nfa_last == nfa->last &&
+           memcmp(dfa->nfa_bytes, nfa->bytes, sizeof(dfa->nfa_bytes)) == 0 &&
+           memcmp(dfa->nfa_follow, nfa->follow, sizeof(dfa->nfa_follow)) == 0;
+}
+
+void dfa_destroy(regex_dfa_t *dfa) {
+    if (dfa) {
+        free(dfa->next);
+        free(dfa->sets);
+        free(dfa->accept);
+        free(dfa->index);
+        free(dfa->slots);
+        free(dfa);
+    }
+}
+
+// The context's DFA cache for nfa, created (or replaced) on first use
+static regex_dfa_t *dfa_for(flowregex_ctx_t *ctx, const regex_nfa_t *nfa) {
+    if (ctx->dfa && dfa_matches(ctx->dfa, nfa)) return ctx->dfa;
+    dfa_destroy(ctx->dfa);
+    ctx->dfa = NULL;
+    
+    regex_dfa_t *dfa = calloc(1, sizeof(regex_dfa_t));
+    if (!dfa) return NULL;
+    memcpy(dfa->nfa_bytes, nfa->bytes, sizeof(dfa->nfa_bytes));
+    memcpy(dfa->nfa_follow, nfa->follow, sizeof(dfa->nfa_follow));
+    dfa->nfa_first = nfa->first;
+    dfa->nfa_last = nfa->last;
+    
+    size_t columns = 0;
+    for (int c = 0; c < 256; c++) {
+        size_t k = 0;
+        while (k < columns && nfa->bytes[dfa->column_byte[k]] != nfa->bytes[c]) k++;
+        if (k == columns) dfa->column_byte[columns++] = (unsigned char)c;
+        dfa->columns[c] = (uint8_t)k;
+    }
+    while ((1u << dfa->shift) < columns) dfa->shift++;
+    
+    dfa->capacity = FLOWREGEX_DFA_BYTES / (sizeof(uint32_t) << dfa->shift);
+    if (dfa->capacity < 2 * DFA_LANES) dfa->capacity = 2 * DFA_LANES;
+    dfa->next = malloc((dfa->capacity << dfa->shift) * sizeof(uint32_t));
+    dfa->sets = malloc(dfa->capacity * sizeof(uint64_t));
+    dfa->accept = malloc(dfa->capacity);
+    dfa->index = calloc(2 * dfa->capacity, sizeof(uint32_t));
+    dfa->slots = malloc(dfa->capacity * sizeof(uint32_t));
+    if (!dfa->next || !dfa->sets || !dfa->accept || !dfa->index || !dfa->slots) {
+        dfa_destroy(dfa);
+        return NULL;
+    }
+    ctx->dfa = dfa;
+    return dfa;
+}
+
+// Row of the state for set, added if new. DFA_UNKNOWN if the cache is full.
+static uint32_t dfa_state(regex_dfa_t *dfa, uint64_t set) {
+    size_t slots = 2 * dfa->capacity;
+    size_t slot = set_hash(set) % slots;
+    while (dfa->index[slot]) {
+        uint32_t state = dfa->index[slot] - 1;
+        if (dfa->sets[state] == set) return state << dfa->shift;
+        slot = slot + 1 == slots ? 0 : slot + 1;
+    }
+    if (dfa->count == dfa->capacity) return DFA_UNKNOWN;
+    
+    uint32_t state = (uint32_t)dfa->count++;
+    dfa->sets[state] = set;
+    dfa->accept[state] = (set & dfa->nfa_last) != 0;
+    dfa->index[slot] = state + 1;
+    dfa->slots[state] = (uint32_t)slot;
+    memset(dfa->next + ((size_t)state << dfa->shift), 0xff, sizeof(uint32_t) << dfa->shift);
+    return state << dfa->shift;
+}
+
+// Take the transition of rows[k] on byte c, which is not cached yet, steps
+// bytes into the run. A full cache is flushed and the count live rows are
+// moved along. False if the cache thrashed.
+static bool dfa_miss(regex_dfa_t *dfa, const regex_nfa_t *nfa, uint32_t *rows, size_t count, size_t k,
+                     unsigned char c, size_t steps, size_t *filled) {
+    uint64_t set = nfa_next(nfa, dfa->sets[rows[k] >> dfa->shift], c);
+    uint32_t to = dfa_state(dfa, set);
+    if (to != DFA_UNKNOWN) {
+        dfa->next[rows[k] + dfa->columns[c]] = to;
+        rows[k] = to;
+        return true;
+    }
+    
+    if (steps - *filled < dfa->capacity * DFA_BYTES_PER_STATE) {
+        dfa->thrashed = true;
+        return false;
+    }
+    *filled = steps;
+    uint64_t sets[DFA_LANES];
+    for (size_t i = 0; i < count; i++) sets[i] = i == k ? set : dfa->sets[rows[i] >> dfa->shift];
+    dfa_flush(dfa);
+    for (size_t i = 0; i < count; i++) rows[i] = dfa_state(dfa, sets[i]);
+    return true;
+}
+
+// Step the lanes at p (lane bytes apart) from rows r0 .. r3 into rows when
+// some transition is not cached. Kept out of dfa_run so the lanes' rows stay
+// in registers there.
+__attribute__((noinline))
+static bool dfa_lanes_miss(regex_dfa_t *dfa, const regex_nfa_t *nfa, const unsigned char *p, size_t lane,
+                           uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3, size_t steps, size_t *filled,
+                           uint32_t *rows) {
+    rows[0] = r0;
+    rows[1] = r1;
+    rows[2] = r2;
+    rows[3] = r3;
+    for (size_t l = 0; l < DFA_LANES; l++) {
+        unsigned char c = p[l * lane];
+        uint32_t to = dfa->next[rows[l] + dfa->columns[c]];
+        if (to != DFA_UNKNOWN) {
+            rows[l] = to;
+        } else if (!dfa_miss(dfa, nfa, rows, DFA_LANES, l, c, steps, filled)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Match ends after the 64 bytes from byte i: bits i + 1 .. i + 64
+static void put_ends(uint64_t *words, size_t i, uint64_t ends) {
+    words[i / 64] |= ends << 1;
+    words[i / 64 + 1] |= ends >> 63;
+}
+
+// output = the end positions of the matches in text, as nfa_run computes
+// them. False if the cache thrashed or could not be allocated: output is
+// then undefined.
+bool dfa_run(const regex_nfa_t *nfa, flowregex_ctx_t *ctx, const char *text, size_t text_len, bitmask_t *output) {
+    if (nfa->nullable) return nfa_run(nfa, text, text_len, output);
+    regex_dfa_t *dfa = dfa_for(ctx, nfa);
+    if (!dfa || dfa->thrashed) return false;
+    bitmask_clear_all(output);
+    uint64_t *words = bitmask_words(output);
+    if (!words) return false;
+    
+    const unsigned char *bytes = (const unsigned char *)text;
+    const uint32_t *next = dfa->next;
+    const uint8_t *accept = dfa->accept;
+    const uint8_t *columns = dfa->columns;
+    const size_t shift = dfa->shift;
+    size_t filled = 0;      // bytes stepped when the cache was last flushed
+    uint64_t set = 0;       // NFA states after the bytes before i
+    size_t i = 0;
+    
+    // Each lane starts with no live state. Where the previous lane really
+    // ended with some, the lane is stepped again from those (on the NFA,
+    // keeping the cache out of it) until both runs agree; a loop nothing
+    // resets can make that the whole lane.
+    size_t lane = text_len / DFA_LANES / 64 * 64;
+    if (lane >= DFA_LANE_MIN) {
+        uint32_t start = dfa_state(dfa, 0);
+        if (start == DFA_UNKNOWN) {
+            dfa_flush(dfa);
+            start = dfa_state(dfa, 0);
+        }
+        uint32_t r0 = start;
+        uint32_t r1 = start;
+        uint32_t r2 = start;
+        uint32_t r3 = start;
+        for (size_t at = 0; at < lane; at += 64) {
+            // The ends of byte b come in at the top and move down one bit per
+            // byte, which keeps variable shifts out of the loop
+            uint64_t e0 = 0;
+            uint64_t e1 = 0;
+            uint64_t e2 = 0;
+            uint64_t e3 = 0;
+            for (const unsigned char *p = bytes + at; p < bytes + at + 64; p++) {
+                uint32_t t0 = next[r0 + columns[p[0]]];
+                uint32_t t1 = next[r1 + columns[p[lane]]];
+                uint32_t t2 = next[r2 + columns[p[2 * lane]]];
+                uint32_t t3 = next[r3 + columns[p[3 * lane]]];
+                if (t0 == DFA_UNKNOWN || t1 == DFA_UNKNOWN || t2 == DFA_UNKNOWN || t3 == DFA_UNKNOWN) {
+                    uint32_t rows[DFA_LANES];
+                    if (!dfa_lanes_miss(dfa, nfa, p, lane, r0, r1, r2, r3, DFA_LANES * (size_t)(p - bytes),
+                                        &filled, rows)) {
+                        return false;
+                    }
+                    t0 = rows[0];
+                    t1 = rows[1];
+                    t2 = rows[2];
+                    t3 = rows[3];
+                }
+                r0 = t0;
+                r1 = t1;
+                r2 = t2;
+                r3 = t3;
+                e0 = (e0 >> 1) | ((uint64_t)accept[r0 >> shift] << 63);
+                e1 = (e1 >> 1) | ((uint64_t)accept[r1 >> shift] << 63);
+                e2 = (e2 >> 1) | ((uint64_t)accept[r2 >> shift] << 63);
+                e3 = (e3 >> 1) | ((uint64_t)accept[r3 >> shift] << 63);
+            }
+            put_ends(words, at, e0);
+            put_ends(words, lane + at, e1);
+            put_ends(words, 2 * lane + at, e2);
+            put_ends(words, 3 * lane + at, e3);
+        }
+        
+        uint32_t rows[DFA_LANES] = {r0, r1, r2, r3};
+        set = dfa->sets[rows[0] >> shift];
+        for (size_t l = 1; l < DFA_LANES; l++) {
+            uint64_t guess = 0;
+            for (i = l * lane; i < (l + 1) * lane && set != guess; i++) {
+                set = nfa_next(nfa, set, bytes[i]);
+                guess = nfa_next(nfa, guess, bytes[i]);
+                if (set & nfa->last) {
+                    bitmask_set(output, i + 1);
+                } else {
+                    bitmask_clear(output, i + 1);
+                }
+            }
+            if (set == guess) set = dfa->sets[rows[l] >> shift];
+        }
+        i = DFA_LANES * lane;
+    }
+    
+    uint32_t row = dfa_state(dfa, set);
+    if (row == DFA_UNKNOWN) {
+        dfa_flush(dfa);
+        row = dfa_state(dfa, set);
+    }
+    for (; i < text_len; i++) {
+        unsigned char c = bytes[i];
+        uint32_t to = next[row + columns[c]];
+        if (to == DFA_UNKNOWN) {
+            if (!dfa_miss(dfa, nfa, &row, 1, 0, c, i, &filled)) return false;
+            to = row;
+        }
+        row = to;
+        if (accept[row >> shift]) bitmask_set(output, i + 1);
+    }
+    return true;
+}
+
+// States cached for nfa in ctx, and whether it thrashed (for the plan)
+size_t dfa_cached(const flowregex_ctx_t *ctx, const regex_nfa_t *nfa, bool *thrashed) {
+    *thrashed = false;
+    if (!ctx->dfa || !dfa_matches(ctx->dfa, nfa)) return 0;
+    *thrashed = ctx->dfa->thrashed;
+    return ctx->dfa->count;
+}
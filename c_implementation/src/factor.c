@@ -0,0 +1,160 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Required-factor matching.
+//
+// A pattern whose top-level concatenation is P F S with a literal F
+// (\d+-ERROR-\w+) only matches where F occurs. The literal runs past the
+// first step are kept as candidate factors (a leading run is the program's
+// own prefix, see program.c). When the planner (plan.c) finds a candidate
+// rare enough to pay off, its occurrences come from the SIMD substring
+// search. Then:
+//   1. an occurrence q is kept if some match of P ends at q. That only
+//      depends on the max_length bytes before q, and P is first cut down to
+//      what decides it (regex_split_steps), so \d+ is checked as \d. Only
+//      windows holding an occurrence are matched.
+//   2. F S runs from the kept occurrences alone (program_run_sparse).
+// Past the substring search, the work follows the occurrences rather than
+// the text. Dense occurrences fall back to the whole program.
+
+// Steps of the top-level concatenation (see regex_split_steps): the byte of
+// each single-byte step, -1 for any other
+static void chain_steps(const regex_element_t *elem, int16_t *bytes, size_t *count) {
+    if (elem->type == REGEX_CONCAT) {
+        chain_steps(elem->left, bytes, count);
+        chain_steps(elem->right, bytes, count);
+        return;
+    }
+    
+    const uint64_t (*sets)[4];
+    size_t length = 1;
+    uint64_t set[4];
+    if (elem->type == REGEX_STRING) {
+        const string_data_t *data = (const string_data_t *)elem->data;
+        sets = (const uint64_t (*)[4])data->sets;
+        length = data->length;
+    } else if (regex_element_byte_set(elem, set)) {
+        sets = (const uint64_t (*)[4])&set;
+    } else {
+        if (bytes) bytes[*count] = -1;
+        (*count)++;
+        return;
+    }
+    
+    for (size_t k = 0; k < length; k++, (*count)++) {
+        if (!bytes) continue;
+        int members = __builtin_popcountll(sets[k][0]) + __builtin_popcountll(sets[k][1]) +
+                      __builtin_popcountll(sets[k][2]) + __builtin_popcountll(sets[k][3]);
+        int16_t byte = 0;
+        while (members == 1 && !((sets[k][byte >> 6] >> (byte & 63)) & 1)) byte++;
+        bytes[*count] = members == 1 ? byte : -1;
+    }
+}
+
+// Compile the factor starting at step at: split a fresh copy of the tree
+// there. A factor whose leading part stays unbounded is not kept.
+static bool factor_compile(flowregex_t *regex, size_t at) {
+    flowregex_error_t error;
+    regex_element_t *tree = parse_regex(regex->pattern, &error);
+    if (tree) tree = regex_optimize(tree);
+    
+    regex_element_t *before, *from;
+    if (!tree || !regex_split_steps(tree, at, &before, &from)) return false;
+    
+    regex_factor_t *factor = &regex->factors[regex->factor_count];
+    factor->before_length = before ? regex_element_max_length(before) : 0;
+    factor->before = NULL;
+    factor->from = NULL;
+    
+    bool ok = true;
+    if (factor->before_length != SIZE_MAX) {
+        factor->before = before ? program_compile(before, &error) : NULL;
+        factor->from = program_compile(from, &error);
+        ok = (!before || factor->before) && factor->from;
+        if (ok) {
+            regex->factor_count++;
+        } else {
+            program_destroy(factor->before);
+            program_destroy(factor->from);
+        }
+    }
+    
+    if (before) before->destroy(before);
+    from->destroy(from);
+    return ok;
+}
+
+// Find the candidate factors of a compiled pattern. False on allocation
+// failure.
+bool factors_compile(flowregex_t *regex) {
+    regex->factor_count = 0;
+    
+    size_t count = 0;
+    chain_steps(regex->root, NULL, &count);
+    int16_t *bytes = malloc(count * sizeof(int16_t));
+    if (!bytes) return false;
+    count = 0;
+    chain_steps(regex->root, bytes, &count);
+    
+    bool ok = true;
+    for (size_t at = 1; ok && at < count && regex->factor_count < REGEX_FACTOR_MAX; at++) {
+        if (bytes[at] >= 0 && bytes[at - 1] < 0) ok = factor_compile(regex, at);
+    }
+    free(bytes);
+    
+    if (!ok) factors_destroy(regex);
+    return ok;
+}
+
+void factors_destroy(flowregex_t *regex) {
+    for (size_t i = 0; i < regex->factor_count; i++) {
+        program_destroy(regex->factors[i].before);
+        program_destroy(regex->factors[i].from);
+    }
+    regex->factor_count = 0;
+}
+
+// Keep the occurrences in starts where a match of factor->before ends. It
+// runs from every position over each window holding some, together with the
+// before_length positions in front of it.
+static bool factor_confirm(const regex_factor_t *factor, flowregex_ctx_t *ctx, bitmask_t *starts) {
+    flowregex_ctx_t *sub = flowregex_ctx_window(ctx);
+    bitmask_t *kept = bitmask_pool_acquire(ctx->pool, starts->size);
+    if (!sub || !kept) {
+        bitmask_pool_release(ctx->pool, kept);
+        return false;
+    }
+    bitmask_clear_all(kept);
+    
+    bool ok = true;
+    size_t p = bitmask_next(starts, 0);
+    while (ok && p < ctx->text_len) {
+        size_t w = p / FLOWREGEX_SPARSE_WINDOW * FLOWREGEX_SPARSE_WINDOW;
+        size_t begin = w > factor->before_length ? (w - factor->before_length) / 64 * 64 : 0;
+        size_t end = ctx->text_len - w > FLOWREGEX_SPARSE_WINDOW ? w + FLOWREGEX_SPARSE_WINDOW : ctx->text_len;
+        ok = flowregex_ctx_bind_text(sub, ctx->text + begin, end - begin) && program_run(factor->before, sub);
+        
+        for (; ok && p < end; p = bitmask_next(starts, p + 1)) {
+            if (bitmask_get(sub->result, p - begin)) ok = bitmask_set(kept, p);
+        }
+    }
+    
+    ok = ok && bitmask_copy_into(starts, kept);
+    bitmask_pool_release(ctx->pool, kept);
+    return ok;
+}
+
+// Match through factor (as planned by flowregex_plan) into ctx->result, or
+// through the whole program when the factor turns out to be common
+bool factors_run(const flowregex_t *regex, flowregex_ctx_t *ctx, const regex_factor_t *factor) {
+    bitmask_t *starts = flowregex_ctx_starts(ctx);
+    if (!starts) return false;
+    const program_t *from = factor->from;
+    size_t found = bitmask_find_string(starts, ctx->text, ctx->text_len, from->prefix, from->prefix_length,
+                                       PROGRAM_SPARSE_BITS);
+    if (found == SIZE_MAX) return program_run(regex->program, ctx);
+    
+    if (found > 0 && factor->before && !factor_confirm(factor, ctx, starts)) return false;
+    return program_run_sparse(from, ctx, starts, ctx->result);
+}
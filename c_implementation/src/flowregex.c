@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 // Match result functions
 match_result_t *match_result_create(void) {
@@ -10,7 +11,7 @@ match_result_t *match_result_create(void) {
     
     result->capacity = 16;
     result->count = 0;
-    result->positions = malloc(result->capacity * sizeof(int));
+    result->positions = malloc(result->capacity * sizeof(size_t));
     
     if (!result->positions) {
         free(result);
@@ -27,13 +28,13 @@ void match_result_destroy(match_result_t *result) {
     }
 }
 
-void match_result_add(match_result_t *result, int position) {
+void match_result_add(match_result_t *result, size_t position) {
     if (!result) return;
     
     // Resize if needed
     if (result->count >= result->capacity) {
         size_t new_capacity = result->capacity * 2;
-        int *new_positions = realloc(result->positions, new_capacity * sizeof(int));
+        size_t *new_positions = realloc(result->positions, new_capacity * sizeof(size_t));
         if (!new_positions) return; // Failed to resize
         
         result->positions = new_positions;
@@ -43,6 +44,39 @@ void match_result_add(match_result_t *result, int position) {
     result->positions[result->count++] = position;
 }
 
+bool match_result_reserve(match_result_t *result, size_t capacity) {
+    if (!result) return false;
+    if (capacity <= result->capacity) return true;
+    
+    size_t *new_positions = realloc(result->positions, capacity * sizeof(size_t));
+    if (!new_positions) return false;
+    
+    result->positions = new_positions;
+    result->capacity = capacity;
+    return true;
+}
+
+// Convert a result bitmask into end positions: popcount sizes the array,
+// then one ctz-driven pass fills it
+static match_result_t *match_result_from_mask(const bitmask_t *mask) {
+    match_result_t *result = match_result_create();
+    if (!result) return NULL;
+    
+    if (!match_result_reserve(result, bitmask_count(mask))) {
+        match_result_destroy(result);
+        return NULL;
+    }
+    
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        result->positions[result->count++] = pos;
+    }
+    
+    return result;
+}
+
 // Main FlowRegex API
 flowregex_t *flowregex_create(const char *pattern, flowregex_error_t *error) {
     if (!pattern || !error) {
@@ -72,6 +106,36 @@ flowregex_t *flowregex_create(const char *pattern, flowregex_error_t *error) {
         return NULL;
     }
     
+    regex->root = regex_optimize(regex->root);
+    if (!regex->root) {
+        free(regex->pattern);
+        free(regex);
+        *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    regex->program = program_compile(regex->root, error);
+    if (!regex->program) {
+        regex->root->destroy(regex->root);
+        free(regex->pattern);
+        free(regex);
+        return NULL;
+    }
+    
+    regex->max_length = regex_element_max_length(regex->root);
+    regex->nfa = nfa_compile(regex->root);
+    regex->dense_cost = plan_dense_cost(regex->program, NULL);
+    
+    if (!factors_compile(regex)) {
+        nfa_destroy(regex->nfa);
+        program_destroy(regex->program);
+        regex->root->destroy(regex->root);
+        free(regex->pattern);
+        free(regex);
+        *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    
     return regex;
 }
 
@@ -81,6 +145,9 @@ void flowregex_destroy(flowregex_t *regex) {
         if (regex->root) {
             regex->root->destroy(regex->root);
         }
+        program_destroy(regex->program);
+        factors_destroy(regex);
+        nfa_destroy(regex->nfa);
         free(regex);
     }
 }
@@ -88,65 +155,178 @@ void flowregex_destroy(flowregex_t *regex) {
 match_result_t *flowregex_match(flowregex_t *regex, const char *text, bool debug) {
     if (!regex || !text) return NULL;
     
-    size_t text_len = strlen(text);
-    if (text_len > FLOWREGEX_MAX_TEXT_LENGTH) {
+    // A context per call keeps the shared regex read-only, so concurrent
+    // calls on one pattern are safe; reuse goes through flowregex_match_ctx
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    if (!ctx) return NULL;
+    
+    ctx->debug = debug;
+    match_result_t *result = flowregex_match_ctx(regex, ctx, text, strlen(text));
+    flowregex_ctx_destroy(ctx);
+    return result;
+}
+
+// Match context
+
+flowregex_ctx_t *flowregex_ctx_create(void) {
+    flowregex_ctx_t *ctx = malloc(sizeof(flowregex_ctx_t));
+    if (!ctx) return NULL;
+    
+    ctx->text = NULL;
+    ctx->text_len = 0;
+    ctx->opt_text = NULL;
+    ctx->initial = NULL;
+    ctx->starts = NULL;
+    ctx->window = NULL;
+    ctx->dfa = NULL;
+    ctx->result = NULL;
+    ctx->slots = NULL;
+    ctx->slot_capacity = 0;
+    ctx->engines = NULL;
+    ctx->engine_capacity = 0;
+    ctx->plan_shares = NULL;
+    ctx->plan_share_capacity = 0;
+    ctx->carry_in = NULL;
+    ctx->carry_out = NULL;
+    ctx->carry_only = false;
+    ctx->no_prefilter = false;
+    ctx->debug = false;
+    memset(&ctx->plan, 0, sizeof(ctx->plan));
+    
+    ctx->pool = bitmask_pool_create(0);
+    if (!ctx->pool) {
+        free(ctx);
         return NULL;
     }
     
-    if (debug) {
-        printf("=== FlowRegex Matching Debug ===\n");
-        printf("Text: '%s'\n", text);
-        printf("Pattern: %s\n", regex->pattern);
-        printf("Initial mask: ");
+    return ctx;
+}
+
+void flowregex_ctx_destroy(flowregex_ctx_t *ctx) {
+    if (ctx) {
+        bitmask_destroy(ctx->initial);
+        bitmask_destroy(ctx->starts);
+        flowregex_ctx_destroy(ctx->window);
+        dfa_destroy(ctx->dfa);
+        bitmask_destroy(ctx->result);
+        bitmask_pool_destroy(ctx->pool);
+        free(ctx->slots);
+        free(ctx->engines);
+        free(ctx->plan_shares);
+        free(ctx);
     }
+}
+
+// Use precomputed match masks for the following matches. The OptimizedText
+// must describe the same text that is passed to flowregex_match_ctx.
+void flowregex_ctx_set_optimized_text(flowregex_ctx_t *ctx, optimized_text_t *opt_text) {
+    if (ctx) ctx->opt_text = opt_text;
+}
+
+// Bind the context to a text, resizing its masks if the length changed
+bool flowregex_ctx_bind_text(flowregex_ctx_t *ctx, const char *text, size_t text_len) {
+    ctx->text = text;
+    ctx->text_len = text_len;
     
-    // Create initial bitmask with all positions set (flow regex starts from every position)
-    bitmask_t *initial_mask = bitmask_create(text_len + 1);
-    if (!initial_mask) return NULL;
+    if (!ctx->initial || ctx->initial->size != text_len + 1) {
+        bitmask_destroy(ctx->initial);
+        bitmask_destroy(ctx->result);
+        bitmask_pool_reset(ctx->pool, text_len + 1);
+        
+        ctx->initial = bitmask_create(text_len + 1);
+        ctx->result = bitmask_create(text_len + 1);
+        if (!ctx->initial || !ctx->result) {
+            bitmask_destroy(ctx->initial);
+            bitmask_destroy(ctx->result);
+            ctx->initial = NULL;
+            ctx->result = NULL;
+            return false;
+        }
+    }
     
-    for (size_t i = 0; i <= text_len; i++) {
-        bitmask_set(initial_mask, i);
+    // Flow regex starts from every position (a carry-only chunk from none)
+    if (ctx->carry_only) {
+        bitmask_clear_all(ctx->initial);
+    } else {
+        bitmask_set_all(ctx->initial);
     }
+    return true;
+}
+
+// Scratch start mask of the bound text's size (contents undefined)
+bitmask_t *flowregex_ctx_starts(flowregex_ctx_t *ctx) {
+    size_t size = ctx->text_len + 1;
+    if (!ctx->starts || ctx->starts->size != size) {
+        bitmask_destroy(ctx->starts);
+        ctx->starts = bitmask_create(size);
+    }
+    return ctx->starts;
+}
+
+// Context for matching windows of the bound text, created on first use
+flowregex_ctx_t *flowregex_ctx_window(flowregex_ctx_t *ctx) {
+    if (!ctx->window) ctx->window = flowregex_ctx_create();
+    return ctx->window;
+}
+
+// Run the pattern over text and return the end-position mask. The mask is
+// owned by ctx and stays valid until the next match with the same context.
+const bitmask_t *flowregex_match_mask(flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len) {
+    if (!regex || !ctx || !text) return NULL;
+    
+    if (!flowregex_plan(regex, ctx, text, text_len, &ctx->plan)) return NULL;
     
-    if (debug) {
+    if (ctx->debug) {
+        printf("=== FlowRegex Matching Debug ===\n");
+        printf("Text: '%.*s'\n", text_len < INT_MAX ? (int)text_len : INT_MAX, text);
+        printf("Pattern: %s\n", regex->pattern);
+        flowregex_plan_print(regex, ctx, &ctx->plan);
+        printf("Initial mask: ");
         #ifdef DEBUG
-        bitmask_print(initial_mask, "");
+        bitmask_print(ctx->initial, "");
         #endif
         printf("\n");
     }
     
-    // Apply the regex
-    bitmask_t *result_mask = regex->root->apply(regex->root, initial_mask, text, debug, NULL);
-    bitmask_destroy(initial_mask);
-    
-    if (!result_mask) return NULL;
+    bool ok = true;
+    switch (ctx->plan.strategy) {
+        case PLAN_DFA:
+            if (dfa_run(regex->nfa, ctx, text, text_len, ctx->result)) break;
+            // The DFA cache thrashed: match with the program instead
+            ctx->plan.strategy = PLAN_DENSE;
+            // fall through
+        case PLAN_DENSE:
+        case PLAN_PREFIX:
+            ctx->no_prefilter = ctx->plan.strategy == PLAN_DENSE;
+            ok = program_run(regex->program, ctx);
+            ctx->no_prefilter = false;
+            break;
+        case PLAN_FACTOR:
+            ok = factors_run(regex, ctx, &regex->factors[ctx->plan.factor]);
+            break;
+        case PLAN_NFA:
+            ok = nfa_run(regex->nfa, text, text_len, ctx->result);
+            break;
+    }
+    if (!ok) return NULL;
     
-    if (debug) {
+    if (ctx->debug) {
         printf("Final result: ");
         #ifdef DEBUG
-        bitmask_print(result_mask, "");
+        bitmask_print(ctx->result, "");
         #endif
         printf("\n=== End Debug ===\n");
     }
     
-    // Convert bitmask to match result
-    match_result_t *match_result = match_result_create();
-    if (!match_result) {
-        bitmask_destroy(result_mask);
-        return NULL;
-    }
-    
-    size_t count;
-    int *positions = bitmask_get_set_positions(result_mask, &count);
-    if (positions) {
-        for (size_t i = 0; i < count; i++) {
-            match_result_add(match_result, positions[i]);
-        }
-        free(positions);
-    }
+    return ctx->result;
+}
+
+match_result_t *flowregex_match_ctx(flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len) {
+    const bitmask_t *result_mask = flowregex_match_mask(regex, ctx, text, text_len);
+    if (!result_mask) return NULL;
     
-    bitmask_destroy(result_mask);
-    return match_result;
+    // Convert bitmask to match result
+    return match_result_from_mask(result_mask);
 }
 
 // Utility functions
@@ -6,15 +6,49 @@
 #include <stddef.h>
 #include "optimized_text.h"
 
-// Maximum text length supported
-#define FLOWREGEX_MAX_TEXT_LENGTH 100000
+// Largest block a stream matches at once; bounds its mask sizes
+#define FLOWREGEX_STREAM_BLOCK 65536
+
+// Text per task of a parallel match; its masks stay cache-resident
+#ifndef FLOWREGEX_PARALLEL_CHUNK
+#define FLOWREGEX_PARALLEL_CHUNK (256 * 1024)
+#endif
+
+// Text per step of a pattern set scan; every pattern runs over a block while
+// it is cache-resident
+#ifndef FLOWREGEX_SET_BLOCK
+#define FLOWREGEX_SET_BLOCK (32 * 1024)
+#endif
+
+// Text per tile of a whole-text match; the program runs over one tile at a
+// time, so its masks stay cache-resident (a multiple of 64)
+#ifndef FLOWREGEX_TILE
+#define FLOWREGEX_TILE (32 * 1024)
+#endif
+
+// Positions per window of a run from sparse starts (a multiple of 64); only
+// windows holding starts, or reached from earlier ones, are matched
+#ifndef FLOWREGEX_SPARSE_WINDOW
+#define FLOWREGEX_SPARSE_WINDOW 4096
+#endif
+
+// Memory of a context's lazy DFA state cache, in bytes: flushed when full
+#ifndef FLOWREGEX_DFA_BYTES
+#define FLOWREGEX_DFA_BYTES (256 * 1024)
+#endif
+
+// Shortest text a match is planned for; shorter ones cost less to match
+// from every position than to estimate (see flowregex_plan)
+#ifndef FLOWREGEX_PLAN_MIN_TEXT
+#define FLOWREGEX_PLAN_MIN_TEXT 4096
+#endif
 
 // Error codes
 typedef enum {
     FLOWREGEX_OK = 0,
     FLOWREGEX_ERROR_PARSE = -1,
     FLOWREGEX_ERROR_MEMORY = -2,
-    FLOWREGEX_ERROR_TEXT_TOO_LONG = -3,
+    FLOWREGEX_ERROR_TEXT_TOO_LONG = -3,     // deprecated: texts have no length limit, never returned
     FLOWREGEX_ERROR_INVALID_PATTERN = -4
 } flowregex_error_t;
 
@@ -23,20 +57,120 @@ struct flowregex;
 struct bitmask;
 struct regex_element;
 
-// BitMask structure for position management
+// Words per block of a dense bitmask; each block has a summary bit
+#define BITMASK_BLOCK_WORDS 64
+
+// How a bitmask stores its positions (see bitmask.c)
+typedef enum {
+    BITMASK_ARRAY,  // sorted positions
+    BITMASK_RUNS,   // sorted, disjoint runs [start, end)
+    BITMASK_DENSE,  // words, with a summary of the blocks that may be nonzero
+    BITMASK_FULL    // every position below size, nothing stored
+} bitmask_kind_t;
+
+// BitMask structure for position management. The representation follows
+// the contents and every function takes any mix of them.
 typedef struct bitmask {
-    uint64_t *bits;
+    uint64_t *bits;         // dense words, NULL until the mask is first dense
     size_t size;
-    size_t capacity;
+    size_t capacity;        // words covering size bits
+    bitmask_kind_t kind;
+    uint64_t *summary;      // one bit per block; clear if the block is zero
+    size_t *items;          // ARRAY positions, or RUNS start/end pairs
+    size_t count;           // positions (ARRAY) or runs (RUNS)
+    size_t room;            // entries allocated in items
 } bitmask_t;
 
+// Free-list pool of equal-sized bitmasks, recycled across elements and
+// across repeated matches on texts of the same length
+typedef struct bitmask_pool {
+    size_t size;            // bit size of every pooled mask
+    bitmask_t **free_list;
+    size_t free_count;
+    size_t free_capacity;
+    size_t allocated;       // masks created by this pool so far
+} bitmask_pool_t;
+
+// Allocation-free iterator over the set bits of a bitmask
+typedef struct {
+    const bitmask_t *mask;
+    size_t word_idx;        // DENSE: current word; ARRAY, RUNS: next item
+    uint64_t word;          // DENSE: bits of the current word not yet returned
+    size_t pos;             // RUNS, FULL: next position of the current run
+    size_t end;             // RUNS, FULL: end of the current run
+} bitmask_iter_t;
+
 // Match result structure
 typedef struct {
-    int *positions;
+    size_t *positions;
     size_t count;
     size_t capacity;
 } match_result_t;
 
+// How a match runs (see plan.c)
+typedef enum {
+    PLAN_DENSE,     // word-parallel from every position
+    PLAN_PREFIX,    // from the occurrences of the literal prefix
+    PLAN_FACTOR,    // from the occurrences of a required factor
+    PLAN_NFA,       // one pass of the bit-parallel NFA (flowregex_t.nfa)
+    PLAN_DFA        // one pass of the lazy DFA built from that NFA
+} plan_strategy_t;
+
+// How one instruction of the planned program runs
+typedef enum {
+    ENGINE_NONE,    // not a step: masks, unions, fixpoint bookkeeping
+    ENGINE_WORD,    // word-parallel over the whole mask
+    ENGINE_SPARSE,  // per live position, from the text
+    ENGINE_NFA      // the subtree's bit-parallel NFA in one pass (OP_NFA)
+} plan_engine_t;
+
+typedef struct {
+    plan_strategy_t strategy;
+    size_t factor;          // index into flowregex_t.factors (PLAN_FACTOR)
+    double share;           // estimated share of the positions the run starts from
+    double cost;            // estimated work per text byte, in relative units
+    double dense_cost;      // the same for PLAN_DENSE
+    bool sampled;           // byte statistics sampled from the text, not from an OptimizedText
+    // Engine of every instruction of the program the strategy runs (NULL
+    // if it runs none), owned by the context and valid until its next plan
+    const struct program *program;
+    plan_engine_t *engines;
+} flowregex_plan_t;
+
+// Lazy DFA state cache (see dfa.c)
+typedef struct regex_dfa regex_dfa_t;
+
+// Match context: everything one evaluation needs besides the pattern.
+// Reusable across flowregex_match_ctx calls (and across patterns); the
+// initial/result masks and the pool are kept while the text length stays
+// the same, so repeated matches run without allocations.
+typedef struct flowregex_ctx {
+    const char *text;
+    size_t text_len;
+    optimized_text_t *opt_text;   // optional precomputed match masks
+    bitmask_pool_t *pool;         // scratch masks
+    bitmask_t *initial;           // all-ones start mask
+    bitmask_t *starts;            // prefiltered start mask (program_t.prefix)
+    struct flowregex_ctx *window; // runs over the windows of sparse starts
+    regex_dfa_t *dfa;             // DFA states of the last pattern matched with PLAN_DFA
+    bitmask_t *result;            // result of the last match
+    bitmask_t **slots;            // program register file (current / owned buffers)
+    size_t slot_capacity;
+    // Chunked evaluation (NULL for a whole text): per carry index (see
+    // program_t.carry_count), whether the output of the previous chunk had
+    // its last bit set, and the same for this chunk, filled by program_run
+    const uint8_t *carry_in;
+    uint8_t *carry_out;
+    bool carry_only;              // start from carry_in alone, not from every position
+    bool no_prefilter;            // start everywhere despite a literal prefix (PLAN_DENSE)
+    bool debug;
+    flowregex_plan_t plan;        // plan of the last flowregex_match_mask
+    plan_engine_t *engines;       // storage of the engines of the last plan
+    size_t engine_capacity;
+    double *plan_shares;          // the planner's per-slot and per-step shares
+    size_t plan_share_capacity;
+} flowregex_ctx_t;
+
 // Regex element types
 typedef enum {
     REGEX_LITERAL,
@@ -46,7 +180,8 @@ typedef enum {
     REGEX_PLUS,
     REGEX_QUESTION,
     REGEX_ANY_CHAR,
-    REGEX_CHAR_CLASS
+    REGEX_CHAR_CLASS,
+    REGEX_STRING
 } regex_element_type_t;
 
 // Base regex element structure
@@ -55,7 +190,7 @@ typedef struct regex_element {
     void *data;
     struct regex_element *left;
     struct regex_element *right;
-    bitmask_t *(*apply)(struct regex_element *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
+    uint64_t hash;      // structural hash: equal subtrees hash equal
     void (*destroy)(struct regex_element *self);
 } regex_element_t;
 
@@ -64,37 +199,269 @@ typedef struct {
     char character;
 } literal_data_t;
 
+// Fused run of single-character steps (literals, classes, '.'), matched in
+// one pass; at most REGEX_STRING_MAX steps
+#define REGEX_STRING_MAX 64
+
+typedef struct {
+    size_t length;
+    uint64_t (*sets)[4];    // bytes consumed by each step
+} string_data_t;
+
 // Character class data
 typedef struct {
-    char *pattern;
+    char *pattern;          // source text, for debug output
     bool negated;
+    uint64_t table[4];      // byte membership: bit b of table[b / 64]
 } char_class_data_t;
 
+// Program opcodes. Operands are mask slots unless noted; slot contents are
+// position sets over the bound text.
+typedef enum {
+    OP_LITERAL_MASK,    // dst = positions holding byte arg
+    OP_CLASS_MASK,      // dst = positions holding a byte of class table arg
+    OP_AND_SHIFT,       // dst = (a & b) << 1
+    OP_CLOSURE,         // dst = single-character closure of a over mask b (arg 1: X+)
+    OP_STRING,          // dst = a after the steps of string b, in one pass
+    OP_OR,              // dst = a | b
+    OP_FIX_BEGIN,       // dst = a (arg 1, X*) or empty (arg 0, X+); frontier b = a
+    OP_FIX_END,         // a &= ~dst; if a is empty fall through, else dst |= a,
+                        // frontier b = a, jump to arg
+    OP_NFA              // if planned, dst = a after the subtree of NFA arg, then
+                        // jump to pc b; otherwise the subtree's own code follows
+} program_op_t;
+
+typedef struct {
+    program_op_t op;
+    uint32_t dst;
+    uint32_t a;
+    uint32_t b;
+    uint32_t arg;
+} program_instr_t;
+
+// Operands of an OP_STRING instruction
+typedef struct {
+    uint32_t *masks;            // mask slot of each step
+    size_t length;
+    size_t carry;               // carry index of the first partial match
+} program_string_t;
+
+// Operands of an OP_NFA instruction
+typedef struct {
+    struct regex_nfa *nfa;      // Glushkov automaton of the subtree
+    size_t carry;               // carry index of its first state
+} program_nfa_t;
+
+// Longest literal prefix kept for the start prefilter
+#define PROGRAM_PREFIX_MAX 16
+
+// Starts are sparse, and worth matching from alone, at up to one per this
+// many positions; denser ones leave hardly any window to skip
+#define PROGRAM_SPARSE_BITS 4096
+
+// Flat, register-allocated form of an element tree. Mask instructions come
+// first; slot_count masks (including input and output) cover one run.
+// Chunked runs carry one bit per consuming instruction, indexed by pc, plus
+// length - 1 per string for its partial matches and one per state of each
+// NFA: carry_count in all.
+typedef struct program {
+    program_instr_t *code;
+    size_t length;
+    size_t capacity;
+    uint64_t (*classes)[4];     // 256-bit byte membership tables
+    size_t class_count;
+    program_string_t *strings;
+    size_t string_count;
+    program_nfa_t *nfas;
+    size_t nfa_count;
+    size_t carry_count;
+    size_t slot_count;
+    uint32_t input_slot;        // bound to the start mask, read-only
+    uint32_t output_slot;       // bound to the context result mask
+    uint32_t *output_slots;     // result slot of every compiled tree ([0] is output_slot)
+    size_t output_count;
+    // Bytes every match of a single tree starts with (prefix_length 0 if
+    // none): runs start only where they occur instead of everywhere
+    unsigned char prefix[PROGRAM_PREFIX_MAX];
+    size_t prefix_length;
+} program_t;
+
+// Most required factors kept per pattern
+#define REGEX_FACTOR_MAX 4
+
+// A literal run of the pattern's top-level concatenation past its first
+// step, which every match contains, and the programs matching around it
+typedef struct {
+    program_t *before;      // where the steps in front of it can end (NULL: anywhere)
+    size_t before_length;   // longest match of before
+    program_t *from;        // the factor and every step after it; its prefix is the factor
+} regex_factor_t;
+
+// Most steps a pattern can have for its bit-parallel NFA
+#define REGEX_NFA_MAX 64
+
+// Glushkov automaton of a small pattern: one state per consuming step,
+// simulated a state word at a time (see nfa.c)
+typedef struct regex_nfa {
+    uint64_t bytes[256];        // states entered on each byte
+    uint64_t first;             // states a match starts in
+    uint64_t last;              // states a match ends in
+    uint64_t shift;             // states followed by the next state
+    uint64_t jump_from;         // states with other followers
+    uint64_t follow[REGEX_NFA_MAX];     // every follower of each state
+    uint64_t (*jumps)[256];     // other followers, by value of a byte of the state word
+    uint8_t jump_groups[REGEX_NFA_MAX / 8];     // which byte, for each table
+    size_t jump_count;
+    size_t states;
+    size_t columns;             // bytes told apart: the width of a DFA row
+    bool plain_shift;           // the shift needs no mask (see nfa_compile)
+    bool nullable;
+} regex_nfa_t;
+
 // Main FlowRegex structure
 typedef struct flowregex {
     char *pattern;
     regex_element_t *root;
+    program_t *program;     // compiled form of root, used for matching
+    size_t max_length;      // longest match span, SIZE_MAX if unbounded
+    regex_factor_t factors[REGEX_FACTOR_MAX];
+    size_t factor_count;
+    regex_nfa_t *nfa;       // NULL if the pattern has too many steps
+    double dense_cost;      // planned cost of PLAN_DENSE without an OptimizedText
 } flowregex_t;
 
-// BitMask functions
+// Patterns compiled together and matched in one scan
+typedef struct flowregex_set {
+    size_t count;
+    char **patterns;
+    regex_element_t **roots;
+    program_t *program;             // one output per pattern, shared text masks
+    flowregex_ctx_t *ctx;           // sized for one block
+    bitmask_t **outputs;            // per pattern: end positions within the block
+    uint8_t *carry_in;              // per carry index, from the previous block
+    uint8_t *carry_out;
+} flowregex_set_t;
+
+// Called with each match end position (offset from the start of the stream)
+typedef void (*flowregex_match_fn)(size_t end, void *user_data);
+
+// Streaming matcher: the text arrives in chunks of any size
+typedef struct flowregex_stream {
+    flowregex_t *regex;
+    flowregex_ctx_t *ctx;           // sized for one block
+    uint8_t *carry_in;              // per carry index, from the previous block
+    uint8_t *carry_out;
+    size_t offset;                  // stream position of the current block
+    bool started;                   // a block was matched (position offset reported)
+    flowregex_match_fn on_match;
+    void *user_data;
+} flowregex_stream_t;
+
+// BitMask functions. Those that may allocate return false when memory ran
+// out; the mask is then unchanged or partly updated.
 bitmask_t *bitmask_create(size_t size);
 void bitmask_destroy(bitmask_t *mask);
-void bitmask_set(bitmask_t *mask, size_t pos);
-void bitmask_clear(bitmask_t *mask, size_t pos);
+bool bitmask_set(bitmask_t *mask, size_t pos);
+bool bitmask_clear(bitmask_t *mask, size_t pos);
 bool bitmask_get(const bitmask_t *mask, size_t pos);
-void bitmask_or(bitmask_t *dest, const bitmask_t *src);
-void bitmask_and(bitmask_t *dest, const bitmask_t *src);
+bool bitmask_set_range(bitmask_t *mask, size_t from, size_t to);
+bool bitmask_or(bitmask_t *dest, const bitmask_t *src);
+bool bitmask_and(bitmask_t *dest, const bitmask_t *src);
+bool bitmask_andnot(bitmask_t *dest, const bitmask_t *src);
+bool bitmask_not(bitmask_t *mask);
+bool bitmask_any(const bitmask_t *mask);
 bitmask_t *bitmask_copy(const bitmask_t *src);
+bool bitmask_copy_into(bitmask_t *dest, const bitmask_t *src);
+bool bitmask_copy_range(bitmask_t *dest, const bitmask_t *src, size_t from);
+bool bitmask_or_at(bitmask_t *dest, const bitmask_t *src, size_t offset);
+void bitmask_set_all(bitmask_t *mask);
+bool bitmask_and_shift(bitmask_t *dest, const bitmask_t *src, const bitmask_t *match);
+bool bitmask_andnot_shift(bitmask_t *dest, const bitmask_t *src, const bitmask_t *exclude);
+bool bitmask_closure(bitmask_t *dest, const bitmask_t *src, const bitmask_t *match, bool at_least_one);
+bool bitmask_and_shift_string(bitmask_t *dest, const bitmask_t *src, const bitmask_t *const *masks, size_t count);
+bool bitmask_match_bytes(bitmask_t *const *masks, const unsigned char *bytes, size_t count,
+                         const char *text, size_t text_len);
+size_t bitmask_find_string(bitmask_t *dest, const char *text, size_t text_len,
+                           const unsigned char *s, size_t n, size_t sparse);
+void bitmask_trim(bitmask_t *mask);
+const char *bitmask_simd_level(void);
 void bitmask_clear_all(bitmask_t *mask);
-int *bitmask_get_set_positions(const bitmask_t *mask, size_t *count);
+size_t *bitmask_get_set_positions(const bitmask_t *mask, size_t *count);
+size_t bitmask_count(const bitmask_t *mask);
+size_t bitmask_next(const bitmask_t *mask, size_t pos);
+uint64_t *bitmask_words(bitmask_t *mask);
+bool bitmask_sparse(bitmask_t *mask);
+void bitmask_optimize(bitmask_t *mask);
+// BitMask pool functions (a NULL pool falls back to create/destroy)
+bitmask_pool_t *bitmask_pool_create(size_t size);
+void bitmask_pool_destroy(bitmask_pool_t *pool);
+void bitmask_pool_reset(bitmask_pool_t *pool, size_t size);
+bitmask_t *bitmask_pool_acquire(bitmask_pool_t *pool, size_t size);
+bitmask_t *bitmask_pool_copy(bitmask_pool_t *pool, const bitmask_t *src);
+void bitmask_pool_release(bitmask_pool_t *pool, bitmask_t *mask);
 #ifdef DEBUG
 void bitmask_print(const bitmask_t *mask, const char *label);
 #endif
 
+// Whether block b of a dense mask may hold set bits
+static inline bool bitmask_block_live(const bitmask_t *mask, size_t b) {
+    return (mask->summary[b / 64] >> (b % 64)) & 1;
+}
+
+// Set-bit iteration: one ctz per set bit in a dense mask, zero words and
+// blocks skipped; positions and runs are walked directly
+static inline void bitmask_iter_init(bitmask_iter_t *it, const bitmask_t *mask) {
+    it->mask = mask;
+    it->word_idx = 0;
+    it->word = 0;
+    it->pos = 0;
+    it->end = mask->kind == BITMASK_FULL ? mask->size : 0;
+    if (mask->kind == BITMASK_DENSE && mask->capacity > 0) {
+        if (bitmask_block_live(mask, 0)) {
+            it->word = mask->bits[0];
+        } else {
+            it->word_idx = BITMASK_BLOCK_WORDS - 1;
+        }
+    }
+}
+
+static inline bool bitmask_iter_next(bitmask_iter_t *it, size_t *pos) {
+    const bitmask_t *mask = it->mask;
+    switch (mask->kind) {
+        case BITMASK_DENSE:
+            while (it->word == 0) {
+                if (++it->word_idx >= mask->capacity) return false;
+                if (it->word_idx % BITMASK_BLOCK_WORDS == 0 &&
+                    !bitmask_block_live(mask, it->word_idx / BITMASK_BLOCK_WORDS)) {
+                    it->word_idx += BITMASK_BLOCK_WORDS - 1;
+                    continue;
+                }
+                it->word = mask->bits[it->word_idx];
+            }
+            *pos = it->word_idx * 64 + (size_t)__builtin_ctzll(it->word);
+            it->word &= it->word - 1;
+            return true;
+        case BITMASK_ARRAY:
+            if (it->word_idx >= mask->count) return false;
+            *pos = mask->items[it->word_idx++];
+            return true;
+        default:
+            while (it->pos >= it->end) {
+                if (mask->kind == BITMASK_FULL || it->word_idx >= mask->count) return false;
+                it->pos = mask->items[2 * it->word_idx];
+                it->end = mask->items[2 * it->word_idx + 1];
+                it->word_idx++;
+            }
+            *pos = it->pos++;
+            return true;
+    }
+}
+
 // Match result functions
 match_result_t *match_result_create(void);
 void match_result_destroy(match_result_t *result);
-void match_result_add(match_result_t *result, int position);
+void match_result_add(match_result_t *result, size_t position);
+bool match_result_reserve(match_result_t *result, size_t capacity);
 
 // Regex element constructors
 regex_element_t *literal_create(char c);
@@ -105,6 +472,55 @@ regex_element_t *plus_create(regex_element_t *inner);
 regex_element_t *question_create(regex_element_t *inner);
 regex_element_t *any_char_create(void);
 regex_element_t *char_class_create(const char *pattern);
+regex_element_t *char_class_create_table(const uint64_t table[4], const char *pattern, bool negated);
+regex_element_t *string_create(const uint64_t (*sets)[4], size_t length);
+bool char_class_add_named(uint64_t table[4], char name);
+bool char_class_compile(const char *body, size_t len, uint64_t table[4], bool *negated);
+
+// Byte membership of a literal, any-char or char-class element
+bool regex_element_byte_set(const regex_element_t *elem, uint64_t set[4]);
+size_t regex_element_max_length(const regex_element_t *elem);
+bool regex_element_equal(const regex_element_t *a, const regex_element_t *b);
+void regex_element_rehash(regex_element_t *elem);
+
+// Algebraic rewrites between parsing and compilation
+regex_element_t *regex_optimize(regex_element_t *root);
+bool regex_split_steps(regex_element_t *root, size_t at, regex_element_t **before, regex_element_t **from);
+
+// Program functions
+program_t *program_compile(const regex_element_t *root, flowregex_error_t *error);
+void program_destroy(program_t *program);
+program_t *program_compile_set(regex_element_t *const *roots, size_t count, flowregex_error_t *error);
+bool program_run(const program_t *program, flowregex_ctx_t *ctx);
+bool program_run_outputs(const program_t *program, flowregex_ctx_t *ctx, bitmask_t *const *outputs);
+bool program_run_sparse(const program_t *program, flowregex_ctx_t *ctx, const bitmask_t *starts, bitmask_t *output);
+void program_print(const program_t *program);
+const char *program_op_name(program_op_t op);
+void program_index_bytes(const program_t *program, uint64_t set[4]);
+
+// Required factor functions
+bool factors_compile(flowregex_t *regex);
+void factors_destroy(flowregex_t *regex);
+bool factors_run(const flowregex_t *regex, flowregex_ctx_t *ctx, const regex_factor_t *factor);
+
+// Bit-parallel NFA functions
+regex_nfa_t *nfa_compile(const regex_element_t *root);
+void nfa_destroy(regex_nfa_t *nfa);
+uint64_t nfa_next(const regex_nfa_t *nfa, uint64_t d, unsigned char c);
+bool nfa_run(const regex_nfa_t *nfa, const char *text, size_t text_len, bitmask_t *output);
+bool nfa_run_from(const regex_nfa_t *nfa, const char *text, size_t text_len, bitmask_t *input,
+                  uint64_t *state, bitmask_t *output);
+
+// Lazy DFA functions
+bool dfa_run(const regex_nfa_t *nfa, flowregex_ctx_t *ctx, const char *text, size_t text_len, bitmask_t *output);
+size_t dfa_cached(const flowregex_ctx_t *ctx, const regex_nfa_t *nfa, bool *thrashed);
+void dfa_destroy(regex_dfa_t *dfa);
+
+// Planner functions
+double plan_dense_cost(const program_t *program, const optimized_text_t *index);
+bool flowregex_plan(const flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len,
+                    flowregex_plan_t *plan);
+void flowregex_plan_print(const flowregex_t *regex, const flowregex_ctx_t *ctx, const flowregex_plan_t *plan);
 
 // Parser functions
 regex_element_t *parse_regex(const char *pattern, flowregex_error_t *error);
@@ -114,6 +530,31 @@ flowregex_t *flowregex_create(const char *pattern, flowregex_error_t *error);
 void flowregex_destroy(flowregex_t *regex);
 match_result_t *flowregex_match(flowregex_t *regex, const char *text, bool debug);
 
+// Match context API
+flowregex_ctx_t *flowregex_ctx_create(void);
+void flowregex_ctx_destroy(flowregex_ctx_t *ctx);
+void flowregex_ctx_set_optimized_text(flowregex_ctx_t *ctx, optimized_text_t *opt_text);
+bool flowregex_ctx_bind_text(flowregex_ctx_t *ctx, const char *text, size_t text_len);
+bitmask_t *flowregex_ctx_starts(flowregex_ctx_t *ctx);
+flowregex_ctx_t *flowregex_ctx_window(flowregex_ctx_t *ctx);
+const bitmask_t *flowregex_match_mask(flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len);
+match_result_t *flowregex_match_ctx(flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len);
+
+// Parallel matching (nthreads 0: one per online CPU)
+match_result_t *flowregex_match_parallel(flowregex_t *regex, const char *text, size_t nthreads);
+
+// Pattern set API
+flowregex_set_t *flowregex_set_create(const char *const *patterns, size_t count, flowregex_error_t *error);
+void flowregex_set_destroy(flowregex_set_t *set);
+match_result_t **flowregex_set_match(flowregex_set_t *set, const char *text, size_t text_len);
+void flowregex_set_results_destroy(match_result_t **results, size_t count);
+bool flowregex_set_matched(flowregex_set_t *set, const char *text, size_t text_len, uint64_t *matched);
+
+// Streaming API
+flowregex_stream_t *flowregex_stream_open(flowregex_t *regex, flowregex_match_fn on_match, void *user_data);
+bool flowregex_stream_feed(flowregex_stream_t *stream, const char *chunk, size_t len);
+bool flowregex_stream_finish(flowregex_stream_t *stream);
+
 // Utility functions
 void flowregex_print_error(flowregex_error_t error);
 const char *flowregex_error_string(flowregex_error_t error);
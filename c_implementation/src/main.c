@@ -7,6 +7,7 @@ void print_usage(const char *program_name) {
     printf("Usage: %s [options] <pattern> <text>\n", program_name);
     printf("Options:\n");
     printf("  -d, --debug    Enable debug output\n");
+    printf("  -p, --plan     Print how the match was planned\n");
     printf("  -h, --help     Show this help message\n");
     printf("\nExamples:\n");
     printf("  %s \"abc\" \"xabcyz\"        # Basic literal matching\n", program_name);
@@ -14,6 +15,7 @@ void print_usage(const char *program_name) {
     printf("  %s \"a|b\" \"cat\"           # Alternation\n", program_name);
     printf("  %s \"\\\\d+\" \"abc123def\"    # Character classes\n", program_name);
     printf("  %s -d \"a+\" \"aaa\"         # Debug mode\n", program_name);
+    printf("  %s -p \"x\\\\d+y\" \"x12y\"      # Match plan\n", program_name);
 }
 
 void print_match_result(match_result_t *result) {
@@ -25,13 +27,14 @@ void print_match_result(match_result_t *result) {
     printf("Match end positions: [");
     for (size_t i = 0; i < result->count; i++) {
         if (i > 0) printf(", ");
-        printf("%d", result->positions[i]);
+        printf("%zu", result->positions[i]);
     }
     printf("]\n");
 }
 
 int main(int argc, char *argv[]) {
     bool debug = false;
+    bool plan = false;
     const char *pattern = NULL;
     const char *text = NULL;
     
@@ -39,6 +42,8 @@ int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
             debug = true;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--plan") == 0) {
+            plan = true;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
             return 0;
@@ -72,20 +77,30 @@ int main(int argc, char *argv[]) {
     printf("Text: %s\n", text);
     printf("\n");
     
-    // Perform matching
-    match_result_t *result = flowregex_match(regex, text, debug);
+    // Perform matching in our own context so the plan can be printed after
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    match_result_t *result = NULL;
+    if (ctx) {
+        ctx->debug = debug;
+        result = flowregex_match_ctx(regex, ctx, text, strlen(text));
+    }
     
     if (!result) {
         fprintf(stderr, "Matching failed.\n");
+        flowregex_ctx_destroy(ctx);
         flowregex_destroy(regex);
         return 1;
     }
     
     // Print results
     print_match_result(result);
+    if (plan) {
+        flowregex_plan_print(regex, ctx, &ctx->plan);
+    }
     
     // Cleanup
     match_result_destroy(result);
+    flowregex_ctx_destroy(ctx);
     flowregex_destroy(regex);
     
     return 0;
@@ -0,0 +1,296 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Bit-parallel NFA.
+//
+// A pattern with at most REGEX_NFA_MAX consuming steps (each literal, class
+// or '.', each step of a fused string) is also compiled into its Glushkov
+// automaton: one state per step, entered on that step's bytes, with no
+// epsilon moves. The text is then read once with the set of live states in
+// one word:
+//
+//   d = (follow(d) | first) & bytes[c]
+//
+// Adding first at every byte starts a match at every position, and each
+// byte after which d meets last is a match end. Most follow edges lead from
+// a step to the next one and are taken together by a shift; only the rest
+// (loops, alternatives) need table lookups, one per byte of the state word
+// that has such an edge, and only while a state that has one is live. No
+// mask is built besides the output. The planner (plan.c) picks this pass
+// for whole texts when it beats building the pattern's class masks.
+
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+    bool nullable;
+} glushkov_t;
+
+// States of the steps of elem from *count on, with their follow edges.
+// False if the pattern has more steps than fit.
+static bool glushkov(const regex_element_t *elem, regex_nfa_t *nfa, uint64_t *follow, size_t *count,
+                     glushkov_t *out) {
+    glushkov_t left;
+    glushkov_t right;
+    uint64_t set[4];
+    
+    switch (elem->type) {
+        case REGEX_CONCAT:
+            if (!glushkov(elem->left, nfa, follow, count, &left)) return false;
+            if (!glushkov(elem->right, nfa, follow, count, &right)) return false;
+            for (size_t p = 0; p < *count; p++) {
+                if ((left.last >> p) & 1) follow[p] |= right.first;
+            }
+            out->first = left.first | (left.nullable ? right.first : 0);
+            out->last = right.last | (right.nullable ? left.last : 0);
+            out->nullable = left.nullable && right.nullable;
+            return true;
+        case REGEX_ALTERNATION:
+            if (!glushkov(elem->left, nfa, follow, count, &left)) return false;
+            if (!glushkov(elem->right, nfa, follow, count, &right)) return false;
+            out->first = left.first | right.first;
+            out->last = left.last | right.last;
+            out->nullable = left.nullable || right.nullable;
+            return true;
+        case REGEX_KLEENE_STAR:
+        case REGEX_PLUS:
+        case REGEX_QUESTION:
+            if (!glushkov(elem->left, nfa, follow, count, out)) return false;
+            if (elem->type != REGEX_QUESTION) {
+                for (size_t p = 0; p < *count; p++) {
+                    if ((out->last >> p) & 1) follow[p] |= out->first;
+                }
+            }
+            if (elem->type != REGEX_PLUS) out->nullable = true;
+            return true;
+        case REGEX_STRING: {
+            const string_data_t *data = (const string_data_t *)elem->data;
+            if (data->length == 0 || data->length > REGEX_NFA_MAX - *count) return false;
+            
+            size_t from = *count;
+            for (size_t k = 0; k < data->length; k++) {
+                size_t p = (*count)++;
+                for (int c = 0; c < 256; c++) {
+                    if ((data->sets[k][c >> 6] >> (c & 63)) & 1) nfa->bytes[c] |= 1ULL << p;
+                }
+                if (k + 1 < data->length) follow[p] |= 1ULL << (p + 1);
+            }
+            out->first = 1ULL << from;
+            out->last = 1ULL << (*count - 1);
+            out->nullable = false;
+            return true;
+        }
+        default: {
+            if (*count == REGEX_NFA_MAX || !regex_element_byte_set(elem, set)) return false;
+            
+            size_t p = (*count)++;
+            for (int c = 0; c < 256; c++) {
+                if ((set[c >> 6] >> (c & 63)) & 1) nfa->bytes[c] |= 1ULL << p;
+            }
+            out->first = 1ULL << p;
+            out->last = 1ULL << p;
+            out->nullable = false;
+            return true;
+        }
+    }
+}
+
+// Compile root into its NFA, or NULL if it has too many steps (or on
+// allocation failure; matching then just runs the program)
+regex_nfa_t *nfa_compile(const regex_element_t *root) {
+    regex_nfa_t *nfa = calloc(1, sizeof(regex_nfa_t));
+    uint64_t follow[REGEX_NFA_MAX] = {0};
+    glushkov_t g;
+    if (!nfa || !root || !glushkov(root, nfa, follow, &nfa->states, &g)) {
+        free(nfa);
+        return NULL;
+    }
+    nfa->first = g.first;
+    nfa->last = g.last;
+    nfa->nullable = g.nullable;
+    memcpy(nfa->follow, follow, sizeof(follow));
+    
+    // Edges to the next state go by shift, the rest by table
+    for (size_t p = 0; p + 1 < nfa->states; p++) {
+        if ((follow[p] >> (p + 1)) & 1) {
+            nfa->shift |= 1ULL << p;
+            follow[p] &= ~(1ULL << (p + 1));
+        }
+    }
+    // Without the shift mask, a state whose previous one does not lead to it
+    // is entered wrongly unless first enters it anyway
+    uint64_t unreached = ~(nfa->shift << 1) & (nfa->states == 64 ? ~0ULL : (1ULL << nfa->states) - 1);
+    nfa->plain_shift = (unreached & ~nfa->first) == 0;
+    
+    uint64_t seen[256];
+    for (int c = 0; c < 256; c++) {
+        size_t k = 0;
+        while (k < nfa->columns && seen[k] != nfa->bytes[c]) k++;
+        if (k == nfa->columns) seen[nfa->columns++] = nfa->bytes[c];
+    }
+    
+    uint8_t groups[REGEX_NFA_MAX / 8];
+    for (size_t k = 0; k * 8 < nfa->states; k++) {
+        bool jumps = false;
+        for (size_t b = 0; b < 8; b++) jumps |= follow[k * 8 + b] != 0;
+        if (jumps) groups[nfa->jump_count++] = (uint8_t)k;
+    }
+    for (size_t p = 0; p < nfa->states; p++) {
+        if (follow[p]) nfa->jump_from |= 1ULL << p;
+    }
+    if (nfa->jump_count > 0) {
+        nfa->jumps = malloc(nfa->jump_count * sizeof(*nfa->jumps));
+        if (!nfa->jumps) {
+            free(nfa);
+            return NULL;
+        }
+    }
+    for (size_t j = 0; j < nfa->jump_count; j++) {
+        size_t k = groups[j];
+        nfa->jump_groups[j] = (uint8_t)k;
+        for (size_t v = 0; v < 256; v++) {
+            uint64_t to = 0;
+            for (size_t b = 0; b < 8; b++) {
+                if ((v >> b) & 1) to |= follow[k * 8 + b];
+            }
+            nfa->jumps[j][v] = to;
+        }
+    }
+    return nfa;
+}
+
+void nfa_destroy(regex_nfa_t *nfa) {
+    if (nfa) {
+        free(nfa->jumps);
+        free(nfa);
+    }
+}
+
+// States live after byte c when states d were live before it
+uint64_t nfa_next(const regex_nfa_t *nfa, uint64_t d, unsigned char c) {
+    uint64_t next = ((d & nfa->shift) << 1) | nfa->first;
+    for (size_t j = 0; j < nfa->jump_count; j++) {
+        next |= nfa->jumps[j][(d >> (nfa->jump_groups[j] * 8)) & 0xff];
+    }
+    return next & nfa->bytes[c];
+}
+
+// output = the end positions of the matches in text (output has text_len + 1
+// bits), starting from every position. False if memory ran out.
+bool nfa_run(const regex_nfa_t *nfa, const char *text, size_t text_len, bitmask_t *output) {
+    if (nfa->nullable) {
+        // The empty match ends everywhere
+        bitmask_set_all(output);
+        return true;
+    }
+    
+    bitmask_clear_all(output);
+    uint64_t *words = bitmask_words(output);
+    if (!words) return false;
+    
+    const unsigned char *bytes = (const unsigned char *)text;
+    const uint64_t first = nfa->first;
+    const uint64_t last = nfa->last;
+    const uint64_t shift = nfa->plain_shift ? ~0ULL : nfa->shift;   // see nfa_compile
+    const uint64_t jump_from = nfa->jump_from;
+    uint64_t d = 0;
+    
+    // Position 64 * w + b ends a match if d meets last after the byte before it
+    for (size_t w = 0; w < output->capacity; w++) {
+        size_t base = w * 64;
+        size_t end = text_len + 1 - base < 64 ? text_len + 1 - base : 64;
+        uint64_t word = 0;
+        for (size_t b = w == 0 ? 1 : 0; b < end; b++) {
+            uint64_t next = ((d & shift) << 1) | first;
+            if (d & jump_from) {
+                for (size_t j = 0; j < nfa->jump_count; j++) {
+                    next |= nfa->jumps[j][(d >> (nfa->jump_groups[j] * 8)) & 0xff];
+                }
+            }
+            d = next & nfa->bytes[bytes[base + b - 1]];
+            word |= (uint64_t)((d & last) != 0) << b;
+        }
+        words[w] = word;
+    }
+    return true;
+}
+
+// States following d, before the next byte's mask
+static inline uint64_t nfa_follow(const regex_nfa_t *nfa, uint64_t d, uint64_t shift) {
+    uint64_t next = (d & shift) << 1;
+    if (d & nfa->jump_from) {
+        for (size_t j = 0; j < nfa->jump_count; j++) {
+            next |= nfa->jumps[j][(d >> (nfa->jump_groups[j] * 8)) & 0xff];
+        }
+    }
+    return next;
+}
+
+// output = the end positions of the matches in text that start at the
+// positions of input (a subtree of a larger pattern, see OP_NFA):
+//
+//   d = (follow(d) | (input has p ? first : 0)) & bytes[c]
+//
+// *state holds the states live at position 0 (those carried from the chunk
+// before, 0 for none) and receives those live at text_len. Dense input is
+// read a word at a time (and left dense); from sparse input the pass jumps
+// to the next input position while no state is live, so the work follows
+// the live positions. False if memory ran out.
+bool nfa_run_from(const regex_nfa_t *nfa, const char *text, size_t text_len, bitmask_t *input,
+                  uint64_t *state, bitmask_t *output) {
+    const unsigned char *bytes = (const unsigned char *)text;
+    const uint64_t first = nfa->first;
+    const uint64_t last = nfa->last;
+    const uint64_t shift = nfa->shift;     // first is not entered everywhere: see nfa_compile
+    uint64_t d = *state;
+    
+    bitmask_clear_all(output);
+    uint64_t *words = bitmask_words(output);
+    if (!words) return false;
+    // Ends gather in word, flushed to words[w] when a pass moves past it
+    size_t w = 0;
+    uint64_t word = (uint64_t)((d & last) != 0);
+    
+    if (bitmask_count(input) * 64 > input->size) {
+        const uint64_t *starts = bitmask_words(input);
+        if (!starts) return false;
+        for (size_t p = 0; p < text_len; p++) {
+            uint64_t next = nfa_follow(nfa, d, shift) | (first & -((starts[p >> 6] >> (p & 63)) & 1));
+            d = next & nfa->bytes[bytes[p]];
+            if ((p + 1) >> 6 != w) {
+                words[w] = word;
+                w = (p + 1) >> 6;
+                word = 0;
+            }
+            word |= (uint64_t)((d & last) != 0) << ((p + 1) & 63);
+        }
+    } else {
+        bitmask_iter_t it;
+        size_t start = SIZE_MAX;
+        bitmask_iter_init(&it, input);
+        bool starting = bitmask_iter_next(&it, &start);
+        for (size_t p = 0; p < text_len; p++) {
+            if (!d) {
+                if (!starting || start >= text_len) break;
+                p = start;
+            }
+            uint64_t next = nfa_follow(nfa, d, shift);
+            if (starting && start == p) {
+                next |= first;
+                starting = bitmask_iter_next(&it, &start);
+            }
+            d = next & nfa->bytes[bytes[p]];
+            if ((p + 1) >> 6 != w) {
+                words[w] |= word;
+                w = (p + 1) >> 6;
+                word = 0;
+            }
+            word |= (uint64_t)((d & last) != 0) << ((p + 1) & 63);
+        }
+    }
+    words[w] |= word;
+    *state = d;
+    
+    // The empty match ends where it starts
+    return !nfa->nullable || bitmask_or(output, input);
+}
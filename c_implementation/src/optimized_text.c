@@ -6,60 +6,95 @@
 
 // OptimizedText実装
 
-optimized_text_t *optimized_text_create(const char *text, const char *alphabets) {
-    if (!text || !alphabets) return NULL;
-    
-    optimized_text_t *opt_text = malloc(sizeof(optimized_text_t));
+static bool byte_set_has(const uint64_t set[4], unsigned char c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+// テキストをコピーし、setのバイトを索引対象（未構築）として登録
+static optimized_text_t *optimized_text_new(const char *text, size_t text_len, const uint64_t set[4]) {
+    optimized_text_t *opt_text = calloc(1, sizeof(optimized_text_t));
     if (!opt_text) return NULL;
     
-    // テキストをコピー
-    opt_text->text_length = strlen(text);
-    opt_text->text = strdup(text);
-    if (!opt_text->text) {
-        free(opt_text);
+    opt_text->text_length = text_len;
+    opt_text->text = malloc(text_len + 1);
+    opt_text->precomputed_chars = malloc(257);
+    opt_text->match_masks = calloc(256, sizeof(struct bitmask*));
+    if (!opt_text->text || !opt_text->precomputed_chars || !opt_text->match_masks) {
+        optimized_text_destroy(opt_text);
         return NULL;
     }
+    memcpy(opt_text->text, text, text_len);
+    opt_text->text[text_len] = '\0';
     
-    // 事前計算する文字を設定
-    opt_text->precomputed_count = strlen(alphabets);
-    opt_text->precomputed_chars = strdup(alphabets);
-    if (!opt_text->precomputed_chars) {
-        free(opt_text->text);
-        free(opt_text);
-        return NULL;
+    for (int c = 0; c < 256; c++) {
+        if (byte_set_has(set, (unsigned char)c)) {
+            opt_text->precomputed_chars[opt_text->precomputed_count++] = (char)c;
+        }
     }
+    opt_text->precomputed_chars[opt_text->precomputed_count] = '\0';
+    memcpy(opt_text->pending, set, sizeof(opt_text->pending));
     
-    // MatchMask配列を初期化
-    opt_text->match_masks = calloc(256, sizeof(struct bitmask*));
-    if (!opt_text->match_masks) {
-        free(opt_text->precomputed_chars);
-        free(opt_text->text);
-        free(opt_text);
-        return NULL;
-    }
+    return opt_text;
+}
+
+// 未構築の索引対象バイトのMatchMaskを、テキスト1パスでまとめて構築
+static bool optimized_text_build_pending(optimized_text_t *opt_text) {
+    unsigned char bytes[256];
+    struct bitmask *masks[256];
+    size_t count = 0;
     
-    // 各文字のMatchMaskを事前計算
-    for (size_t i = 0; i < opt_text->precomputed_count; i++) {
-        char c = alphabets[i];
-        unsigned char idx = (unsigned char)c;
+    for (int c = 0; c < 256; c++) {
+        if (!byte_set_has(opt_text->pending, (unsigned char)c)) continue;
         
-        opt_text->match_masks[idx] = bitmask_create(opt_text->text_length + 1);
-        if (!opt_text->match_masks[idx]) {
-            optimized_text_destroy(opt_text);
-            return NULL;
-        }
-        
-        // テキスト中の文字cの位置をマーク
-        for (size_t pos = 0; pos < opt_text->text_length; pos++) {
-            if (text[pos] == c) {
-                bitmask_set(opt_text->match_masks[idx], pos);
-            }
+        masks[count] = bitmask_create(opt_text->text_length + 1);
+        if (!masks[count]) {
+            while (count > 0) bitmask_destroy(masks[--count]);
+            return false;
         }
+        bytes[count++] = (unsigned char)c;
     }
     
+    // 失敗したら未構築のまま残し、次の参照で再試行する
+    if (!bitmask_match_bytes(masks, bytes, count, opt_text->text, opt_text->text_length)) {
+        while (count > 0) bitmask_destroy(masks[--count]);
+        return false;
+    }
+    
+    for (size_t k = 0; k < count; k++) {
+        opt_text->match_masks[bytes[k]] = masks[k];
+    }
+    memset(opt_text->pending, 0, sizeof(opt_text->pending));
+    return true;
+}
+
+// alphabetsの各文字のMatchMaskを1パスで事前計算
+optimized_text_t *optimized_text_create(const char *text, const char *alphabets) {
+    if (!text || !alphabets) return NULL;
+    
+    uint64_t set[4] = {0, 0, 0, 0};
+    for (const char *p = alphabets; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        set[c >> 6] |= 1ULL << (c & 63);
+    }
+    
+    optimized_text_t *opt_text = optimized_text_new(text, strlen(text), set);
+    if (opt_text && !optimized_text_build_pending(opt_text)) {
+        optimized_text_destroy(opt_text);
+        return NULL;
+    }
     return opt_text;
 }
 
+// パターンが参照するバイト（リテラルと文字クラスのメンバー）だけを索引対象
+// とする。MatchMaskは最初に参照されたときに1パスでまとめて構築される
+optimized_text_t *optimized_text_create_for_regex(const struct flowregex *regex, const char *text, size_t text_len) {
+    if (!regex || !text) return NULL;
+    
+    uint64_t set[4];
+    program_index_bytes(regex->program, set);
+    return optimized_text_new(text, text_len, set);
+}
+
 void optimized_text_destroy(optimized_text_t *opt_text) {
     if (!opt_text) return;
     
@@ -72,21 +107,50 @@ void optimized_text_destroy(optimized_text_t *opt_text) {
         free(opt_text->match_masks);
     }
     
+    free(opt_text->byte_counts);
     free(opt_text->precomputed_chars);
     free(opt_text->text);
     free(opt_text);
 }
 
+// 文字cのMatchMask（索引対象外、または構築に失敗したらNULL）。未構築なら
+// 構築してから返す
 struct bitmask *optimized_text_get_match_mask(optimized_text_t *opt_text, char c) {
     if (!opt_text) return NULL;
     
     unsigned char idx = (unsigned char)c;
+    if (!opt_text->match_masks[idx] && byte_set_has(opt_text->pending, idx)) {
+        if (!optimized_text_build_pending(opt_text)) return NULL;
+    }
     return opt_text->match_masks[idx];
 }
 
+// 文字cが索引対象か（構築済みか、参照時に構築されるか）
+bool optimized_text_has_match_mask(const optimized_text_t *opt_text, char c) {
+    if (!opt_text) return false;
+    
+    unsigned char idx = (unsigned char)c;
+    return opt_text->match_masks[idx] || byte_set_has(opt_text->pending, idx);
+}
+
+// テキスト中の各バイトの出現数（256要素、確保失敗時はNULL）。最初の参照時に
+// 1パスで集計する
+const size_t *optimized_text_byte_counts(optimized_text_t *opt_text) {
+    if (!opt_text) return NULL;
+    
+    if (!opt_text->byte_counts) {
+        opt_text->byte_counts = calloc(256, sizeof(size_t));
+        if (!opt_text->byte_counts) return NULL;
+        for (size_t i = 0; i < opt_text->text_length; i++) {
+            opt_text->byte_counts[(unsigned char)opt_text->text[i]]++;
+        }
+    }
+    return opt_text->byte_counts;
+}
+
 // オフセット付きビットマスク実装
 
-offset_bitmask_t *offset_bitmask_create(size_t size, int offset) {
+offset_bitmask_t *offset_bitmask_create(size_t size, int64_t offset) {
     offset_bitmask_t *mask = malloc(sizeof(offset_bitmask_t));
     if (!mask) return NULL;
     
@@ -133,12 +197,12 @@ void offset_bitmask_and_with_offset(offset_bitmask_t *dest, const struct bitmask
     
     // match_maskをoffset分ずらしてtempにコピー
     size_t count;
-    int *positions = bitmask_get_set_positions(match_mask, &count);
+    size_t *positions = bitmask_get_set_positions(match_mask, &count);
     if (positions) {
         for (size_t i = 0; i < count; i++) {
-            int shifted_pos = positions[i] + dest->offset;
-            if (shifted_pos >= 0 && shifted_pos < (int)temp->size) {
-                bitmask_set(temp, shifted_pos);
+            int64_t shifted_pos = (int64_t)positions[i] + dest->offset;
+            if (shifted_pos >= 0 && (uint64_t)shifted_pos < temp->size) {
+                bitmask_set(temp, (size_t)shifted_pos);
             }
         }
         free(positions);
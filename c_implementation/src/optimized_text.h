@@ -7,6 +7,7 @@
 
 // Forward declaration (bitmask_t is defined in flowregex.h)
 struct bitmask;
+struct flowregex;
 
 // MatchMask最適化のための構造体
 typedef struct {
@@ -15,21 +16,26 @@ typedef struct {
     struct bitmask **match_masks;  // 各文字のMatchMask
     char *precomputed_chars;  // 事前計算された文字の配列
     size_t precomputed_count; // 事前計算された文字数
+    uint64_t pending[4];      // 索引対象だが未構築のバイト（256ビット）
+    size_t *byte_counts;      // バイトごとの出現数（最初の参照時に集計）
 } optimized_text_t;
 
 // オフセット付きビットマスク（シフト演算を論理的に管理）
 typedef struct {
     struct bitmask *bits;
-    int offset;  // 論理的なオフセット位置
+    int64_t offset;  // 論理的なオフセット位置
 } offset_bitmask_t;
 
 // OptimizedText関数
 optimized_text_t *optimized_text_create(const char *text, const char *alphabets);
+optimized_text_t *optimized_text_create_for_regex(const struct flowregex *regex, const char *text, size_t text_len);
 void optimized_text_destroy(optimized_text_t *opt_text);
 struct bitmask *optimized_text_get_match_mask(optimized_text_t *opt_text, char c);
+bool optimized_text_has_match_mask(const optimized_text_t *opt_text, char c);
+const size_t *optimized_text_byte_counts(optimized_text_t *opt_text);
 
 // オフセット付きビットマスク関数
-offset_bitmask_t *offset_bitmask_create(size_t size, int offset);
+offset_bitmask_t *offset_bitmask_create(size_t size, int64_t offset);
 void offset_bitmask_destroy(offset_bitmask_t *mask);
 offset_bitmask_t *offset_bitmask_copy(const offset_bitmask_t *src);
 void offset_bitmask_and_with_offset(offset_bitmask_t *dest, const struct bitmask *match_mask);
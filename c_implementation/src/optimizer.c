@@ -0,0 +1,583 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+// Algebraic rewrites between parsing and compilation.
+//
+// Every rewrite keeps the matched language, so the end positions reached
+// from each start are unchanged, and leaves fewer nodes to compile:
+//   (x*)*, (x+)*, x?*, x+? ...  -> x*      nested quantifiers collapse
+//   x|x                         -> x
+//   a|b|[cd]                    -> [a-d]   single-byte branches merge
+//   ab|ac                       -> a(b|c)  common first factors are pulled out
+//   xx*, x*x                    -> x+
+//   x*x*, x?x*, x*x?            -> x*
+//   x+x*, x*x+, x+x?, x?x+      -> x+
+// Finally, runs of single-character factors become one string element
+// (GATTACA, a.c, \d\d-\d) that is matched in a single fused pass.
+// Concatenation and alternation chains are flattened into arrays and
+// relinked through their own nodes, so only rewrites that need a node of a
+// new type allocate. On allocation failure the whole tree is freed and NULL
+// is returned.
+
+typedef struct {
+    regex_element_t **items;
+    size_t count;
+} node_list_t;
+
+static regex_element_t *rewrite(regex_element_t *elem);
+
+static bool is_repeat(const regex_element_t *elem) {
+    return elem->type == REGEX_KLEENE_STAR || elem->type == REGEX_PLUS ||
+           elem->type == REGEX_QUESTION;
+}
+
+// Free a node whose children now belong to someone else
+static void free_shell(regex_element_t *elem) {
+    elem->left = NULL;
+    elem->right = NULL;
+    elem->destroy(elem);
+}
+
+static void list_remove(node_list_t *list, size_t index) {
+    memmove(&list->items[index], &list->items[index + 1],
+            (list->count - index - 1) * sizeof(regex_element_t *));
+    list->count--;
+}
+
+// Quantifier nesting: x** = x*, x++ = x+, x?? = x?; any other pair can
+// repeat zero or more times
+static regex_element_t *rewrite_repeat(regex_element_t *elem) {
+    regex_element_t *inner = rewrite(elem->left);
+    elem->left = inner;
+    if (!inner) {
+        free_shell(elem);
+        return NULL;
+    }
+    regex_element_rehash(elem);
+    if (!is_repeat(inner)) return elem;
+    
+    regex_element_type_t type = elem->type == inner->type ? elem->type : REGEX_KLEENE_STAR;
+    if (inner->type == type) {
+        free_shell(elem);
+        return inner;
+    }
+    if (elem->type == type) {
+        elem->left = inner->left;
+        free_shell(inner);
+        regex_element_rehash(elem);
+        return elem;
+    }
+    
+    regex_element_t *star = kleene_star_create(inner->left);
+    if (!star) {
+        elem->destroy(elem);
+        return NULL;
+    }
+    free_shell(inner);
+    free_shell(elem);
+    return star;
+}
+
+static size_t chain_length(const regex_element_t *elem, regex_element_type_t type) {
+    if (elem->type != type) return 1;
+    return chain_length(elem->left, type) + chain_length(elem->right, type);
+}
+
+// Split a chain of one node type into its operands, left to right, and the
+// chain's own nodes, detached
+static void chain_split(regex_element_t *elem, regex_element_type_t type, node_list_t *parts, node_list_t *shells) {
+    if (elem->type != type) {
+        parts->items[parts->count++] = elem;
+        return;
+    }
+    
+    regex_element_t *left = elem->left;
+    regex_element_t *right = elem->right;
+    elem->left = NULL;
+    elem->right = NULL;
+    shells->items[shells->count++] = elem;
+    chain_split(left, type, parts, shells);
+    chain_split(right, type, parts, shells);
+}
+
+// Relink parts left-deep through saved nodes (at least one fewer than
+// parts) and free the rest
+static regex_element_t *chain_join(node_list_t *parts, node_list_t *shells) {
+    regex_element_t *result = parts->items[0];
+    for (size_t i = 1; i < parts->count; i++) {
+        regex_element_t *node = shells->items[--shells->count];
+        node->left = result;
+        node->right = parts->items[i];
+        regex_element_rehash(node);
+        result = node;
+    }
+    
+    while (shells->count > 0) {
+        free_shell(shells->items[--shells->count]);
+    }
+    return result;
+}
+
+// Whether the concatenation g spells out items[*pos...] in order
+static bool chain_spells(const regex_element_t *g, regex_element_t *const *items, size_t count, size_t *pos) {
+    if (g->type == REGEX_CONCAT) {
+        return chain_spells(g->left, items, count, pos) && chain_spells(g->right, items, count, pos);
+    }
+    if (*pos >= count || !regex_element_equal(g, items[*pos])) return false;
+    (*pos)++;
+    return true;
+}
+
+// Whether the m factors at items[at...] are exactly the body g
+static bool run_equals(const regex_element_t *g, const node_list_t *parts, size_t at, size_t m) {
+    size_t pos = 0;
+    return at + m <= parts->count && chain_spells(g, parts->items + at, m, &pos) && pos == m;
+}
+
+// Replace the star at index star and the copy of its body at [run, run + m)
+// with one plus
+static bool fold_plus(node_list_t *parts, size_t star, size_t run, size_t m) {
+    regex_element_t *body = parts->items[star]->left;
+    regex_element_t *plus = plus_create(body);
+    if (!plus) return false;
+    
+    free_shell(parts->items[star]);
+    for (size_t k = 0; k < m; k++) {
+        parts->items[run + k]->destroy(parts->items[run + k]);
+    }
+    
+    size_t first = star < run ? star : run;
+    parts->items[first] = plus;
+    for (size_t k = 0; k < m; k++) {
+        list_remove(parts, first + 1);
+    }
+    return true;
+}
+
+// Adjacent quantifiers over one body: a star absorbs a neighbouring star or
+// option, and a plus absorbs a neighbouring star or option. Returns the index
+// of the factor to drop, or SIZE_MAX.
+static size_t absorbed_neighbour(const node_list_t *parts, size_t i) {
+    regex_element_t *a = parts->items[i];
+    regex_element_t *b = parts->items[i + 1];
+    if (!is_repeat(b) || !regex_element_equal(a->left, b->left)) return SIZE_MAX;
+    if (a->type == b->type) return a->type == REGEX_KLEENE_STAR ? i + 1 : SIZE_MAX;
+    if (a->type == REGEX_PLUS || (a->type == REGEX_KLEENE_STAR && b->type == REGEX_QUESTION)) return i + 1;
+    return i;
+}
+
+static bool simplify_concat(node_list_t *parts) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < parts->count && !changed; i++) {
+            regex_element_t *elem = parts->items[i];
+            if (!is_repeat(elem)) continue;
+            
+            if (i + 1 < parts->count) {
+                size_t drop = absorbed_neighbour(parts, i);
+                if (drop != SIZE_MAX) {
+                    parts->items[drop]->destroy(parts->items[drop]);
+                    list_remove(parts, drop);
+                    changed = true;
+                    continue;
+                }
+            }
+            
+            if (elem->type != REGEX_KLEENE_STAR) continue;
+            size_t m = chain_length(elem->left, REGEX_CONCAT);
+            if (i >= m && run_equals(elem->left, parts, i - m, m)) {
+                if (!fold_plus(parts, i, i - m, m)) return false;
+                changed = true;
+            } else if (run_equals(elem->left, parts, i + 1, m)) {
+                if (!fold_plus(parts, i, i + 1, m)) return false;
+                changed = true;
+            }
+        }
+    }
+    return true;
+}
+
+static const regex_element_t *first_factor(const regex_element_t *elem) {
+    while (elem->type == REGEX_CONCAT) elem = elem->left;
+    return elem;
+}
+
+// Detach the first factor of a concatenation; returns the rest, or NULL if
+// branch was that factor alone
+static regex_element_t *split_first(regex_element_t *branch, regex_element_t **first) {
+    if (branch->type != REGEX_CONCAT) {
+        *first = branch;
+        return NULL;
+    }
+    
+    regex_element_t *rest = split_first(branch->left, first);
+    if (!rest) {
+        rest = branch->right;
+        free_shell(branch);
+        return rest;
+    }
+    branch->left = rest;
+    regex_element_rehash(branch);
+    return branch;
+}
+
+// Pull the first factor shared by the branches listed in group out in front
+// of their remainders: ab|ac|a -> a(b|c)?. The remainders are joined with
+// saved alternation nodes; a group of k uses k - 1 of them while taking the
+// place of k branches, so the chain keeps enough for the final join.
+static bool factor_group(node_list_t *parts, node_list_t *shells, const size_t *group, size_t k) {
+    bool has_empty = false;
+    for (size_t g = 0; g < k; g++) {
+        if (parts->items[group[g]]->type != REGEX_CONCAT) has_empty = true;
+    }
+    
+    regex_element_t *join = concat_create(NULL, NULL);
+    regex_element_t *optional = has_empty ? question_create(NULL) : NULL;
+    if (!join || (has_empty && !optional)) {
+        if (join) join->destroy(join);
+        if (optional) optional->destroy(optional);
+        return false;
+    }
+    
+    regex_element_t *prefix = NULL;
+    regex_element_t *tails = NULL;
+    for (size_t g = 0; g < k; g++) {
+        regex_element_t *first;
+        regex_element_t *rest = split_first(parts->items[group[g]], &first);
+        if (!prefix) {
+            prefix = first;
+        } else {
+            first->destroy(first);
+        }
+        
+        if (!rest) continue;
+        if (!tails) {
+            tails = rest;
+        } else {
+            regex_element_t *node = shells->items[--shells->count];
+            node->left = tails;
+            node->right = rest;
+            regex_element_rehash(node);
+            tails = node;
+        }
+    }
+    
+    // Duplicates are gone, so at most one branch was the prefix alone
+    if (optional) {
+        optional->left = tails;
+        regex_element_rehash(optional);
+        tails = optional;
+    }
+    join->left = prefix;
+    join->right = tails;
+    regex_element_rehash(join);
+    
+    for (size_t g = k - 1; g > 0; g--) {
+        list_remove(parts, group[g]);
+    }
+    parts->items[group[0]] = rewrite(join);
+    return parts->items[group[0]] != NULL;
+}
+
+// Class element for a byte table
+static regex_element_t *class_from_table(const uint64_t table[4]) {
+    // Body text for debug output only; the table is what matches
+    char body[256 * 4 + 1];
+    size_t len = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!((table[c >> 6] >> (c & 63)) & 1)) continue;
+        if (isalnum(c)) {
+            body[len++] = (char)c;
+        } else {
+            len += (size_t)snprintf(body + len, sizeof(body) - len, "\\x%02x", c);
+        }
+    }
+    body[len] = '\0';
+    return char_class_create_table(table, body, false);
+}
+
+// Merge every single-byte branch into one class
+static bool merge_leaves(node_list_t *parts) {
+    uint64_t table[4] = {0, 0, 0, 0};
+    size_t first = SIZE_MAX;
+    size_t leaves = 0;
+    
+    for (size_t i = 0; i < parts->count; i++) {
+        uint64_t set[4];
+        if (!regex_element_byte_set(parts->items[i], set)) continue;
+        for (int w = 0; w < 4; w++) table[w] |= set[w];
+        if (first == SIZE_MAX) first = i;
+        leaves++;
+    }
+    if (leaves < 2) return true;
+    
+    regex_element_t *merged = class_from_table(table);
+    if (!merged) return false;
+    
+    for (size_t i = parts->count; i-- > first;) {
+        uint64_t set[4];
+        if (!regex_element_byte_set(parts->items[i], set)) continue;
+        parts->items[i]->destroy(parts->items[i]);
+        if (i == first) {
+            parts->items[i] = merged;
+        } else {
+            list_remove(parts, i);
+        }
+    }
+    return true;
+}
+
+static bool simplify_alternation(node_list_t *parts, node_list_t *shells) {
+    for (size_t i = 0; i < parts->count; i++) {
+        for (size_t j = parts->count - 1; j > i; j--) {
+            if (regex_element_equal(parts->items[i], parts->items[j])) {
+                parts->items[j]->destroy(parts->items[j]);
+                list_remove(parts, j);
+            }
+        }
+    }
+    
+    size_t *group = malloc(parts->count * sizeof(size_t));
+    if (!group) return false;
+    
+    for (size_t i = 0; i < parts->count; i++) {
+        const regex_element_t *prefix = first_factor(parts->items[i]);
+        size_t k = 0;
+        group[k++] = i;
+        for (size_t j = i + 1; j < parts->count; j++) {
+            if (regex_element_equal(prefix, first_factor(parts->items[j]))) group[k++] = j;
+        }
+        if (k > 1 && !factor_group(parts, shells, group, k)) {
+            free(group);
+            return false;
+        }
+    }
+    free(group);
+    
+    return merge_leaves(parts);
+}
+
+// Free everything a failed chain rewrite still holds
+static regex_element_t *chain_abort(node_list_t *parts, node_list_t *shells) {
+    for (size_t i = 0; i < parts->count; i++) {
+        if (parts->items[i]) parts->items[i]->destroy(parts->items[i]);
+    }
+    while (shells->count > 0) {
+        free_shell(shells->items[--shells->count]);
+    }
+    free(parts->items);
+    free(shells->items);
+    return NULL;
+}
+
+// Split the chain of type at elem into parts and shells, with room for extra
+// more parts; on allocation failure elem is freed and false returned
+static bool chain_open(regex_element_t *elem, regex_element_type_t type, size_t extra,
+                       node_list_t *parts, node_list_t *shells) {
+    size_t n = chain_length(elem, type);
+    parts->items = malloc((n + extra) * sizeof(regex_element_t *));
+    shells->items = malloc(n * sizeof(regex_element_t *));
+    parts->count = 0;
+    shells->count = 0;
+    if (!parts->items || !shells->items) {
+        free(parts->items);
+        free(shells->items);
+        elem->destroy(elem);
+        return false;
+    }
+    chain_split(elem, type, parts, shells);
+    return true;
+}
+
+static regex_element_t *chain_close(node_list_t *parts, node_list_t *shells) {
+    regex_element_t *result = chain_join(parts, shells);
+    free(parts->items);
+    free(shells->items);
+    return result;
+}
+
+static regex_element_t *rewrite_chain(regex_element_t *elem) {
+    regex_element_type_t type = elem->type;
+    node_list_t parts, shells;
+    if (!chain_open(elem, elem->type, 0, &parts, &shells)) return NULL;
+    
+    for (size_t i = 0; i < parts.count; i++) {
+        parts.items[i] = rewrite(parts.items[i]);
+        if (!parts.items[i]) return chain_abort(&parts, &shells);
+    }
+    
+    bool ok = type == REGEX_CONCAT ? simplify_concat(&parts) : simplify_alternation(&parts, &shells);
+    if (!ok) return chain_abort(&parts, &shells);
+    return chain_close(&parts, &shells);
+}
+
+static regex_element_t *rewrite(regex_element_t *root) {
+    if (!root) return NULL;
+    
+    switch (root->type) {
+        case REGEX_KLEENE_STAR:
+        case REGEX_PLUS:
+        case REGEX_QUESTION:
+            return rewrite_repeat(root);
+        case REGEX_CONCAT:
+        case REGEX_ALTERNATION:
+            return rewrite_chain(root);
+        default:
+            return root;
+    }
+}
+
+// Replace each run of two or more single-character factors with strings of
+// at most REGEX_STRING_MAX steps
+static bool fuse_runs(node_list_t *parts) {
+    uint64_t sets[REGEX_STRING_MAX][4];
+    size_t out = 0;
+    size_t i = 0;
+    
+    while (i < parts->count) {
+        size_t run = 0;
+        while (i + run < parts->count && run < REGEX_STRING_MAX &&
+               regex_element_byte_set(parts->items[i + run], sets[run])) {
+            run++;
+        }
+        if (run < 2) {
+            parts->items[out++] = parts->items[i++];
+            continue;
+        }
+        
+        regex_element_t *string = string_create((const uint64_t (*)[4])sets, run);
+        if (!string) {
+            // Keep the list whole for chain_abort
+            memmove(&parts->items[out], &parts->items[i], (parts->count - i) * sizeof(regex_element_t *));
+            parts->count = out + parts->count - i;
+            return false;
+        }
+        for (size_t k = 0; k < run; k++) {
+            parts->items[i + k]->destroy(parts->items[i + k]);
+        }
+        parts->items[out++] = string;
+        i += run;
+    }
+    parts->count = out;
+    return true;
+}
+
+static regex_element_t *fuse(regex_element_t *elem) {
+    switch (elem->type) {
+        case REGEX_CONCAT: {
+            node_list_t parts, shells;
+            if (!chain_open(elem, elem->type, 0, &parts, &shells)) return NULL;
+            for (size_t i = 0; i < parts.count; i++) {
+                parts.items[i] = fuse(parts.items[i]);
+                if (!parts.items[i]) return chain_abort(&parts, &shells);
+            }
+            if (!fuse_runs(&parts)) return chain_abort(&parts, &shells);
+            return chain_close(&parts, &shells);
+        }
+        case REGEX_ALTERNATION:
+        case REGEX_KLEENE_STAR:
+        case REGEX_PLUS:
+        case REGEX_QUESTION:
+            elem->left = fuse(elem->left);
+            if (elem->left && elem->right) elem->right = fuse(elem->right);
+            if (!elem->left || (elem->type == REGEX_ALTERNATION && !elem->right)) {
+                elem->destroy(elem);
+                return NULL;
+            }
+            regex_element_rehash(elem);
+            return elem;
+        default:
+            return elem;
+    }
+}
+
+// Rewrite a parsed tree (taking ownership of it) into an equivalent one
+regex_element_t *regex_optimize(regex_element_t *root) {
+    root = rewrite(root);
+    return root ? fuse(root) : NULL;
+}
+
+// Steps of one factor of a concatenation: the characters of a string, or
+// the factor as a whole
+static size_t factor_steps(const regex_element_t *elem) {
+    return elem->type == REGEX_STRING ? ((const string_data_t *)elem->data)->length : 1;
+}
+
+static regex_element_t *steps_element(const uint64_t (*sets)[4], size_t length) {
+    return length == 1 ? class_from_table(sets[0]) : string_create(sets, length);
+}
+
+// Cut an optimized tree (taking ownership of it) into the steps of its
+// top-level concatenation before step at and the steps from at on (at least
+// one). The leading part is only kept to tell where some match of it ends:
+// a match of x*y or x?y ends wherever one of y does, and one of x+y wherever
+// one of xy does, so leading x* and x? are left out and a leading x+ cut to
+// x (*before is NULL if nothing is left). On allocation failure the tree is
+// freed and false returned.
+bool regex_split_steps(regex_element_t *root, size_t at, regex_element_t **before, regex_element_t **from) {
+    *before = NULL;
+    *from = NULL;
+    
+    node_list_t parts, shells;
+    if (!chain_open(root, REGEX_CONCAT, 1, &parts, &shells)) return false;
+    
+    size_t k = 0;
+    size_t step = 0;
+    while (k < parts.count && step + factor_steps(parts.items[k]) <= at) {
+        step += factor_steps(parts.items[k++]);
+    }
+    if (k == parts.count) {
+        chain_abort(&parts, &shells);
+        return false;
+    }
+    
+    // A cut inside a string splits it in two
+    if (at > step) {
+        const string_data_t *data = (const string_data_t *)parts.items[k]->data;
+        size_t cut = at - step;
+        regex_element_t *head = steps_element((const uint64_t (*)[4])data->sets, cut);
+        regex_element_t *tail = steps_element((const uint64_t (*)[4])data->sets + cut, data->length - cut);
+        if (!head || !tail) {
+            if (head) head->destroy(head);
+            if (tail) tail->destroy(tail);
+            chain_abort(&parts, &shells);
+            return false;
+        }
+        parts.items[k]->destroy(parts.items[k]);
+        memmove(&parts.items[k + 2], &parts.items[k + 1], (parts.count - k - 1) * sizeof(regex_element_t *));
+        parts.items[k] = head;
+        parts.items[k + 1] = tail;
+        parts.count++;
+        k++;
+    }
+    
+    size_t first = 0;
+    while (first < k && is_repeat(parts.items[first])) {
+        regex_element_t *elem = parts.items[first];
+        if (elem->type == REGEX_PLUS) {
+            parts.items[first] = elem->left;
+            free_shell(elem);
+            break;
+        }
+        elem->destroy(elem);
+        first++;
+    }
+    
+    // The leading part takes its links off the end of the saved nodes, the
+    // rest get what remains
+    node_list_t head = {parts.items + first, k - first};
+    node_list_t tail = {parts.items + k, parts.count - k};
+    if (head.count > 0) {
+        node_list_t links = {shells.items + shells.count - (head.count - 1), head.count - 1};
+        shells.count -= head.count - 1;
+        *before = chain_join(&head, &links);
+    }
+    *from = chain_join(&tail, &shells);
+    free(parts.items);
+    free(shells.items);
+    return true;
+}
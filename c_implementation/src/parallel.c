@@ -0,0 +1,428 @@
+#include "flowregex.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Parallel matching.
+//
+// The text is cut into FLOWREGEX_PARALLEL_CHUNK-byte chunks matched on a
+// small thread pool; chunk i owns the end positions in (begin, end] (the
+// first chunk also owns position 0), so the per-chunk lists concatenate in
+// order without duplicates.
+//
+// Bounded patterns: a match ending at e starts no earlier than e - L
+// (L = regex->max_length), so each chunk is matched together with the
+// L - 1 bytes before it and the result is exact.
+//
+// Unbounded patterns: the state at a chunk boundary is the streaming carry
+// vector (one bit per shift-and / closure / string instruction and per
+// partial string match, see chunk_boundary in program.c). Matching
+// distributes over union of starts, so a chunk's outgoing carries are those
+// of a run from every position with no incoming state, plus, for each
+// incoming carry bit, those of a run started from that bit alone. Three
+// phases:
+//   1. per chunk (parallel): the base run, and the transfer row of every
+//      carry bit (carry-only runs, one bit each)
+//   2. sequential scan composing the rows into each chunk's incoming carries
+//   3. per chunk (parallel): a carry-only run from the incoming carries adds
+//      the ends of matches that started in earlier chunks
+// All runs go window by window. The base run records its carries at every
+// window end; a carry-only run stops at the first window end where its
+// carries are a subset of those (the base run then produces everything it
+// would), so most of them cost a window or two even for `.*`.
+
+// Chunked runs advance this many bytes at a time
+#ifndef FLOWREGEX_CARRY_WINDOW
+#define FLOWREGEX_CARRY_WINDOW 4096
+#endif
+
+typedef struct parallel_job parallel_job_t;
+
+// Per-thread scratch, kept for one phase
+typedef struct {
+    flowregex_ctx_t *ctx;           // runs from every position
+    flowregex_ctx_t *window_ctx;    // carry-only runs
+    uint8_t *carry_a;
+    uint8_t *carry_b;
+} parallel_worker_t;
+
+struct parallel_job {
+    flowregex_t *regex;
+    const char *text;
+    size_t text_len;
+    size_t chunk_count;
+    match_result_t **results;       // one per chunk
+    // Unbounded patterns: carry vectors of program->carry_count bytes
+    size_t carry_len;
+    uint32_t *consuming;            // carry indices that can be set
+    size_t consuming_count;
+    size_t chunk_windows;           // windows per full chunk
+    uint8_t *base_states;           // per chunk and window: carries of the base run
+    uint8_t *transfer;              // per chunk and carry bit: outgoing carries of that
+                                    // bit beyond the base run's
+    uint8_t *incoming;              // per chunk: incoming carries (phase 2)
+    bool (*task)(parallel_job_t *job, parallel_worker_t *worker, size_t i);
+    pthread_mutex_t lock;
+    size_t next_chunk;              // guarded by lock
+    bool failed;                    // guarded by lock
+};
+
+static void chunk_bounds(const parallel_job_t *job, size_t i, size_t *begin, size_t *end) {
+    *begin = i * FLOWREGEX_PARALLEL_CHUNK;
+    *end = *begin + FLOWREGEX_PARALLEL_CHUNK < job->text_len ? *begin + FLOWREGEX_PARALLEL_CHUNK : job->text_len;
+}
+
+// Match [start, end) with the worker's context and collect into a fresh
+// result the ends after skip_through (all ends if skip_through is SIZE_MAX)
+static match_result_t *collect_ends(parallel_job_t *job, parallel_worker_t *worker,
+                                    size_t start, size_t end, size_t skip_through) {
+    const bitmask_t *mask = flowregex_match_mask(job->regex, worker->ctx, job->text + start, end - start);
+    if (!mask) return NULL;
+    
+    match_result_t *result = match_result_create();
+    if (!result) return NULL;
+    
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        if (skip_through != SIZE_MAX && start + pos <= skip_through) continue;
+        match_result_add(result, start + pos);
+    }
+    return result;
+}
+
+// Bounded pattern: chunk i together with the L - 1 bytes before it
+static bool bounded_chunk(parallel_job_t *job, parallel_worker_t *worker, size_t i) {
+    size_t begin, end;
+    chunk_bounds(job, i, &begin, &end);
+    
+    size_t start = 0;
+    if (i > 0 && begin + 1 > job->regex->max_length) {
+        start = begin + 1 - job->regex->max_length;
+    }
+    
+    job->results[i] = collect_ends(job, worker, start, end, i > 0 ? begin : SIZE_MAX);
+    return job->results[i] != NULL;
+}
+
+static bool carry_empty(const uint8_t *carry, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (carry[i]) return false;
+    }
+    return true;
+}
+
+static bool carry_covered(const uint8_t *carry, const uint8_t *cover, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (carry[i] && !cover[i]) return false;
+    }
+    return true;
+}
+
+static size_t chunk_windows(size_t begin, size_t end) {
+    return (end - begin + FLOWREGEX_CARRY_WINDOW - 1) / FLOWREGEX_CARRY_WINDOW;
+}
+
+// Run [begin, end) window by window with ctx from the carries in carry
+// (modified), adding the ends in (begin, end] to ends if given. With states,
+// the carries after every window are recorded there (the base run). With
+// cover (the base run's states), the run stops at the first window end where
+// its carries are covered: from then on it adds nothing the base run lacks.
+// The carries left in carry are the outgoing ones beyond the base run's.
+static bool window_run(parallel_job_t *job, parallel_worker_t *worker, flowregex_ctx_t *ctx,
+                       size_t begin, size_t end, uint8_t *carry, uint8_t *states,
+                       const uint8_t *cover, match_result_t *ends) {
+    uint8_t *out = worker->carry_a;
+    
+    for (size_t pos = begin, w = 0; pos < end; pos += FLOWREGEX_CARRY_WINDOW, w++) {
+        size_t n = end - pos < FLOWREGEX_CARRY_WINDOW ? end - pos : FLOWREGEX_CARRY_WINDOW;
+        memset(out, 0, job->carry_len);
+        ctx->carry_in = carry;
+        ctx->carry_out = out;
+        const bitmask_t *mask = flowregex_match_mask(job->regex, ctx, job->text + pos, n);
+        ctx->carry_in = NULL;
+        ctx->carry_out = NULL;
+        if (!mask) return false;
+        
+        if (ends) {
+            // Position 0 belongs to the previous window (or chunk)
+            bitmask_iter_t it;
+            size_t p;
+            bitmask_iter_init(&it, mask);
+            while (bitmask_iter_next(&it, &p)) {
+                if (p > 0 || pos == 0) match_result_add(ends, pos + p);
+            }
+        }
+        
+        memcpy(carry, out, job->carry_len);
+        if (states) memcpy(states + w * job->carry_len, carry, job->carry_len);
+        if (cover && carry_covered(carry, cover + w * job->carry_len, job->carry_len)) {
+            memset(carry, 0, job->carry_len);
+            break;
+        }
+    }
+    return true;
+}
+
+// Phase 1: base run of chunk i and its transfer rows
+static bool transfer_chunk(parallel_job_t *job, parallel_worker_t *worker, size_t i) {
+    size_t begin, end;
+    chunk_bounds(job, i, &begin, &end);
+    
+    uint8_t *carry = worker->carry_b;
+    uint8_t *states = job->base_states + i * job->chunk_windows * job->carry_len;
+    memset(carry, 0, job->carry_len);
+    job->results[i] = match_result_create();
+    if (!job->results[i] ||
+        !window_run(job, worker, worker->ctx, begin, end, carry, states, NULL, job->results[i])) {
+        return false;
+    }
+    
+    // The last chunk's outgoing carries go nowhere
+    if (i + 1 == job->chunk_count) return true;
+    
+    uint8_t *rows = job->transfer + i * job->consuming_count * job->carry_len;
+    for (size_t k = 0; k < job->consuming_count; k++) {
+        uint8_t *row = rows + k * job->carry_len;
+        row[job->consuming[k]] = 1;
+        if (!window_run(job, worker, worker->window_ctx, begin, end, row, NULL, states, NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Phase 3: ends of matches reaching chunk i from earlier chunks
+static bool fixup_chunk(parallel_job_t *job, parallel_worker_t *worker, size_t i) {
+    const uint8_t *incoming = job->incoming + i * job->carry_len;
+    if (carry_empty(incoming, job->carry_len)) return true;
+    
+    size_t begin, end;
+    chunk_bounds(job, i, &begin, &end);
+    
+    uint8_t *carry = worker->carry_b;
+    memcpy(carry, incoming, job->carry_len);
+    match_result_t *extra = match_result_create();
+    bool ok = extra && window_run(job, worker, worker->window_ctx, begin, end, carry, NULL,
+                                  job->base_states + i * job->chunk_windows * job->carry_len, extra);
+    
+    if (ok && extra->count > 0) {
+        // Merge two ascending lists, dropping duplicates
+        match_result_t *base = job->results[i];
+        match_result_t *merged = match_result_create();
+        ok = merged && match_result_reserve(merged, base->count + extra->count);
+        size_t a = 0, b = 0;
+        while (ok && (a < base->count || b < extra->count)) {
+            size_t next;
+            if (b == extra->count || (a < base->count && base->positions[a] < extra->positions[b])) {
+                next = base->positions[a++];
+            } else {
+                next = extra->positions[b++];
+                if (a < base->count && base->positions[a] == next) a++;
+            }
+            merged->positions[merged->count++] = next;
+        }
+        if (ok) {
+            match_result_destroy(base);
+            job->results[i] = merged;
+        } else {
+            match_result_destroy(merged);
+        }
+    }
+    
+    match_result_destroy(extra);
+    return ok;
+}
+
+static bool worker_init(parallel_worker_t *worker, const parallel_job_t *job) {
+    size_t carry_len = job->carry_len ? job->carry_len : 1;
+    worker->ctx = flowregex_ctx_create();
+    worker->window_ctx = flowregex_ctx_create();
+    worker->carry_a = malloc(carry_len);
+    worker->carry_b = malloc(carry_len);
+    if (worker->window_ctx) worker->window_ctx->carry_only = true;
+    return worker->ctx && worker->window_ctx && worker->carry_a && worker->carry_b;
+}
+
+static void worker_release(parallel_worker_t *worker) {
+    flowregex_ctx_destroy(worker->ctx);
+    flowregex_ctx_destroy(worker->window_ctx);
+    free(worker->carry_a);
+    free(worker->carry_b);
+}
+
+static void *parallel_worker(void *arg) {
+    parallel_job_t *job = arg;
+    parallel_worker_t worker;
+    bool ready = worker_init(&worker, job);
+    
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (!ready) job->failed = true;
+        size_t i = job->failed ? job->chunk_count : job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->chunk_count) break;
+        
+        if (!job->task(job, &worker, i)) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = true;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    
+    worker_release(&worker);
+    return NULL;
+}
+
+// Run task over every chunk on nthreads threads; the calling thread is
+// worker 0. Returns false if any chunk failed.
+static bool run_phase(parallel_job_t *job, pthread_t *threads, size_t nthreads,
+                      bool (*task)(parallel_job_t *, parallel_worker_t *, size_t)) {
+    job->task = task;
+    job->next_chunk = 0;
+    
+    size_t started = 1;
+    while (started < nthreads && pthread_create(&threads[started], NULL, parallel_worker, job) == 0) {
+        started++;
+    }
+    parallel_worker(job);
+    for (size_t t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return !job->failed;
+}
+
+// Phase 2: incoming carries of every chunk, composing the transfer rows
+static void compose_carries(parallel_job_t *job) {
+    size_t len = job->carry_len;
+    memset(job->incoming, 0, len);
+    
+    for (size_t i = 0; i + 1 < job->chunk_count; i++) {
+        const uint8_t *in = job->incoming + i * len;
+        uint8_t *out = job->incoming + (i + 1) * len;
+        const uint8_t *rows = job->transfer + i * job->consuming_count * len;
+        size_t begin, end;
+        chunk_bounds(job, i, &begin, &end);
+        memcpy(out, job->base_states + (i * job->chunk_windows + chunk_windows(begin, end) - 1) * len, len);
+        for (size_t k = 0; k < job->consuming_count; k++) {
+            if (!in[job->consuming[k]]) continue;
+            for (size_t pc = 0; pc < len; pc++) {
+                out[pc] |= rows[k * len + pc];
+            }
+        }
+    }
+}
+
+// Phase 1-3 buffers for an unbounded pattern
+static bool alloc_transfers(parallel_job_t *job) {
+    const program_t *program = job->regex->program;
+    job->carry_len = program->carry_count;
+    job->consuming = malloc((program->carry_count ? program->carry_count : 1) * sizeof(uint32_t));
+    if (!job->consuming) return false;
+    
+    job->consuming_count = 0;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        program_op_t op = program->code[pc].op;
+        if (op == OP_AND_SHIFT || op == OP_CLOSURE || op == OP_STRING) {
+            job->consuming[job->consuming_count++] = (uint32_t)pc;
+        }
+    }
+    for (size_t i = 0; i < program->string_count; i++) {
+        for (size_t j = 1; j < program->strings[i].length; j++) {
+            job->consuming[job->consuming_count++] = (uint32_t)(program->strings[i].carry + j - 1);
+        }
+    }
+    
+    job->chunk_windows = chunk_windows(0, FLOWREGEX_PARALLEL_CHUNK);
+    size_t vectors = job->chunk_count * job->carry_len;
+    size_t states = vectors * job->chunk_windows;
+    size_t rows = vectors * job->consuming_count;
+    job->base_states = calloc(states ? states : 1, sizeof(uint8_t));
+    job->incoming = calloc(vectors ? vectors : 1, sizeof(uint8_t));
+    job->transfer = calloc(rows ? rows : 1, sizeof(uint8_t));
+    return job->base_states && job->incoming && job->transfer;
+}
+
+// Concatenate the per-chunk results (already ordered and disjoint)
+static match_result_t *merge_results(match_result_t **results, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += results[i]->count;
+    
+    match_result_t *merged = match_result_create();
+    if (!merged) return NULL;
+    if (!match_result_reserve(merged, total)) {
+        match_result_destroy(merged);
+        return NULL;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (results[i]->count > 0) {
+            memcpy(merged->positions + merged->count, results[i]->positions,
+                   results[i]->count * sizeof(size_t));
+        }
+        merged->count += results[i]->count;
+    }
+    return merged;
+}
+
+// Match text on nthreads threads. With one thread or one chunk there is
+// nothing to overlap: chunking only adds the overlaps and carries (1.5-4x
+// slower), so that goes to flowregex_match, which matches in a context of
+// its own, never one shared through the regex.
+match_result_t *flowregex_match_parallel(flowregex_t *regex, const char *text, size_t nthreads) {
+    if (!regex || !text) return NULL;
+    
+    size_t text_len = strlen(text);
+    size_t chunk_count = (text_len + FLOWREGEX_PARALLEL_CHUNK - 1) / FLOWREGEX_PARALLEL_CHUNK;
+    if (nthreads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? (size_t)online : 1;
+    }
+    if (nthreads > chunk_count) nthreads = chunk_count;
+    if (nthreads <= 1) {
+        return flowregex_match(regex, text, false);
+    }
+    
+    bool bounded = regex->max_length < FLOWREGEX_PARALLEL_CHUNK;
+    
+    parallel_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.regex = regex;
+    job.text = text;
+    job.text_len = text_len;
+    job.chunk_count = chunk_count;
+    job.results = calloc(chunk_count, sizeof(match_result_t *));
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    
+    bool ok = job.results && threads && (bounded || alloc_transfers(&job)) &&
+              pthread_mutex_init(&job.lock, NULL) == 0;
+    match_result_t *merged = NULL;
+    if (ok) {
+        if (bounded) {
+            ok = run_phase(&job, threads, nthreads, bounded_chunk);
+        } else {
+            ok = run_phase(&job, threads, nthreads, transfer_chunk);
+            if (ok) {
+                compose_carries(&job);
+                ok = run_phase(&job, threads, nthreads, fixup_chunk);
+            }
+        }
+        if (ok) merged = merge_results(job.results, chunk_count);
+        pthread_mutex_destroy(&job.lock);
+    }
+    
+    if (job.results) {
+        for (size_t i = 0; i < chunk_count; i++) {
+            match_result_destroy(job.results[i]);
+        }
+    }
+    free(job.results);
+    free(job.consuming);
+    free(job.base_states);
+    free(job.transfer);
+    free(job.incoming);
+    free(threads);
+    return merged;
+}
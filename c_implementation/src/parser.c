@@ -108,7 +108,45 @@ static regex_element_t *parse_factor(parser_state_t *state) {
     }
 }
 
-// Atom := CHAR | '(' Expression ')' | '.' | '\' EscapeChar
+// Bracket := '[' '^'? ']'? BracketItem* ']'
+// The body is compiled once into a 256-bit class table.
+static regex_element_t *parse_bracket(parser_state_t *state) {
+    advance(state); // consume '['
+    size_t start = state->pos;
+    
+    // A ']' right after '[' or '[^' is a literal member
+    consume(state, '^');
+    consume(state, ']');
+    
+    while (!at_end(state) && current_char(state) != ']') {
+        if (current_char(state) == '\\') advance(state);
+        advance(state);
+    }
+    if (!consume(state, ']')) {
+        *(state->error) = FLOWREGEX_ERROR_PARSE;
+        return NULL;
+    }
+    
+    size_t len = state->pos - 1 - start;
+    uint64_t table[4];
+    bool negated;
+    if (!char_class_compile(state->pattern + start, len, table, &negated)) {
+        *(state->error) = FLOWREGEX_ERROR_PARSE;
+        return NULL;
+    }
+    
+    char *body = strndup(state->pattern + start, len);
+    if (!body) {
+        *(state->error) = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    regex_element_t *elem = char_class_create_table(table, body, negated);
+    free(body);
+    if (!elem) *(state->error) = FLOWREGEX_ERROR_MEMORY;
+    return elem;
+}
+
+// Atom := CHAR | '(' Expression ')' | '.' | '\' EscapeChar | Bracket
 static regex_element_t *parse_atom(parser_state_t *state) {
     char c = current_char(state);
     
@@ -135,6 +173,9 @@ static regex_element_t *parse_atom(parser_state_t *state) {
             advance(state);
             return any_char_create();
             
+        case '[':
+            return parse_bracket(state);
+            
         case '\\':
             advance(state); // consume '\'
             {
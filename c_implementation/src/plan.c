@@ -0,0 +1,502 @@
+#include "flowregex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Match planning.
+//
+// A pattern can run five ways: word-parallel from every position
+// (PLAN_DENSE, one tile at a time on long texts), from the occurrences of
+// its literal prefix (PLAN_PREFIX), from those of a required factor
+// (PLAN_FACTOR, see factor.c) or, if it is small, as one pass of its
+// bit-parallel NFA over the text (PLAN_NFA, see nfa.c) or of the DFA built
+// lazily from that NFA (PLAN_DFA, see dfa.c). Which one wins depends on the
+// text: a literal that is rare in a log is everywhere in DNA. The planner
+// estimates the share of positions each literal occurs at from the byte
+// statistics of the text, prices every strategy in rough per-byte units and
+// picks the cheapest. The estimates only choose; the substring search still
+// falls back to PLAN_DENSE when a literal turns out dense, and every step
+// still measures its input before going sparse (program.c).
+//
+// Within the program the strategy runs, the planner also picks an engine
+// per instruction (flowregex_plan_t.engines) from the shares flowing into
+// it: a step is expected word-parallel or sparse, and a loop whose subtree
+// has an NFA (OP_NFA) runs either as its word-parallel fixpoint, one round
+// per link of the longest chain of body matches, or as one pass of that NFA
+// from the loop's input. The NFA choice is binding; the sparse one is still
+// confirmed by measurement.
+
+// Relative work per text byte
+#define COST_SCAN 1.0           // substring search for a literal
+#define COST_LITERALS 1.0       // one pass building every literal mask
+#define COST_CLASS 6.0          // building one class mask
+#define COST_WORD_STEP 0.05     // one word-parallel step
+#define COST_SPARSE_STEP 8.0    // one step taken at one live position
+#define COST_NFA 8.0            // one NFA transition
+#define COST_NFA_JUMP 40.0      // one with a state live that has table followers
+#define COST_NFA_START 64.0     // starting a subtree's NFA at one sparse input position
+#define COST_DFA 6.0            // one cached DFA transition, four lanes at a time
+#define COST_DFA_MISS 100.0     // adding one transition to the cache
+
+// Text sampled for byte statistics when no OptimizedText counts them
+#define PLAN_SAMPLE_PIECES 64
+#define PLAN_SAMPLE_PIECE 1024
+
+// Share of the text's positions holding each byte: counted in the
+// OptimizedText if there is one, otherwise in evenly spaced pieces of the
+// text. Returns true if sampled.
+static bool byte_shares(const flowregex_ctx_t *ctx, double shares[256]) {
+    const size_t *counts = ctx->opt_text ? optimized_text_byte_counts(ctx->opt_text) : NULL;
+    if (counts) {
+        for (int c = 0; c < 256; c++) {
+            shares[c] = (counts[c] + 1.0) / (ctx->text_len + 256.0);
+        }
+        return false;
+    }
+    
+    size_t sample[256] = {0};
+    size_t total = 0;
+    const unsigned char *text = (const unsigned char *)ctx->text;
+    if (ctx->text_len <= PLAN_SAMPLE_PIECES * PLAN_SAMPLE_PIECE) {
+        for (size_t i = 0; i < ctx->text_len; i++) sample[text[i]]++;
+        total = ctx->text_len;
+    } else {
+        size_t stride = ctx->text_len / PLAN_SAMPLE_PIECES;
+        for (size_t k = 0; k < PLAN_SAMPLE_PIECES; k++) {
+            const unsigned char *piece = text + k * stride;
+            for (size_t i = 0; i < PLAN_SAMPLE_PIECE; i++) sample[piece[i]]++;
+        }
+        total = PLAN_SAMPLE_PIECES * PLAN_SAMPLE_PIECE;
+    }
+    for (int c = 0; c < 256; c++) {
+        shares[c] = (sample[c] + 1.0) / (total + 256.0);
+    }
+    return true;
+}
+
+static double set_share(const uint64_t set[4], const double shares[256]) {
+    double share = 0.0;
+    for (int c = 0; c < 256; c++) {
+        if ((set[c >> 6] >> (c & 63)) & 1) share += shares[c];
+    }
+    return share < 1.0 ? share : 1.0;
+}
+
+// Estimated share of the positions where the n bytes s occur
+static double string_share(const unsigned char *s, size_t n, const double shares[256]) {
+    double share = 1.0;
+    for (size_t k = 0; k < n; k++) share *= shares[s[k]];
+    return share;
+}
+
+// Steps instructions from..to - 1 of program take per live position
+static size_t steps_between(const program_t *program, size_t from, size_t to) {
+    size_t steps = 0;
+    for (size_t pc = from; pc < to; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        if (instr->op == OP_STRING) {
+            steps += program->strings[instr->b].length;
+        } else if (instr->op != OP_LITERAL_MASK && instr->op != OP_CLASS_MASK && instr->op != OP_NFA) {
+            steps++;
+        }
+    }
+    return steps;
+}
+
+// Steps a run of program takes per live position
+static size_t program_steps(const program_t *program) {
+    return steps_between(program, 0, program->length);
+}
+
+// Whether index has a mask for every byte of set, or of its complement for
+// mostly-full sets, so that the set's mask is their OR (see class_mask)
+static bool indexed(const optimized_text_t *index, const uint64_t set[4], size_t *count) {
+    int members = __builtin_popcountll(set[0]) + __builtin_popcountll(set[1]) +
+                  __builtin_popcountll(set[2]) + __builtin_popcountll(set[3]);
+    bool complement = members > 128;
+    *count = complement ? 256 - members : members;
+    if (!index) return false;
+    for (int c = 0; c < 256; c++) {
+        bool member = (set[c >> 6] >> (c & 63)) & 1;
+        if (member != complement && !optimized_text_has_match_mask(index, (char)c)) return false;
+    }
+    return true;
+}
+
+// Cost per byte of running program word-parallel over the whole text, with
+// the masks index (if not NULL) holds for it
+double plan_dense_cost(const program_t *program, const optimized_text_t *index) {
+    bool literals = false;
+    double cost = 0.0;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        uint64_t set[4] = {0};
+        size_t count;
+        if (instr->op == OP_LITERAL_MASK) {
+            set[instr->arg >> 6] |= 1ULL << (instr->arg & 63);
+            literals |= !indexed(index, set, &count);
+        } else if (instr->op == OP_CLASS_MASK) {
+            bool ored = indexed(index, program->classes[instr->arg], &count) && count <= 64;
+            cost += ored ? count * COST_WORD_STEP : COST_CLASS;
+        }
+    }
+    return cost + (literals ? COST_LITERALS : 0.0) + program_steps(program) * COST_WORD_STEP;
+}
+
+// Cost per byte of running program from starts at share of the positions,
+// after searching for them: sparse steps while they are rare enough, dense
+// past that
+static double literal_cost(const program_t *program, const optimized_text_t *index, double share) {
+    if (share * 64 > 1.0) return COST_SCAN + plan_dense_cost(program, index);
+    return COST_SCAN + share * program_steps(program) * COST_SPARSE_STEP;
+}
+
+// Cost per byte of the NFA pass from start, a share of the positions (1
+// for a whole pattern). Table lookups are skipped while no state that
+// needs them is live, so they are priced by how often one is: each state
+// is live where its bytes occur after a live predecessor (or a start, for a
+// first state), settled over a few rounds for loops. From sparse starts
+// (nfa_run_from) the pass reads bytes only while a state is live, but pays
+// for every start it jumps to.
+static double nfa_cost(const regex_nfa_t *nfa, const double shares[256], double start) {
+    if (nfa->jump_count == 0 && start * 64 > 1.0) return COST_NFA;
+    
+    double own[REGEX_NFA_MAX] = {0};
+    double live[REGEX_NFA_MAX] = {0};
+    for (int c = 0; c < 256; c++) {
+        for (size_t p = 0; p < nfa->states; p++) {
+            if ((nfa->bytes[c] >> p) & 1) own[p] += shares[c];
+        }
+    }
+    for (int round = 0; round < 8; round++) {
+        double next[REGEX_NFA_MAX];
+        for (size_t p = 0; p < nfa->states; p++) {
+            double in = (nfa->first >> p) & 1 ? start : 0.0;
+            for (size_t q = 0; q < nfa->states; q++) {
+                if ((nfa->follow[q] >> p) & 1) in += live[q];
+            }
+            next[p] = own[p] * (in < 1.0 ? in : 1.0);
+        }
+        memcpy(live, next, sizeof(next));
+    }
+    
+    double busy = 0.0;
+    double jumping = 0.0;
+    for (size_t p = 0; p < nfa->states; p++) {
+        busy += live[p];
+        if ((nfa->jump_from >> p) & 1) jumping += live[p];
+    }
+    double cost = (jumping < 1.0 ? jumping : 1.0) * COST_NFA_JUMP;
+    if (start * 64 > 1.0) return cost + COST_NFA;
+    return cost + start * COST_NFA_START + (busy < 1.0 ? busy : 1.0) * COST_NFA;
+}
+
+// Flow estimated shares through instructions from..to - 1 of program,
+// loops taken as a single round. live holds the share of the positions in
+// each slot; inputs (if not NULL) receives the input share of every step
+// and OP_NFA.
+static void flow_shares(const program_t *program, const double shares[256], double *live, size_t from,
+                        size_t to, double *inputs) {
+    for (size_t pc = from; pc < to; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        uint64_t set[4] = {0};
+        double in = 0.0;
+        double out = 0.0;
+        switch (instr->op) {
+            case OP_LITERAL_MASK:
+                set[instr->arg >> 6] |= 1ULL << (instr->arg & 63);
+                live[instr->dst] = set_share(set, shares);
+                continue;
+            case OP_CLASS_MASK:
+                live[instr->dst] = set_share(program->classes[instr->arg], shares);
+                continue;
+            case OP_NFA:
+                // The fixpoint that follows computes the same value
+                if (inputs) inputs[pc] = live[instr->a];
+                continue;
+            case OP_AND_SHIFT:
+                in = live[instr->a];
+                out = in * live[instr->b];
+                break;
+            case OP_CLOSURE: {
+                // A run of matching bytes is 1 / (1 - p) long on average
+                double p = live[instr->b] < 0.99 ? live[instr->b] : 0.99;
+                in = live[instr->a];
+                out = in * (instr->arg ? p : 1.0) / (1.0 - p);
+                break;
+            }
+            case OP_STRING: {
+                const program_string_t *str = &program->strings[instr->b];
+                in = live[instr->a];
+                out = in;
+                for (size_t k = 0; k < str->length; k++) out *= live[str->masks[k]];
+                break;
+            }
+            case OP_OR:
+                out = live[instr->a] + live[instr->b];
+                break;
+            case OP_FIX_BEGIN:
+                out = instr->arg ? live[instr->a] : 0.0;
+                live[instr->b] = live[instr->a];
+                break;
+            case OP_FIX_END:
+                out = live[instr->dst] + live[instr->a];
+                break;
+        }
+        live[instr->dst] = out < 1.0 ? out : 1.0;
+        if (inputs) inputs[pc] = in;
+    }
+}
+
+// Cost per byte of a loop's fixpoint from a share in of the positions,
+// run_length positions at a time, up to limit. Every round runs the body
+// (steps per position) from the frontier, the positions first reached the
+// round before, and a share q of those reach positions again, new ones as
+// far as they were not reached already. The bookkeeping (andnot, any, or)
+// works on the positions reached so far, word-parallel once they are
+// dense. From dense input the frontier dies out within a round or two;
+// from sparse input a round runs while some chain of body matches goes on,
+// with at least one chain counted (a literal's estimated share can be far
+// below one position).
+static double fixpoint_cost(double in, double q, size_t steps, size_t run_length, double limit) {
+    double chains = in * run_length > 1.0 ? in * run_length : 1.0;
+    double frontier = chains / run_length;
+    double reached = frontier;
+    double cost = 0.0;
+    for (size_t round = 0; round < run_length && frontier * run_length >= 0.01 && cost < limit; round++) {
+        double runs = frontier * run_length < 1.0 ? frontier * run_length : 1.0;
+        double dense = reached * 64 < 1.0 ? reached * 64 : 1.0;
+        cost += runs * 3 * dense * COST_WORD_STEP;
+        cost += frontier * 64 > 1.0 ? steps * COST_WORD_STEP : frontier * steps * COST_SPARSE_STEP;
+        frontier *= q * (1.0 - reached);
+        reached = reached + frontier < 1.0 ? reached + frontier : 1.0;
+    }
+    return cost;
+}
+
+// Choose the engine of every instruction of program run from start, a share
+// of the positions, run_length positions at a time. Each OP_NFA weighs its
+// loop's fixpoint, with the body's ratio of output to input share from a
+// small input (the shares of a whole round saturate), against the NFA pass;
+// instructions an NFA pass skips get no engine. Without use_nfa, every loop
+// keeps its fixpoint. scratch holds 2 * slot_count + length doubles.
+static void plan_engines(const program_t *program, const double shares[256], double start, size_t run_length,
+                         bool use_nfa, double *scratch, plan_engine_t *engines) {
+    double *live = scratch;
+    double *body = live + program->slot_count;
+    double *inputs = body + program->slot_count;
+    memset(live, 0, program->slot_count * sizeof(double));
+    memset(inputs, 0, program->length * sizeof(double));
+    live[program->input_slot] = start;
+    flow_shares(program, shares, live, 0, program->length, inputs);
+    
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        engines[pc] = ENGINE_NONE;
+        if (instr->op == OP_AND_SHIFT || instr->op == OP_CLOSURE || instr->op == OP_STRING) {
+            engines[pc] = inputs[pc] * 64 > 1.0 ? ENGINE_WORD : ENGINE_SPARSE;
+        }
+        if (instr->op != OP_NFA || !use_nfa) continue;
+        
+        // The loop: FIX_BEGIN at pc + 1, its FIX_END before instr->b
+        const program_instr_t *begin = &program->code[pc + 1];
+        const program_instr_t *end = &program->code[instr->b - 1];
+        const double small = 1.0 / 4096;
+        memcpy(body, live, program->slot_count * sizeof(double));
+        body[begin->b] = small;
+        flow_shares(program, shares, body, pc + 2, instr->b - 1, NULL);
+        double q = body[end->a] / small;
+        
+        // Both from at least one position, as fixpoint_cost counts it
+        double in = inputs[pc] * run_length > 1.0 ? inputs[pc] : 1.0 / run_length;
+        double nfa = nfa_cost(program->nfas[instr->arg].nfa, shares, in);
+        size_t steps = steps_between(program, pc + 2, instr->b - 1);
+        if (nfa < fixpoint_cost(in, q, steps, run_length, nfa)) {
+            engines[pc] = ENGINE_NFA;
+            for (pc++; pc < instr->b; pc++) engines[pc] = ENGINE_NONE;
+            pc--;
+        }
+    }
+}
+
+// Plan the match of regex over text (bound to ctx). False on allocation
+// failure.
+bool flowregex_plan(const flowregex_t *regex, flowregex_ctx_t *ctx, const char *text, size_t text_len,
+                    flowregex_plan_t *plan) {
+    if (!regex || !ctx || !text || !plan) return false;
+    if (!flowregex_ctx_bind_text(ctx, text, text_len)) return false;
+    
+    plan->strategy = PLAN_DENSE;
+    plan->factor = 0;
+    plan->share = 1.0;
+    plan->dense_cost = regex->dense_cost;
+    plan->cost = plan->dense_cost;
+    plan->sampled = false;
+    plan->program = NULL;
+    plan->engines = NULL;
+    // A short text is matched from every position in a few words per step:
+    // the estimates below would cost more than any strategy saves
+    if (text_len < FLOWREGEX_PLAN_MIN_TEXT) return true;
+    
+    double shares[256];
+    plan->sampled = byte_shares(ctx, shares);
+    // Masks of the text come from its OptimizedText where that has them
+    const optimized_text_t *index = ctx->opt_text && ctx->opt_text->text_length == text_len ? ctx->opt_text : NULL;
+    if (index) {
+        plan->dense_cost = plan_dense_cost(regex->program, index);
+        plan->cost = plan->dense_cost;
+    }
+    
+    const program_t *program = regex->program;
+    if (program->prefix_length > 0) {
+        double share = string_share(program->prefix, program->prefix_length, shares);
+        double cost = literal_cost(program, index, share);
+        if (cost < plan->cost) {
+            plan->strategy = PLAN_PREFIX;
+            plan->share = share;
+            plan->cost = cost;
+        }
+    }
+    
+    // The NFA reads a whole text only: it has no chunk carries
+    bool whole = !ctx->carry_in && !ctx->carry_out && !ctx->carry_only && !ctx->debug;
+    if (whole && regex->nfa) {
+        double cost = nfa_cost(regex->nfa, shares, 1.0);
+        if (cost < plan->cost) {
+            plan->strategy = PLAN_NFA;
+            plan->share = 1.0;
+            plan->cost = cost;
+        }
+        
+        // Not again after its cache thrashed on this pattern. An empty
+        // cache first fills a row per NFA state or so.
+        bool thrashed;
+        cost = COST_DFA;
+        if (dfa_cached(ctx, regex->nfa, &thrashed) == 0) {
+            cost += (regex->nfa->states + 1) * regex->nfa->columns * COST_DFA_MISS / (text_len + 1.0);
+        }
+        if (!thrashed && cost < plan->cost) {
+            plan->strategy = PLAN_DFA;
+            plan->share = 1.0;
+            plan->cost = cost;
+        }
+    }
+    
+    // Factors work on a whole, long text only, with starts sparse enough
+    // for windows
+    for (size_t i = 0; whole && text_len >= 4 * FLOWREGEX_SPARSE_WINDOW && i < regex->factor_count; i++) {
+        const regex_factor_t *factor = &regex->factors[i];
+        double share = string_share(factor->from->prefix, factor->from->prefix_length, shares);
+        if (share * PROGRAM_SPARSE_BITS > 1.0) continue;
+        
+        double cost = literal_cost(factor->from, index, share);
+        if (factor->before) {
+            // A window with an occurrence runs before from every position
+            double windows = share * FLOWREGEX_SPARSE_WINDOW < 1.0 ? share * FLOWREGEX_SPARSE_WINDOW : 1.0;
+            cost += windows * plan_dense_cost(factor->before, NULL);
+        }
+        if (cost < plan->cost) {
+            plan->strategy = PLAN_FACTOR;
+            plan->factor = i;
+            plan->share = share;
+            plan->cost = cost;
+        }
+    }
+    
+    // Engines for the program the strategy runs, one tile or window at a
+    // time on long texts
+    if (plan->strategy == PLAN_NFA) return true;
+    if (plan->strategy == PLAN_FACTOR) program = regex->factors[plan->factor].from;
+    size_t run_length = text_len;
+    if (plan->strategy == PLAN_FACTOR) {
+        run_length = FLOWREGEX_SPARSE_WINDOW;
+    } else if (!index && text_len >= 4 * FLOWREGEX_TILE) {
+        run_length = FLOWREGEX_TILE;
+    }
+    if (ctx->engine_capacity < program->length) {
+        plan_engine_t *engines = realloc(ctx->engines, program->length * sizeof(plan_engine_t));
+        if (!engines) return false;
+        ctx->engines = engines;
+        ctx->engine_capacity = program->length;
+    }
+    size_t scratch_length = 2 * program->slot_count + program->length;
+    if (ctx->plan_share_capacity < scratch_length) {
+        double *scratch = realloc(ctx->plan_shares, scratch_length * sizeof(double));
+        if (!scratch) return false;
+        ctx->plan_shares = scratch;
+        ctx->plan_share_capacity = scratch_length;
+    }
+    // Chunks joined by carries each plan their own, but an NFA's carries are
+    // its states and a fixpoint's are its instructions': the chunk after
+    // must run the loop the same way, so those keep the fixpoint
+    bool carried = ctx->carry_in || ctx->carry_out || ctx->carry_only;
+    plan_engines(program, shares, plan->share, run_length, !carried, ctx->plan_shares, ctx->engines);
+    plan->program = program;
+    plan->engines = ctx->engines;
+    return true;
+}
+
+static const char *strategy_names[] = {"dense", "prefix", "factor", "nfa", "dfa"};
+
+// Print the plan with the estimated input share of every step of the
+// program it runs and the engine planned for it
+void flowregex_plan_print(const flowregex_t *regex, const flowregex_ctx_t *ctx, const flowregex_plan_t *plan) {
+    if (!regex || !ctx || !plan) return;
+    if (ctx->text_len < FLOWREGEX_PLAN_MIN_TEXT) {
+        printf("Plan: dense, not estimated for a text under %d bytes\n", FLOWREGEX_PLAN_MIN_TEXT);
+        return;
+    }
+    
+    const program_t *program = regex->program;
+    const unsigned char *literal = NULL;
+    size_t literal_length = 0;
+    if (plan->strategy == PLAN_PREFIX) {
+        literal = program->prefix;
+        literal_length = program->prefix_length;
+    } else if (plan->strategy == PLAN_FACTOR) {
+        program = regex->factors[plan->factor].from;
+        literal = program->prefix;
+        literal_length = program->prefix_length;
+    }
+    
+    printf("Plan: %s", strategy_names[plan->strategy]);
+    if (literal) printf(" '%.*s'", (int)literal_length, (const char *)literal);
+    if (plan->strategy == PLAN_NFA || plan->strategy == PLAN_DFA) {
+        printf(" of %zu states with %zu follow tables", regex->nfa->states, regex->nfa->jump_count);
+    }
+    if (plan->strategy == PLAN_DFA) {
+        bool thrashed;
+        printf(", %zu DFA states cached", dfa_cached(ctx, regex->nfa, &thrashed));
+    }
+    printf(", estimated share %.3g, cost %.3g per byte (dense %.3g), bytes %s\n", plan->share, plan->cost,
+           plan->dense_cost, plan->sampled ? "sampled from the text" : "counted in the OptimizedText");
+    
+    if (plan->strategy == PLAN_NFA || plan->strategy == PLAN_DFA) return;
+    
+    double shares[256];
+    double *live = calloc(program->slot_count, sizeof(double));
+    double *inputs = calloc(program->length, sizeof(double));
+    if (!live || !inputs || !ctx->text) {
+        free(live);
+        free(inputs);
+        return;
+    }
+    byte_shares(ctx, shares);
+    live[program->input_slot] = plan->share;
+    flow_shares(program, shares, live, 0, program->length, inputs);
+    
+    bool planned = plan->program == program && plan->engines;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        plan_engine_t engine = planned ? plan->engines[pc] : ENGINE_NONE;
+        if (instr->op == OP_NFA) {
+            printf("%4zu  %-12s input share %-10.3g %s\n", pc, program_op_name(instr->op), inputs[pc],
+                   engine == ENGINE_NFA ? "bit-parallel NFA" : "fixpoint");
+        } else if (engine != ENGINE_NONE) {
+            printf("%4zu  %-12s input share %-10.3g %s\n", pc, program_op_name(instr->op), inputs[pc],
+                   engine == ENGINE_WORD ? "word-parallel" : "sparse");
+        }
+    }
+    free(live);
+    free(inputs);
+}
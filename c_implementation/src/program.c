@@ -0,0 +1,1274 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Lowering of the element tree into a flat program.
+//
+// Compilation first emits every instruction into virtual registers (one per
+// value), hoisting the text-derived masks to the front, then assigns the
+// virtual registers to a minimal set of mask slots by linear scan over their
+// live ranges. A value read inside a fixpoint loop but defined before it stays
+// live until the loop ends; the frontier and body result of a loop keep their
+// slots for the whole loop because the interpreter swaps their buffers.
+
+#define NO_VREG UINT32_MAX
+
+// Largest class built as an OR of OptimizedText byte masks; a table scan of
+// the text is cheaper beyond that
+#define CLASS_MASK_MAX_OR 64
+
+typedef struct {
+    size_t pc;
+    uint32_t vreg;
+} vreg_use_t;
+
+typedef struct {
+    size_t begin;   // pc of FIX_BEGIN
+    size_t end;     // pc of FIX_END
+} loop_range_t;
+
+// A compiled subexpression: elem applied to vreg input is in vreg output,
+// valid while loop (0: none) is open
+typedef struct {
+    const regex_element_t *elem;    // NULL: empty slot
+    uint32_t input;
+    uint32_t output;
+    uint32_t loop;
+} memo_entry_t;
+
+typedef struct {
+    program_t *program;
+    
+    size_t *start;          // per vreg: first pc that needs its slot
+    size_t *last;           // per vreg: last pc that reads it
+    size_t vreg_count;
+    size_t vreg_capacity;
+    
+    vreg_use_t *uses;
+    size_t use_count;
+    size_t use_capacity;
+    
+    loop_range_t *loops;
+    size_t loop_count;
+    size_t loop_capacity;
+    
+    uint64_t (*mask_sets)[4];   // byte set of each hoisted mask
+    uint32_t *mask_vregs;
+    size_t mask_count;
+    size_t mask_capacity;
+    
+    memo_entry_t *memo;         // open addressing, capacity a power of two
+    size_t memo_count;
+    size_t memo_capacity;
+    uint32_t *open_loops;       // loops whose body is being compiled, innermost last
+    size_t open_count;
+    size_t open_capacity;
+    uint32_t loop_ids;
+    
+    size_t string_capacity;
+    size_t nfa_capacity;
+} compiler_t;
+
+static const char *op_names[] = {
+    "literal-mask", "class-mask", "and-shift", "closure", "string", "or", "fix-begin", "fix-end", "nfa"
+};
+
+static bool grow(void **array, size_t *capacity, size_t needed, size_t elem_size) {
+    if (needed <= *capacity) return true;
+    
+    size_t new_capacity = *capacity ? *capacity * 2 : 8;
+    while (new_capacity < needed) new_capacity *= 2;
+    
+    void *new_array = realloc(*array, new_capacity * elem_size);
+    if (!new_array) return false;
+    
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+static uint32_t new_vreg(compiler_t *c) {
+    size_t capacity = c->vreg_capacity;
+    if (!grow((void **)&c->start, &capacity, c->vreg_count + 1, sizeof(size_t))) return NO_VREG;
+    capacity = c->vreg_capacity;
+    if (!grow((void **)&c->last, &capacity, c->vreg_count + 1, sizeof(size_t))) return NO_VREG;
+    c->vreg_capacity = capacity;
+    
+    // Defined by the instruction about to be emitted
+    c->start[c->vreg_count] = c->program->length;
+    c->last[c->vreg_count] = c->program->length;
+    return (uint32_t)c->vreg_count++;
+}
+
+static bool add_use(compiler_t *c, uint32_t vreg, size_t pc) {
+    if (!grow((void **)&c->uses, &c->use_capacity, c->use_count + 1, sizeof(vreg_use_t))) return false;
+    c->uses[c->use_count].pc = pc;
+    c->uses[c->use_count].vreg = vreg;
+    c->use_count++;
+    return true;
+}
+
+// Append an instruction; returns its pc, or SIZE_MAX on allocation failure
+static size_t emit(compiler_t *c, program_op_t op, uint32_t dst, uint32_t a, uint32_t b, uint32_t arg) {
+    program_t *program = c->program;
+    if (dst == NO_VREG) return SIZE_MAX;
+    if (!grow((void **)&program->code, &program->capacity, program->length + 1, sizeof(program_instr_t))) {
+        return SIZE_MAX;
+    }
+    
+    size_t pc = program->length;
+    bool ok = true;
+    switch (op) {
+        case OP_LITERAL_MASK:
+        case OP_CLASS_MASK:
+            break;
+        case OP_FIX_BEGIN:
+            ok = add_use(c, a, pc);
+            break;
+        case OP_STRING:
+            // b indexes program->strings; its masks live to the end anyway
+            ok = a != NO_VREG && add_use(c, a, pc);
+            break;
+        case OP_FIX_END:
+            ok = add_use(c, dst, pc) && add_use(c, a, pc) && add_use(c, b, pc);
+            break;
+        case OP_NFA:
+            // b is the pc past the subtree, set once its code is emitted
+            ok = a != NO_VREG && add_use(c, a, pc);
+            break;
+        default:
+            ok = a != NO_VREG && b != NO_VREG && add_use(c, a, pc) && add_use(c, b, pc);
+            break;
+    }
+    if (!ok) return SIZE_MAX;
+    
+    program_instr_t *instr = &program->code[program->length++];
+    instr->op = op;
+    instr->dst = dst;
+    instr->a = a;
+    instr->b = b;
+    instr->arg = arg;
+    return pc;
+}
+
+// Emit the mask of a byte set unless one was already emitted for it
+static bool hoist_set(compiler_t *c, const uint64_t set[4]) {
+    for (size_t i = 0; i < c->mask_count; i++) {
+        if (memcmp(c->mask_sets[i], set, 4 * sizeof(uint64_t)) == 0) return true;
+    }
+    
+    size_t capacity = c->mask_capacity;
+    if (!grow((void **)&c->mask_sets, &capacity, c->mask_count + 1, 4 * sizeof(uint64_t))) return false;
+    capacity = c->mask_capacity;
+    if (!grow((void **)&c->mask_vregs, &capacity, c->mask_count + 1, sizeof(uint32_t))) return false;
+    c->mask_capacity = capacity;
+    
+    // A single byte is looked up directly; anything else gets a class table
+    int bytes = __builtin_popcountll(set[0]) + __builtin_popcountll(set[1]) +
+                __builtin_popcountll(set[2]) + __builtin_popcountll(set[3]);
+    uint32_t vreg = new_vreg(c);
+    size_t pc;
+    if (bytes == 1) {
+        uint32_t byte = 0;
+        while (!((set[byte >> 6] >> (byte & 63)) & 1)) byte++;
+        pc = emit(c, OP_LITERAL_MASK, vreg, NO_VREG, NO_VREG, byte);
+    } else {
+        program_t *program = c->program;
+        size_t class_capacity = program->class_count;
+        if (!grow((void **)&program->classes, &class_capacity, program->class_count + 1, 4 * sizeof(uint64_t))) {
+            return false;
+        }
+        memcpy(program->classes[program->class_count], set, 4 * sizeof(uint64_t));
+        pc = emit(c, OP_CLASS_MASK, vreg, NO_VREG, NO_VREG, (uint32_t)program->class_count++);
+    }
+    if (pc == SIZE_MAX) return false;
+    
+    memcpy(c->mask_sets[c->mask_count], set, 4 * sizeof(uint64_t));
+    c->mask_vregs[c->mask_count++] = vreg;
+    return true;
+}
+
+// Emit one mask per distinct byte set used by the tree, in tree order
+static bool hoist_masks(compiler_t *c, const regex_element_t *elem) {
+    if (!elem) return true;
+    
+    if (elem->type == REGEX_STRING) {
+        const string_data_t *data = (const string_data_t *)elem->data;
+        for (size_t k = 0; k < data->length; k++) {
+            if (!hoist_set(c, data->sets[k])) return false;
+        }
+        return true;
+    }
+    
+    uint64_t set[4];
+    if (!regex_element_byte_set(elem, set)) {
+        return hoist_masks(c, elem->left) && hoist_masks(c, elem->right);
+    }
+    return hoist_set(c, set);
+}
+
+static uint32_t mask_vreg(compiler_t *c, const uint64_t set[4]) {
+    for (size_t i = 0; i < c->mask_count; i++) {
+        if (memcmp(c->mask_sets[i], set, 4 * sizeof(uint64_t)) == 0) return c->mask_vregs[i];
+    }
+    return NO_VREG;
+}
+
+static uint32_t compile_element(compiler_t *c, const regex_element_t *elem, uint32_t input);
+
+// Common subexpressions. A value computed inside a fixpoint body changes from
+// round to round, so it is reused only while that loop is still open; values
+// from outside a loop are loop-invariant inside it.
+static bool memo_live(const compiler_t *c, uint32_t loop) {
+    if (loop == 0) return true;
+    for (size_t i = 0; i < c->open_count; i++) {
+        if (c->open_loops[i] == loop) return true;
+    }
+    return false;
+}
+
+static size_t memo_slot(const compiler_t *c, const regex_element_t *elem, uint32_t input) {
+    size_t mask = c->memo_capacity - 1;
+    size_t i = (size_t)((elem->hash ^ (input * 0x9E3779B97F4A7C15ULL)) >> 7) & mask;
+    while (c->memo[i].elem &&
+           !(c->memo[i].input == input && regex_element_equal(c->memo[i].elem, elem))) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static uint32_t memo_find(const compiler_t *c, const regex_element_t *elem, uint32_t input) {
+    if (c->memo_count == 0) return NO_VREG;
+    const memo_entry_t *entry = &c->memo[memo_slot(c, elem, input)];
+    return entry->elem && memo_live(c, entry->loop) ? entry->output : NO_VREG;
+}
+
+static bool memo_add(compiler_t *c, const regex_element_t *elem, uint32_t input, uint32_t output) {
+    if (2 * (c->memo_count + 1) > c->memo_capacity) {
+        size_t old_capacity = c->memo_capacity;
+        memo_entry_t *old = c->memo;
+        c->memo_capacity = old_capacity ? 2 * old_capacity : 64;
+        c->memo = calloc(c->memo_capacity, sizeof(memo_entry_t));
+        if (!c->memo) {
+            c->memo = old;
+            c->memo_capacity = old_capacity;
+            return false;
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].elem) c->memo[memo_slot(c, old[i].elem, old[i].input)] = old[i];
+        }
+        free(old);
+    }
+    
+    // A stale entry for the same key (from a closed loop) is replaced
+    memo_entry_t *entry = &c->memo[memo_slot(c, elem, input)];
+    if (!entry->elem) c->memo_count++;
+    entry->elem = elem;
+    entry->input = input;
+    entry->output = output;
+    entry->loop = c->open_count ? c->open_loops[c->open_count - 1] : 0;
+    return true;
+}
+
+// Emit the instructions for elem applied to the value in vreg input;
+// returns the vreg holding the result, or NO_VREG on failure
+static uint32_t compile_node(compiler_t *c, const regex_element_t *elem, uint32_t input) {
+    
+    uint64_t set[4];
+    uint32_t out;
+    
+    switch (elem->type) {
+        case REGEX_LITERAL:
+        case REGEX_ANY_CHAR:
+        case REGEX_CHAR_CLASS:
+            regex_element_byte_set(elem, set);
+            out = new_vreg(c);
+            if (emit(c, OP_AND_SHIFT, out, input, mask_vreg(c, set), 0) == SIZE_MAX) return NO_VREG;
+            return out;
+            
+        case REGEX_STRING: {
+            const string_data_t *data = (const string_data_t *)elem->data;
+            program_t *program = c->program;
+            if (!grow((void **)&program->strings, &c->string_capacity, program->string_count + 1,
+                      sizeof(program_string_t))) {
+                return NO_VREG;
+            }
+            program_string_t *str = &program->strings[program->string_count];
+            str->masks = malloc(data->length * sizeof(uint32_t));
+            if (!str->masks) return NO_VREG;
+            str->length = data->length;
+            str->carry = 0;
+            for (size_t k = 0; k < data->length; k++) {
+                str->masks[k] = mask_vreg(c, data->sets[k]);
+            }
+            
+            out = new_vreg(c);
+            if (emit(c, OP_STRING, out, input, (uint32_t)program->string_count++, 0) == SIZE_MAX) {
+                return NO_VREG;
+            }
+            return out;
+        }
+        
+        case REGEX_CONCAT:
+            return compile_element(c, elem->right, compile_element(c, elem->left, input));
+            
+        case REGEX_ALTERNATION: {
+            uint32_t left = compile_element(c, elem->left, input);
+            uint32_t right = compile_element(c, elem->right, input);
+            if (left == NO_VREG || right == NO_VREG) return NO_VREG;
+            out = new_vreg(c);
+            if (emit(c, OP_OR, out, left, right, 0) == SIZE_MAX) return NO_VREG;
+            return out;
+        }
+        
+        case REGEX_QUESTION: {
+            uint32_t inner = compile_element(c, elem->left, input);
+            if (inner == NO_VREG) return NO_VREG;
+            out = new_vreg(c);
+            if (emit(c, OP_OR, out, inner, input, 0) == SIZE_MAX) return NO_VREG;
+            return out;
+        }
+        
+        case REGEX_KLEENE_STAR:
+        case REGEX_PLUS: {
+            bool star = elem->type == REGEX_KLEENE_STAR;
+            
+            // Single-character inner element: one carry-propagation pass
+            if (regex_element_byte_set(elem->left, set)) {
+                out = new_vreg(c);
+                if (emit(c, OP_CLOSURE, out, input, mask_vreg(c, set), star ? 0 : 1) == SIZE_MAX) {
+                    return NO_VREG;
+                }
+                return out;
+            }
+            
+            // A loop small enough for an NFA may run as one pass of it
+            // instead, jumping over the fixpoint; the planner decides per
+            // match (see OP_NFA)
+            out = new_vreg(c);
+            size_t nfa_pc = SIZE_MAX;
+            regex_nfa_t *nfa = nfa_compile(elem);
+            if (nfa) {
+                program_t *program = c->program;
+                if (!grow((void **)&program->nfas, &c->nfa_capacity, program->nfa_count + 1,
+                          sizeof(program_nfa_t))) {
+                    nfa_destroy(nfa);
+                    return NO_VREG;
+                }
+                program->nfas[program->nfa_count].nfa = nfa;
+                program->nfas[program->nfa_count].carry = 0;
+                nfa_pc = emit(c, OP_NFA, out, input, 0, (uint32_t)program->nfa_count++);
+                if (nfa_pc == SIZE_MAX) return NO_VREG;
+            }
+            
+            // Semi-naive fixpoint: the body runs on the frontier until a round
+            // adds nothing. X* starts from the input, X+ from the empty set.
+            uint32_t frontier = new_vreg(c);
+            size_t begin = emit(c, OP_FIX_BEGIN, out, input, frontier, star ? 1 : 0);
+            if (begin == SIZE_MAX) return NO_VREG;
+            
+            if (!grow((void **)&c->open_loops, &c->open_capacity, c->open_count + 1, sizeof(uint32_t))) {
+                return NO_VREG;
+            }
+            c->open_loops[c->open_count++] = ++c->loop_ids;
+            uint32_t next = compile_element(c, elem->left, frontier);
+            c->open_count--;
+            if (next == NO_VREG) return NO_VREG;
+            c->start[next] = begin;
+            
+            size_t end = emit(c, OP_FIX_END, out, next, frontier, (uint32_t)(begin + 1));
+            if (end == SIZE_MAX) return NO_VREG;
+            if (!grow((void **)&c->loops, &c->loop_capacity, c->loop_count + 1, sizeof(loop_range_t))) {
+                return NO_VREG;
+            }
+            c->loops[c->loop_count].begin = begin;
+            c->loops[c->loop_count].end = end;
+            c->loop_count++;
+            if (nfa_pc != SIZE_MAX) c->program->code[nfa_pc].b = (uint32_t)(end + 1);
+            return out;
+        }
+    }
+    
+    return NO_VREG;
+}
+
+// compile_node, reusing the value of an equal subtree already applied to the
+// same input
+static uint32_t compile_element(compiler_t *c, const regex_element_t *elem, uint32_t input) {
+    if (!elem || input == NO_VREG) return NO_VREG;
+    
+    uint32_t out = memo_find(c, elem, input);
+    if (out != NO_VREG) return out;
+    
+    out = compile_node(c, elem, input);
+    if (out == NO_VREG || !memo_add(c, elem, input, out)) return NO_VREG;
+    return out;
+}
+
+// Linear-scan assignment of vregs to slots. A slot is reused only once its
+// previous value is dead strictly before the new value is defined, so an
+// instruction never writes a slot that one of its operands occupies.
+static bool allocate_slots(compiler_t *c, uint32_t input, const uint32_t *outputs, size_t output_count) {
+    program_t *program = c->program;
+    size_t end = program->length;
+    
+    for (size_t i = 0; i < c->use_count; i++) {
+        const vreg_use_t *use = &c->uses[i];
+        size_t last = use->pc;
+        // Values entering a loop are read again on every round
+        for (size_t l = 0; l < c->loop_count; l++) {
+            const loop_range_t *loop = &c->loops[l];
+            if (loop->begin <= use->pc && use->pc <= loop->end &&
+                c->start[use->vreg] < loop->begin && loop->end > last) {
+                last = loop->end;
+            }
+        }
+        if (last > c->last[use->vreg]) c->last[use->vreg] = last;
+    }
+    
+    // The input is bound to the caller's start mask and the hoisted masks
+    // may alias OptimizedText masks: neither slot can be handed on
+    c->last[input] = end;
+    for (size_t k = 0; k < output_count; k++) {
+        c->last[outputs[k]] = end;
+    }
+    for (size_t i = 0; i < c->mask_count; i++) {
+        c->last[c->mask_vregs[i]] = end;
+    }
+    
+    uint32_t *slot_of = malloc(c->vreg_count * sizeof(uint32_t));
+    size_t *slot_free_after = malloc((c->vreg_count + 1) * sizeof(size_t));
+    bool *assigned = calloc(c->vreg_count, sizeof(bool));
+    if (!slot_of || !slot_free_after || !assigned) {
+        free(slot_of);
+        free(slot_free_after);
+        free(assigned);
+        return false;
+    }
+    
+    size_t slot_count = 0;
+    for (size_t n = 0; n < c->vreg_count; n++) {
+        // Next unassigned vreg by start pc
+        size_t v = SIZE_MAX;
+        for (size_t i = 0; i < c->vreg_count; i++) {
+            if (!assigned[i] && (v == SIZE_MAX || c->start[i] < c->start[v])) v = i;
+        }
+        assigned[v] = true;
+        
+        size_t slot = slot_count;
+        for (size_t s = 0; s < slot_count; s++) {
+            if (slot_free_after[s] < c->start[v]) {
+                slot = s;
+                break;
+            }
+        }
+        if (slot == slot_count) slot_count++;
+        slot_free_after[slot] = c->last[v];
+        slot_of[v] = (uint32_t)slot;
+    }
+    
+    for (size_t pc = 0; pc < program->length; pc++) {
+        program_instr_t *instr = &program->code[pc];
+        instr->dst = slot_of[instr->dst];
+        if (instr->op == OP_STRING) {
+            program_string_t *str = &program->strings[instr->b];
+            instr->a = slot_of[instr->a];
+            for (size_t k = 0; k < str->length; k++) {
+                str->masks[k] = slot_of[str->masks[k]];
+            }
+        } else if (instr->op == OP_NFA) {
+            instr->a = slot_of[instr->a];
+        } else if (instr->op != OP_LITERAL_MASK && instr->op != OP_CLASS_MASK) {
+            instr->a = slot_of[instr->a];
+            instr->b = slot_of[instr->b];
+        }
+    }
+    
+    program->slot_count = slot_count;
+    program->input_slot = slot_of[input];
+    for (size_t k = 0; k < output_count; k++) {
+        program->output_slots[k] = slot_of[outputs[k]];
+    }
+    program->output_slot = program->output_slots[0];
+    
+    free(slot_of);
+    free(slot_free_after);
+    free(assigned);
+    return true;
+}
+
+// Append to program->prefix the bytes every match of elem starts with.
+// True if elem is literal throughout, so the prefix may run on past it.
+static bool literal_prefix(program_t *program, const regex_element_t *elem) {
+    if (elem->type == REGEX_CONCAT) {
+        return literal_prefix(program, elem->left) && literal_prefix(program, elem->right);
+    }
+    
+    const uint64_t (*sets)[4];
+    size_t length;
+    uint64_t set[4];
+    if (elem->type == REGEX_STRING) {
+        const string_data_t *data = (const string_data_t *)elem->data;
+        sets = (const uint64_t (*)[4])data->sets;
+        length = data->length;
+    } else if (regex_element_byte_set(elem, set)) {
+        sets = (const uint64_t (*)[4])&set;
+        length = 1;
+    } else {
+        return false;
+    }
+    
+    for (size_t k = 0; k < length; k++) {
+        int bytes = __builtin_popcountll(sets[k][0]) + __builtin_popcountll(sets[k][1]) +
+                    __builtin_popcountll(sets[k][2]) + __builtin_popcountll(sets[k][3]);
+        if (bytes != 1 || program->prefix_length == PROGRAM_PREFIX_MAX) return false;
+        unsigned int byte = 0;
+        while (!((sets[k][byte >> 6] >> (byte & 63)) & 1)) byte++;
+        program->prefix[program->prefix_length++] = (unsigned char)byte;
+    }
+    return true;
+}
+
+// Compile count trees into one program sharing the start mask and the hoisted
+// text masks; tree k leaves its result in output_slots[k]
+program_t *program_compile_set(regex_element_t *const *roots, size_t count, flowregex_error_t *error) {
+    if (error) *error = FLOWREGEX_OK;
+    if (!roots || count == 0) {
+        if (error) *error = FLOWREGEX_ERROR_INVALID_PATTERN;
+        return NULL;
+    }
+    for (size_t k = 0; k < count; k++) {
+        if (!roots[k]) {
+            if (error) *error = FLOWREGEX_ERROR_INVALID_PATTERN;
+            return NULL;
+        }
+    }
+    
+    program_t *program = calloc(1, sizeof(program_t));
+    uint32_t *outputs = malloc(count * sizeof(uint32_t));
+    compiler_t c;
+    memset(&c, 0, sizeof(c));
+    c.program = program;
+    
+    bool ok = program && outputs;
+    if (ok) {
+        program->output_slots = malloc(count * sizeof(uint32_t));
+        program->output_count = count;
+        uint32_t input = new_vreg(&c);
+        ok = program->output_slots && input != NO_VREG;
+        for (size_t k = 0; ok && k < count; k++) {
+            ok = hoist_masks(&c, roots[k]);
+        }
+        for (size_t k = 0; ok && k < count; k++) {
+            outputs[k] = compile_element(&c, roots[k], input);
+            ok = outputs[k] != NO_VREG;
+        }
+        ok = ok && allocate_slots(&c, input, outputs, count);
+    }
+    
+    // The partial-match carries of strings, then the states of NFAs,
+    // follow the per-pc ones
+    if (ok) {
+        program->carry_count = program->length;
+        for (size_t i = 0; i < program->string_count; i++) {
+            program->strings[i].carry = program->carry_count;
+            program->carry_count += program->strings[i].length - 1;
+        }
+        for (size_t i = 0; i < program->nfa_count; i++) {
+            program->nfas[i].carry = program->carry_count;
+            program->carry_count += program->nfas[i].nfa->states;
+        }
+        // A set's trees start in different places; only one tree is prefiltered
+        if (count == 1) literal_prefix(program, roots[0]);
+    }
+    
+    free(outputs);
+    free(c.start);
+    free(c.last);
+    free(c.uses);
+    free(c.loops);
+    free(c.mask_sets);
+    free(c.mask_vregs);
+    free(c.memo);
+    free(c.open_loops);
+    
+    if (!ok) {
+        program_destroy(program);
+        if (error) *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    return program;
+}
+
+program_t *program_compile(const regex_element_t *root, flowregex_error_t *error) {
+    regex_element_t *roots[1] = {(regex_element_t *)root};
+    return program_compile_set(roots, 1, error);
+}
+
+void program_destroy(program_t *program) {
+    if (program) {
+        free(program->code);
+        free(program->classes);
+        for (size_t i = 0; i < program->string_count; i++) {
+            free(program->strings[i].masks);
+        }
+        free(program->strings);
+        for (size_t i = 0; i < program->nfa_count; i++) {
+            nfa_destroy(program->nfas[i].nfa);
+        }
+        free(program->nfas);
+        free(program->output_slots);
+        free(program);
+    }
+}
+
+const char *program_op_name(program_op_t op) {
+    return op_names[op];
+}
+
+static void print_instr(const program_t *program, const program_instr_t *instr, size_t pc) {
+    printf("%4zu  %-12s r%u", pc, op_names[instr->op], instr->dst);
+    switch (instr->op) {
+        case OP_LITERAL_MASK:
+            printf(", '%c'\n", (char)instr->arg);
+            break;
+        case OP_CLASS_MASK:
+            printf(", class %u\n", instr->arg);
+            break;
+        case OP_CLOSURE:
+            printf(", r%u, r%u%s\n", instr->a, instr->b, instr->arg ? ", plus" : "");
+            break;
+        case OP_STRING: {
+            const program_string_t *str = &program->strings[instr->b];
+            printf(", r%u, [", instr->a);
+            for (size_t k = 0; k < str->length; k++) {
+                printf("%sr%u", k ? " " : "", str->masks[k]);
+            }
+            printf("]\n");
+            break;
+        }
+        case OP_FIX_BEGIN:
+            printf(", r%u, frontier r%u%s\n", instr->a, instr->b, instr->arg ? "" : ", plus");
+            break;
+        case OP_FIX_END:
+            printf(", r%u, frontier r%u, loop %u\n", instr->a, instr->b, instr->arg);
+            break;
+        case OP_NFA:
+            printf(", r%u, %zu states, past %u\n", instr->a, program->nfas[instr->arg].nfa->states, instr->b);
+            break;
+        default:
+            printf(", r%u, r%u\n", instr->a, instr->b);
+            break;
+    }
+}
+
+void program_print(const program_t *program) {
+    if (!program) return;
+    
+    printf("Program: %zu instructions, %zu slots (input r%u, output r%u",
+           program->length, program->slot_count, program->input_slot, program->output_slot);
+    for (size_t k = 1; k < program->output_count; k++) {
+        printf(", r%u", program->output_slots[k]);
+    }
+    printf(")\n");
+    if (program->prefix_length > 0) {
+        printf("Prefix: '%.*s'\n", (int)program->prefix_length, (const char *)program->prefix);
+    }
+    for (size_t pc = 0; pc < program->length; pc++) {
+        print_instr(program, &program->code[pc], pc);
+    }
+}
+
+// Bytes whose OptimizedText masks a run of the program reads: literal bytes,
+// and the members (or non-members, for mostly-full sets) of classes small
+// enough to be built as an OR of byte masks
+void program_index_bytes(const program_t *program, uint64_t set[4]) {
+    memset(set, 0, 4 * sizeof(uint64_t));
+    if (!program) return;
+    
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        if (instr->op == OP_LITERAL_MASK) {
+            set[instr->arg >> 6] |= 1ULL << (instr->arg & 63);
+        } else if (instr->op == OP_CLASS_MASK) {
+            const uint64_t *class_set = program->classes[instr->arg];
+            int members = __builtin_popcountll(class_set[0]) + __builtin_popcountll(class_set[1]) +
+                          __builtin_popcountll(class_set[2]) + __builtin_popcountll(class_set[3]);
+            bool complement = members > 128;
+            if ((complement ? 256 - members : members) > CLASS_MASK_MAX_OR) continue;
+            for (int w = 0; w < 4; w++) {
+                set[w] |= complement ? ~class_set[w] : class_set[w];
+            }
+        }
+    }
+}
+
+// Positions of text whose byte is in set
+static bool build_class_mask(bitmask_t *dest, const flowregex_ctx_t *ctx, const uint64_t set[4]) {
+    const unsigned char *text = (const unsigned char *)ctx->text;
+    
+    bitmask_clear_all(dest);
+    uint64_t *words = bitmask_words(dest);
+    if (!words) return false;
+    for (size_t w = 0; w < dest->capacity; w++) {
+        size_t base = w * 64;
+        size_t end = base + 64 < ctx->text_len ? base + 64 : ctx->text_len;
+        uint64_t word = 0;
+        for (size_t i = base; i < end; i++) {
+            unsigned char c = text[i];
+            word |= ((set[c >> 6] >> (c & 63)) & 1) << (i - base);
+        }
+        words[w] = word;
+    }
+    return true;
+}
+
+// Positions holding byte c: the OptimizedText mask if it has one, otherwise
+// built into dest. Returns the mask to read (NULL if memory ran out).
+static bitmask_t *literal_mask(bitmask_t *dest, const flowregex_ctx_t *ctx, unsigned char c) {
+    bitmask_t *mask = optimized_text_get_match_mask(ctx->opt_text, (char)c);
+    if (mask && mask->size == dest->size) return mask;
+    
+    if (!bitmask_match_bytes(&dest, &c, 1, ctx->text, ctx->text_len)) return NULL;
+    bitmask_optimize(dest);
+    return dest;
+}
+
+// Positions holding a byte of set. With an OptimizedText that has masks for
+// every member (or every non-member, for mostly-full sets like [^\n]) the
+// mask is a word-level OR of those byte masks; otherwise the text is scanned
+// once against the table. A rare class comes out as positions (see
+// bitmask_optimize), so the steps over it are taken per position.
+static bool class_mask(bitmask_t *dest, const flowregex_ctx_t *ctx, const uint64_t set[4]) {
+    int members = __builtin_popcountll(set[0]) + __builtin_popcountll(set[1]) +
+                  __builtin_popcountll(set[2]) + __builtin_popcountll(set[3]);
+    bool complement = members > 128;
+    int count = complement ? 256 - members : members;
+    
+    bool from_index = ctx->opt_text && count <= CLASS_MASK_MAX_OR &&
+                      ctx->opt_text->text_length == ctx->text_len;
+    for (int c = 0; from_index && c < 256; c++) {
+        bool member = (set[c >> 6] >> (c & 63)) & 1;
+        if (member != complement) {
+            from_index = optimized_text_has_match_mask(ctx->opt_text, (char)c);
+        }
+    }
+    
+    if (from_index) {
+        bitmask_clear_all(dest);
+        for (int c = 0; from_index && c < 256; c++) {
+            bool member = (set[c >> 6] >> (c & 63)) & 1;
+            if (member == complement) continue;
+            bitmask_t *mask = optimized_text_get_match_mask(ctx->opt_text, (char)c);
+            if (!mask) {
+                from_index = false;
+            } else if (!bitmask_or(dest, mask)) {
+                return false;
+            }
+        }
+    }
+    
+    if (!from_index) {
+        if (!build_class_mask(dest, ctx, set)) return false;
+    } else if (complement) {
+        // Only text positions hold a byte
+        if (!bitmask_not(dest) || !bitmask_clear(dest, ctx->text_len)) return false;
+    }
+    bitmask_optimize(dest);
+    return true;
+}
+
+// Whether byte set holds the text byte at pos (never past the text)
+static inline bool text_in(const flowregex_ctx_t *ctx, const uint64_t set[4], size_t pos) {
+    if (pos >= ctx->text_len) return false;
+    unsigned char c = (unsigned char)ctx->text[pos];
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+// Chunk boundary handling for a consuming instruction at pc (see
+// flowregex_ctx_t.carry_in). Bit 0 of a chunk is the previous chunk's last
+// bit, so an incoming carry sets it; for a closure over set it also extends
+// through the run of matching bytes starting there. The outgoing carry is the
+// output's last bit, accumulated over every execution of the instruction
+// (all rounds of an enclosing fixpoint).
+static bool chunk_boundary(bitmask_t *dst, const uint64_t *set, flowregex_ctx_t *ctx, size_t pc) {
+    if (ctx->carry_in && ctx->carry_in[pc]) {
+        size_t end = 0;
+        while (set && text_in(ctx, set, end)) end++;
+        if (!bitmask_set_range(dst, 0, end + 1)) return false;
+    }
+    if (ctx->carry_out && bitmask_get(dst, ctx->text_len)) {
+        ctx->carry_out[pc] = 1;
+    }
+    return true;
+}
+
+// Chunk boundary handling for a string step. A partial match of its first j
+// characters (0 < j < length) ending at the last bit carries over as carry
+// index str->carry + j - 1 and resumes at bit 0 of the next chunk. Only the
+// first and last length - 1 positions are involved, so they are walked byte
+// by byte; the full match's own carry is left to chunk_boundary.
+static bool string_walk(bitmask_t *dst, const uint64_t (*sets)[4], const program_string_t *str,
+                        flowregex_ctx_t *ctx, size_t pos, size_t j) {
+    while (j < str->length) {
+        if (pos == ctx->text_len) {
+            if (j > 0 && ctx->carry_out) ctx->carry_out[str->carry + j - 1] = 1;
+            return true;
+        }
+        if (!text_in(ctx, sets[j], pos)) return true;
+        pos++;
+        j++;
+    }
+    return bitmask_set(dst, pos);
+}
+
+static bool string_boundary(bitmask_t *dst, const bitmask_t *src, const uint64_t (*sets)[4],
+                            const program_string_t *str, flowregex_ctx_t *ctx) {
+    size_t n = str->length;
+    size_t text_len = ctx->text_len;
+    
+    if (ctx->carry_in) {
+        for (size_t j = 1; j < n; j++) {
+            if (ctx->carry_in[str->carry + j - 1] && !string_walk(dst, sets, str, ctx, 0, j)) return false;
+        }
+    }
+    
+    // Starts too close to the end for the whole string to fit
+    if (ctx->carry_out) {
+        for (size_t p = text_len > n - 1 ? text_len - (n - 1) : 0; p < text_len; p++) {
+            if (bitmask_get(src, p) && !string_walk(dst, sets, str, ctx, p, 0)) return false;
+        }
+    }
+    return true;
+}
+
+// Sparse steps. Below one live position per word on average (see
+// bitmask_sparse, which leaves such a mask as a position array), a step is
+// cheaper taken from the text at each live position than as word operations
+// over the whole mask, and the text masks it would read are never built: the
+// work, and the masks written, follow the live positions rather than the
+// text. dst never aliases src (see allocate_slots).
+
+// dst = the positions after the live positions of src holding a byte of set
+static bool sparse_and_shift(bitmask_t *dst, const bitmask_t *src, const uint64_t set[4],
+                             const flowregex_ctx_t *ctx) {
+    bitmask_clear_all(dst);
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, src);
+    while (bitmask_iter_next(&it, &pos)) {
+        if (text_in(ctx, set, pos) && !bitmask_set(dst, pos + 1)) return false;
+    }
+    return true;
+}
+
+// dst = the ends of the n steps of sets taken from the live positions of src
+static bool sparse_string(bitmask_t *dst, const bitmask_t *src, const uint64_t (*sets)[4], size_t n,
+                          const flowregex_ctx_t *ctx) {
+    bitmask_clear_all(dst);
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, src);
+    while (bitmask_iter_next(&it, &pos)) {
+        size_t j = 0;
+        while (j < n && text_in(ctx, sets[j], pos + j)) j++;
+        if (j == n && !bitmask_set(dst, pos + n)) return false;
+    }
+    return true;
+}
+
+// dst = the closure of src over set (see bitmask_closure), each walk added
+// as one run. A live position inside a run already walked from an earlier
+// one reaches nothing new.
+static bool sparse_closure(bitmask_t *dst, const bitmask_t *src, const uint64_t set[4], bool at_least_one,
+                           const flowregex_ctx_t *ctx) {
+    bitmask_clear_all(dst);
+    size_t reach = 0;
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, src);
+    while (bitmask_iter_next(&it, &pos)) {
+        if (pos < reach) continue;
+        size_t end = pos;
+        while (text_in(ctx, set, end)) end++;
+        if (!bitmask_set_range(dst, at_least_one ? pos + 1 : pos, end + 1)) return false;
+        reach = end;
+    }
+    return true;
+}
+
+// dst = the subtree of the OP_NFA instruction nfa run from src, in one
+// pass of its automaton. Its states cross chunk boundaries as carries, one
+// per state, accumulated over every execution like chunk_boundary's.
+static bool nfa_step(bitmask_t *dst, bitmask_t *src, const program_nfa_t *sub, flowregex_ctx_t *ctx) {
+    const regex_nfa_t *nfa = sub->nfa;
+    uint64_t state = 0;
+    for (size_t p = 0; ctx->carry_in && p < nfa->states; p++) {
+        if (ctx->carry_in[sub->carry + p]) state |= 1ULL << p;
+    }
+    if (!nfa_run_from(nfa, ctx->text, ctx->text_len, src, &state, dst)) return false;
+    for (size_t p = 0; ctx->carry_out && p < nfa->states; p++) {
+        if ((state >> p) & 1) ctx->carry_out[sub->carry + p] = 1;
+    }
+    return true;
+}
+
+// Whether the plan of ctx runs the OP_NFA instruction at pc. Both ways give
+// the same mask, so a plan made for another program only costs speed. The
+// tiles of a run share its plan, and runs joined by carries never plan an
+// NFA (flowregex_plan): the carries of both sides must agree.
+static bool planned_nfa(const flowregex_ctx_t *ctx, const program_t *program, size_t pc) {
+    return ctx->plan.program == program && ctx->plan.engines && ctx->plan.engines[pc] == ENGINE_NFA;
+}
+
+// Byte set of the hoisted mask in slot s
+static void slot_set(const program_t *program, uint32_t s, uint64_t set[4]) {
+    memset(set, 0, 4 * sizeof(uint64_t));
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        if (instr->op != OP_LITERAL_MASK && instr->op != OP_CLASS_MASK) return;
+        if (instr->dst != s) continue;
+        if (instr->op == OP_CLASS_MASK) {
+            memcpy(set, program->classes[instr->arg], 4 * sizeof(uint64_t));
+        } else {
+            set[instr->arg >> 6] |= 1ULL << (instr->arg & 63);
+        }
+        return;
+    }
+}
+
+// The hoisted mask in slot s, built on its first dense use (NULL on
+// allocation failure). The first literal mask built brings the other
+// literals along in the same pass over the text; masks the OptimizedText
+// already has are borrowed instead.
+static bitmask_t *mask_slot(const program_t *program, flowregex_ctx_t *ctx, bitmask_t **regs,
+                            bitmask_t **own, bitmask_t **pooled, uint32_t s) {
+    if (regs[s]) return regs[s];
+    
+    bitmask_t *masks[256];
+    unsigned char bytes[256];
+    size_t count = 0;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        const program_instr_t *instr = &program->code[pc];
+        if (instr->op != OP_LITERAL_MASK && instr->op != OP_CLASS_MASK) break;
+        uint32_t d = instr->dst;
+        bool single = instr->op == OP_CLASS_MASK || optimized_text_has_match_mask(ctx->opt_text, (char)instr->arg);
+        if (regs[d] || (single && d != s)) continue;
+        
+        if (!own[d]) {
+            own[d] = pooled[d] = bitmask_pool_acquire(ctx->pool, ctx->initial->size);
+            if (!own[d]) return NULL;
+        }
+        if (instr->op == OP_CLASS_MASK) {
+            if (!class_mask(own[d], ctx, program->classes[instr->arg])) return NULL;
+            regs[d] = own[d];
+        } else if (single) {
+            regs[d] = literal_mask(own[d], ctx, (unsigned char)instr->arg);
+            if (!regs[d]) return NULL;
+        } else {
+            masks[count] = own[d];
+            bytes[count++] = (unsigned char)instr->arg;
+            regs[d] = own[d];
+        }
+    }
+    
+    if (count > 0 && !bitmask_match_bytes(masks, bytes, count, ctx->text, ctx->text_len)) return NULL;
+    return regs[s];
+}
+
+// Start mask of a prefixed program: the prefix's occurrences (found of
+// them), plus in a chunked run the last positions, where an occurrence may
+// run on into the next chunk (the program itself rejects the ones that do
+// not). Occurrences too dense for sparse steps fall back to starting
+// everywhere.
+static bitmask_t *prefilter_starts(const program_t *program, flowregex_ctx_t *ctx, size_t *found) {
+    bitmask_t *starts = flowregex_ctx_starts(ctx);
+    if (!starts) return NULL;
+    
+    size_t n = program->prefix_length;
+    *found = bitmask_find_string(starts, ctx->text, ctx->text_len, program->prefix, n, 64);
+    if (*found == SIZE_MAX) return ctx->initial;
+    if (ctx->carry_out) {
+        size_t from = ctx->text_len >= n - 1 ? ctx->text_len - (n - 1) : 0;
+        if (!bitmask_set_range(starts, from, ctx->text_len)) return NULL;
+    }
+    return starts;
+}
+
+// Run a single-output program over the text window positions at a time,
+// each window matched as a chunk (see flowregex_ctx_t.carry_in) from its own
+// starts and the carries of the one before. Only the window's masks are live
+// at once. With skip, the run goes straight from a window without carries
+// to the window of the next start.
+static bool run_windows(const program_t *program, flowregex_ctx_t *ctx, const bitmask_t *starts,
+                        bitmask_t *output, size_t window, bool skip) {
+    flowregex_ctx_t *sub = flowregex_ctx_window(ctx);
+    size_t carry_len = program->carry_count ? program->carry_count : 1;
+    uint8_t *carry = malloc(2 * carry_len);
+    if (!sub || !carry) {
+        free(carry);
+        return false;
+    }
+    uint8_t *carry_in = carry;
+    uint8_t *carry_out = carry + carry_len;
+    bool carrying = false;
+    sub->plan = ctx->plan;
+    
+    bitmask_clear_all(output);
+    bool ok = true;
+    for (size_t w = 0; ok && (w == 0 || w < ctx->text_len); w += window) {
+        if (skip && !carrying) {
+            size_t next = bitmask_next(starts, w);
+            if (next == SIZE_MAX) break;
+            w = next / window * window;
+            if (w >= ctx->text_len && w != 0) break;
+        }
+        
+        size_t end = ctx->text_len - w > window ? w + window : ctx->text_len;
+        sub->carry_only = true;
+        ok = flowregex_ctx_bind_text(sub, ctx->text + w, end - w) &&
+             bitmask_copy_range(sub->initial, starts, w);
+        if (!ok) break;
+        
+        memset(carry_out, 0, carry_len);
+        sub->carry_in = carrying ? carry_in : NULL;
+        sub->carry_out = carry_out;
+        ok = program_run(program, sub) && bitmask_or_at(output, sub->result, w);
+        if (!ok) break;
+        
+        carrying = false;
+        for (size_t i = 0; i < carry_len; i++) carrying |= carry_out[i] != 0;
+        uint8_t *tmp = carry_in;
+        carry_in = carry_out;
+        carry_out = tmp;
+    }
+    
+    sub->carry_in = NULL;
+    sub->carry_out = NULL;
+    sub->carry_only = false;
+    free(carry);
+    return ok;
+}
+
+// Run a single-output program from the positions in starts alone, one
+// FLOWREGEX_SPARSE_WINDOW window at a time; windows the starts and their
+// carries never reach are skipped, so the work follows the starts rather
+// than the text.
+bool program_run_sparse(const program_t *program, flowregex_ctx_t *ctx, const bitmask_t *starts, bitmask_t *output) {
+    return run_windows(program, ctx, starts, output, FLOWREGEX_SPARSE_WINDOW, true);
+}
+
+// Run the program from ctx->initial into outputs (one mask of the bound
+// text's size per program output). A program with a literal prefix starts
+// only where the prefix occurs, and stops there if it occurs nowhere.
+// The register file keeps two pointers per slot: the buffer the slot
+// currently reads (regs) and the buffer it owns (own). They differ only for
+// masks borrowed from the OptimizedText and for the frontier/result pair of
+// a running fixpoint.
+bool program_run_outputs(const program_t *program, flowregex_ctx_t *ctx, bitmask_t *const *outputs) {
+    if (!program || !ctx || !ctx->initial || !outputs) return false;
+    
+    size_t n = program->slot_count;
+    if (ctx->slot_capacity < 3 * n) {
+        bitmask_t **slots = realloc(ctx->slots, 3 * n * sizeof(bitmask_t *));
+        if (!slots) return false;
+        ctx->slots = slots;
+        ctx->slot_capacity = 3 * n;
+    }
+    bitmask_t **regs = ctx->slots;
+    bitmask_t **own = ctx->slots + n;
+    bitmask_t **pooled = ctx->slots + 2 * n;    // scratch buffers to release
+    
+    bitmask_t *input = ctx->initial;
+    if (program->prefix_length > 0 && !ctx->carry_only && !ctx->no_prefilter) {
+        size_t found;
+        input = prefilter_starts(program, ctx, &found);
+        if (!input) return false;
+        if (!ctx->carry_in && !bitmask_any(input)) {
+            for (size_t k = 0; k < program->output_count; k++) {
+                bitmask_clear_all(outputs[k]);
+            }
+            if (ctx->carry_out) memset(ctx->carry_out, 0, program->carry_count);
+            return true;
+        }
+        // Sparse starts in a long text: only the windows they reach
+        if (input != ctx->initial && !ctx->carry_in && !ctx->carry_out && !ctx->debug &&
+            ctx->text_len >= 4 * FLOWREGEX_SPARSE_WINDOW && found <= ctx->text_len / PROGRAM_SPARSE_BITS + 8) {
+            return program_run_sparse(program, ctx, input, outputs[0]);
+        }
+    }
+    
+    // A long text runs one cache-resident tile at a time instead of one
+    // text-length mask per instruction
+    if (program->output_count == 1 && !ctx->opt_text && !ctx->carry_in && !ctx->carry_out &&
+        !ctx->carry_only && !ctx->debug && ctx->text_len >= 4 * FLOWREGEX_TILE) {
+        return run_windows(program, ctx, input, outputs[0], FLOWREGEX_TILE, input != ctx->initial);
+    }
+    
+    for (size_t s = 0; s < n; s++) {
+        own[s] = NULL;
+        pooled[s] = NULL;
+    }
+    own[program->input_slot] = input;
+    for (size_t k = 0; k < program->output_count; k++) {
+        if (!own[program->output_slots[k]]) own[program->output_slots[k]] = outputs[k];
+    }
+    
+    // The hoisted masks are left to mask_slot, which builds them when a step
+    // first needs them (a debug run builds them in order); until then their
+    // slots hold no buffer
+    size_t pc = 0;
+    while (!ctx->debug && pc < program->length &&
+           (program->code[pc].op == OP_LITERAL_MASK || program->code[pc].op == OP_CLASS_MASK)) {
+        pc++;
+    }
+    
+    bool ok = true;
+    for (size_t s = 0; s < n; s++) {
+        bool hoisted = false;
+        for (size_t i = 0; i < pc; i++) hoisted |= program->code[i].dst == s;
+        if (!own[s] && !hoisted) {
+            own[s] = pooled[s] = ok ? bitmask_pool_acquire(ctx->pool, ctx->initial->size) : NULL;
+            if (!own[s]) ok = false;
+        }
+        regs[s] = own[s];
+    }
+    
+    if (ctx->debug) {
+        program_print(program);
+    }
+    
+    uint64_t sets[REGEX_STRING_MAX][4];
+    while (ok && pc < program->length) {
+        const program_instr_t *instr = &program->code[pc];
+        bitmask_t *dst = regs[instr->dst];
+        
+        if (ctx->debug) {
+            print_instr(program, instr, pc);
+        }
+        
+        switch (instr->op) {
+            case OP_LITERAL_MASK:
+                regs[instr->dst] = literal_mask(dst, ctx, (unsigned char)instr->arg);
+                ok = regs[instr->dst] != NULL;
+                break;
+            case OP_CLASS_MASK:
+                ok = class_mask(dst, ctx, program->classes[instr->arg]);
+                break;
+            case OP_AND_SHIFT:
+                if (bitmask_sparse(regs[instr->a])) {
+                    slot_set(program, instr->b, sets[0]);
+                    ok = sparse_and_shift(dst, regs[instr->a], sets[0], ctx);
+                } else {
+                    const bitmask_t *mask = mask_slot(program, ctx, regs, own, pooled, instr->b);
+                    ok = mask && bitmask_and_shift(dst, regs[instr->a], mask);
+                }
+                if (ok && (ctx->carry_in || ctx->carry_out)) ok = chunk_boundary(dst, NULL, ctx, pc);
+                break;
+            case OP_CLOSURE:
+                slot_set(program, instr->b, sets[0]);
+                if (bitmask_sparse(regs[instr->a])) {
+                    ok = sparse_closure(dst, regs[instr->a], sets[0], instr->arg != 0, ctx);
+                } else {
+                    const bitmask_t *mask = mask_slot(program, ctx, regs, own, pooled, instr->b);
+                    ok = mask && bitmask_closure(dst, regs[instr->a], mask, instr->arg != 0);
+                }
+                if (ok && (ctx->carry_in || ctx->carry_out)) ok = chunk_boundary(dst, sets[0], ctx, pc);
+                break;
+            case OP_STRING: {
+                const program_string_t *str = &program->strings[instr->b];
+                bool sparse = bitmask_sparse(regs[instr->a]);
+                if (sparse || ctx->carry_in || ctx->carry_out) {
+                    for (size_t k = 0; k < str->length; k++) {
+                        slot_set(program, str->masks[k], sets[k]);
+                    }
+                }
+                if (sparse) {
+                    ok = sparse_string(dst, regs[instr->a], (const uint64_t (*)[4])sets, str->length, ctx);
+                } else {
+                    const bitmask_t *masks[REGEX_STRING_MAX];
+                    for (size_t k = 0; ok && k < str->length; k++) {
+                        masks[k] = mask_slot(program, ctx, regs, own, pooled, str->masks[k]);
+                        ok = masks[k] != NULL;
+                    }
+                    ok = ok && bitmask_and_shift_string(dst, regs[instr->a], masks, str->length);
+                }
+                if (ok && (ctx->carry_in || ctx->carry_out)) {
+                    ok = string_boundary(dst, regs[instr->a], (const uint64_t (*)[4])sets, str, ctx) &&
+                         chunk_boundary(dst, NULL, ctx, pc);
+                }
+                break;
+            }
+            case OP_OR:
+                ok = bitmask_copy_into(dst, regs[instr->a]) && bitmask_or(dst, regs[instr->b]);
+                break;
+            case OP_FIX_BEGIN:
+                if (instr->arg) {
+                    ok = bitmask_copy_into(dst, regs[instr->a]);
+                } else {
+                    bitmask_clear_all(dst);
+                }
+                // The first round reads the input in place
+                regs[instr->b] = regs[instr->a];
+                break;
+            case OP_FIX_END: {
+                bitmask_t *next = regs[instr->a];
+                if (!bitmask_andnot(next, dst)) {
+                    ok = false;
+                    break;
+                }
+                if (!bitmask_any(next)) {
+                    regs[instr->a] = own[instr->a];
+                    regs[instr->b] = own[instr->b];
+                    break;
+                }
+                if (!bitmask_or(dst, next)) {
+                    ok = false;
+                    break;
+                }
+                
+                // The new bits become the frontier; the body writes its next
+                // round into the other buffer of the pair
+                bitmask_t *old = regs[instr->b];
+                regs[instr->b] = next;
+                if (old == own[instr->a] || old == own[instr->b]) {
+                    regs[instr->a] = old;
+                } else {
+                    regs[instr->a] = next == own[instr->b] ? own[instr->a] : own[instr->b];
+                }
+                pc = instr->arg;
+                continue;
+            }
+            case OP_NFA:
+                if (!planned_nfa(ctx, program, pc)) break;
+                ok = nfa_step(dst, regs[instr->a], &program->nfas[instr->arg], ctx);
+                pc = instr->b;
+                continue;
+        }
+        
+        #ifdef DEBUG
+        if (ctx->debug) {
+            bitmask_print(regs[instr->dst], "       ");
+        }
+        #endif
+        pc++;
+    }
+    
+    for (size_t s = 0; s < n; s++) {
+        if (pooled[s]) bitmask_pool_release(ctx->pool, pooled[s]);
+    }
+    
+    // Patterns compiled to the same value share a slot
+    for (size_t k = 0; ok && k < program->output_count; k++) {
+        bitmask_t *shared = own[program->output_slots[k]];
+        if (shared != outputs[k]) ok = bitmask_copy_into(outputs[k], shared);
+    }
+    return ok;
+}
+
+// Run a single-output program from ctx->initial into ctx->result
+bool program_run(const program_t *program, flowregex_ctx_t *ctx) {
+    if (!program || !ctx || !ctx->result) return false;
+    return program_run_outputs(program, ctx, &ctx->result);
+}
@@ -1,19 +1,8 @@
 #include "flowregex.h"
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #include <ctype.h>
 
-// Forward declarations for apply functions
-static bitmask_t *literal_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *concat_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *alternation_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *kleene_star_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *plus_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *question_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *any_char_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-static bitmask_t *char_class_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text);
-
 // Forward declarations for destroy functions
 static void literal_destroy(regex_element_t *self);
 static void concat_destroy(regex_element_t *self);
@@ -23,6 +12,112 @@ static void plus_destroy(regex_element_t *self);
 static void question_destroy(regex_element_t *self);
 static void any_char_destroy(regex_element_t *self);
 static void char_class_destroy(regex_element_t *self);
+static void string_destroy(regex_element_t *self);
+
+// Bytes consumed by a literal, any-char or char-class element, as a 256-bit
+// table (bit b of set[b / 64]). Returns false for other elements.
+bool regex_element_byte_set(const regex_element_t *elem, uint64_t set[4]) {
+    if (!elem) return false;
+    
+    switch (elem->type) {
+        case REGEX_LITERAL: {
+            unsigned char c = (unsigned char)((const literal_data_t *)elem->data)->character;
+            memset(set, 0, 4 * sizeof(uint64_t));
+            set[c >> 6] = 1ULL << (c & 63);
+            return true;
+        }
+        case REGEX_ANY_CHAR:
+            // Any character except newline
+            memset(set, 0xff, 4 * sizeof(uint64_t));
+            set['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+            return true;
+        case REGEX_CHAR_CLASS:
+            memcpy(set, ((const char_class_data_t *)elem->data)->table, 4 * sizeof(uint64_t));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Longest text a match of elem can span, or SIZE_MAX if unbounded (a star
+// or plus anywhere in the tree)
+size_t regex_element_max_length(const regex_element_t *elem) {
+    if (!elem) return 0;
+    
+    switch (elem->type) {
+        case REGEX_LITERAL:
+        case REGEX_ANY_CHAR:
+        case REGEX_CHAR_CLASS:
+            return 1;
+        case REGEX_CONCAT: {
+            size_t left = regex_element_max_length(elem->left);
+            size_t right = regex_element_max_length(elem->right);
+            if (left == SIZE_MAX || right == SIZE_MAX || left > SIZE_MAX - 1 - right) return SIZE_MAX;
+            return left + right;
+        }
+        case REGEX_ALTERNATION: {
+            size_t left = regex_element_max_length(elem->left);
+            size_t right = regex_element_max_length(elem->right);
+            return left > right ? left : right;
+        }
+        case REGEX_QUESTION:
+            return regex_element_max_length(elem->left);
+        case REGEX_KLEENE_STAR:
+        case REGEX_PLUS:
+            return SIZE_MAX;
+        case REGEX_STRING:
+            return ((const string_data_t *)elem->data)->length;
+    }
+    return SIZE_MAX;
+}
+
+static uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 29);
+}
+
+// Structural hash of a new element over its children's: leaves hash the bytes
+// they consume, so 'a' and [a] are the same subtree
+void regex_element_rehash(regex_element_t *elem) {
+    uint64_t h = hash_mix(0, (uint64_t)elem->type);
+    uint64_t set[4];
+    if (regex_element_byte_set(elem, set)) {
+        h = hash_mix(hash_mix(0, REGEX_CHAR_CLASS), set[0]);
+        for (int w = 1; w < 4; w++) h = hash_mix(h, set[w]);
+    }
+    if (elem->type == REGEX_STRING) {
+        const string_data_t *data = (const string_data_t *)elem->data;
+        for (size_t k = 0; k < data->length; k++) {
+            for (int w = 0; w < 4; w++) h = hash_mix(h, data->sets[k][w]);
+        }
+    }
+    if (elem->left) h = hash_mix(h, elem->left->hash);
+    if (elem->right) h = hash_mix(h, elem->right->hash);
+    elem->hash = h;
+}
+
+// Whether two subtrees match the same way (same shape, leaves consuming the
+// same bytes)
+bool regex_element_equal(const regex_element_t *a, const regex_element_t *b) {
+    if (a == b) return true;
+    if (!a || !b || a->hash != b->hash) return false;
+    
+    uint64_t set_a[4], set_b[4];
+    bool leaf_a = regex_element_byte_set(a, set_a);
+    bool leaf_b = regex_element_byte_set(b, set_b);
+    if (leaf_a || leaf_b) {
+        return leaf_a && leaf_b && memcmp(set_a, set_b, sizeof(set_a)) == 0;
+    }
+    if (a->type == REGEX_STRING && b->type == REGEX_STRING) {
+        const string_data_t *da = (const string_data_t *)a->data;
+        const string_data_t *db = (const string_data_t *)b->data;
+        return da->length == db->length && memcmp(da->sets, db->sets, da->length * sizeof(da->sets[0])) == 0;
+    }
+    return a->type == b->type && regex_element_equal(a->left, b->left) &&
+           regex_element_equal(a->right, b->right);
+}
 
 // Literal element
 regex_element_t *literal_create(char c) {
@@ -41,94 +136,12 @@ regex_element_t *literal_create(char c) {
     elem->data = data;
     elem->left = NULL;
     elem->right = NULL;
-    elem->apply = literal_apply;
     elem->destroy = literal_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *literal_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    literal_data_t *data = (literal_data_t *)self->data;
-    size_t text_len = strlen(text);
-    bitmask_t *output = bitmask_create(input->size);
-    if (!output) return NULL;
-    
-    if (debug) {
-        printf("Literal '%c':\n", data->character);
-        printf("  Input:  ");
-        #ifdef DEBUG
-        bitmask_print(input, "");
-        #endif
-    }
-    
-    // Use OptimizedText if available
-    if (opt_text) {
-        struct bitmask *char_mask = optimized_text_get_match_mask(opt_text, data->character);
-        if (char_mask) {
-            // Optimized path: direct word-level operations
-            // This is the true optimization - operate on 64-bit words directly
-            size_t words = input->capacity < char_mask->capacity ? input->capacity : char_mask->capacity;
-            
-            for (size_t word_idx = 0; word_idx < words; word_idx++) {
-                uint64_t input_word = input->bits[word_idx];
-                uint64_t char_word = char_mask->bits[word_idx];
-                
-                if (input_word == 0) continue;
-                
-                // For each bit set in input_word, check if next position has character
-                for (int bit = 0; bit < 64 && word_idx * 64 + bit < input->size - 1; bit++) {
-                    if (input_word & (1ULL << bit)) {
-                        size_t pos = word_idx * 64 + bit;
-                        if (pos < char_mask->size && bitmask_get(char_mask, pos)) {
-                            if (pos + 1 < output->size) {
-                                bitmask_set(output, pos + 1);
-                            }
-                        }
-                    }
-                }
-            }
-        } else {
-            // Fallback to traditional method
-            size_t count;
-            int *positions = bitmask_get_set_positions(input, &count);
-            if (positions) {
-                for (size_t i = 0; i < count; i++) {
-                    int pos = positions[i];
-                    if (pos < (int)text_len && text[pos] == data->character) {
-                        bitmask_set(output, pos + 1);
-                    }
-                }
-                free(positions);
-            }
-        }
-    } else {
-        // Traditional path: character-by-character comparison
-        size_t count;
-        int *positions = bitmask_get_set_positions(input, &count);
-        if (positions) {
-            for (size_t i = 0; i < count; i++) {
-                int pos = positions[i];
-                if (pos < (int)text_len && text[pos] == data->character) {
-                    bitmask_set(output, pos + 1);
-                }
-            }
-            free(positions);
-        }
-    }
-    
-    if (debug) {
-        printf("  Output: ");
-        #ifdef DEBUG
-        bitmask_print(output, "");
-        #endif
-        printf("\n");
-    }
-    
-    return output;
-}
-
 static void literal_destroy(regex_element_t *self) {
     if (self) {
         free(self->data);
@@ -145,30 +158,12 @@ regex_element_t *concat_create(regex_element_t *left, regex_element_t *right) {
     elem->data = NULL;
     elem->left = left;
     elem->right = right;
-    elem->apply = concat_apply;
     elem->destroy = concat_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *concat_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    if (debug) {
-        printf("Concat:\n");
-    }
-    
-    // Apply left element first
-    bitmask_t *intermediate = self->left->apply(self->left, input, text, debug, opt_text);
-    if (!intermediate) return NULL;
-    
-    // Apply right element to the result
-    bitmask_t *output = self->right->apply(self->right, intermediate, text, debug, opt_text);
-    
-    bitmask_destroy(intermediate);
-    return output;
-}
-
 static void concat_destroy(regex_element_t *self) {
     if (self) {
         if (self->left) self->left->destroy(self->left);
@@ -186,36 +181,12 @@ regex_element_t *alternation_create(regex_element_t *left, regex_element_t *righ
     elem->data = NULL;
     elem->left = left;
     elem->right = right;
-    elem->apply = alternation_apply;
     elem->destroy = alternation_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *alternation_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    if (debug) {
-        printf("Alternation:\n");
-    }
-    
-    // Apply both branches
-    bitmask_t *left_result = self->left->apply(self->left, input, text, debug, opt_text);
-    bitmask_t *right_result = self->right->apply(self->right, input, text, debug, opt_text);
-    
-    if (!left_result || !right_result) {
-        bitmask_destroy(left_result);
-        bitmask_destroy(right_result);
-        return NULL;
-    }
-    
-    // Combine results with OR
-    bitmask_or(left_result, right_result);
-    
-    bitmask_destroy(right_result);
-    return left_result;
-}
-
 static void alternation_destroy(regex_element_t *self) {
     if (self) {
         if (self->left) self->left->destroy(self->left);
@@ -233,62 +204,12 @@ regex_element_t *kleene_star_create(regex_element_t *inner) {
     elem->data = NULL;
     elem->left = inner;
     elem->right = NULL;
-    elem->apply = kleene_star_apply;
     elem->destroy = kleene_star_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *kleene_star_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    if (debug) {
-        printf("Kleene Star:\n");
-    }
-    
-    bitmask_t *result = bitmask_copy(input);
-    if (!result) return NULL;
-    
-    bitmask_t *current = bitmask_copy(input);
-    if (!current) {
-        bitmask_destroy(result);
-        return NULL;
-    }
-    
-    // Iterate until convergence
-    for (int iteration = 0; iteration < 100; iteration++) { // Prevent infinite loops
-        bitmask_t *next = self->left->apply(self->left, current, text, debug, opt_text);
-        if (!next) break;
-        
-        // Check if we have new bits
-        bitmask_t *temp = bitmask_copy(result);
-        if (!temp) {
-            bitmask_destroy(next);
-            break;
-        }
-        
-        bitmask_or(result, next);
-        
-        // Check for convergence
-        bool converged = true;
-        for (size_t i = 0; i < result->size; i++) {
-            if (bitmask_get(result, i) != bitmask_get(temp, i)) {
-                converged = false;
-                break;
-            }
-        }
-        
-        bitmask_destroy(temp);
-        bitmask_destroy(current);
-        current = next;
-        
-        if (converged) break;
-    }
-    
-    bitmask_destroy(current);
-    return result;
-}
-
 static void kleene_star_destroy(regex_element_t *self) {
     if (self) {
         if (self->left) self->left->destroy(self->left);
@@ -305,62 +226,12 @@ regex_element_t *plus_create(regex_element_t *inner) {
     elem->data = NULL;
     elem->left = inner;
     elem->right = NULL;
-    elem->apply = plus_apply;
     elem->destroy = plus_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *plus_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    if (debug) {
-        printf("Plus:\n");
-    }
-    
-    // First application (required)
-    bitmask_t *result = self->left->apply(self->left, input, text, debug, opt_text);
-    if (!result) return NULL;
-    
-    bitmask_t *current = bitmask_copy(result);
-    if (!current) {
-        bitmask_destroy(result);
-        return NULL;
-    }
-    
-    // Continue applying until convergence
-    for (int iteration = 0; iteration < 100; iteration++) {
-        bitmask_t *next = self->left->apply(self->left, current, text, debug, opt_text);
-        if (!next) break;
-        
-        bitmask_t *temp = bitmask_copy(result);
-        if (!temp) {
-            bitmask_destroy(next);
-            break;
-        }
-        
-        bitmask_or(result, next);
-        
-        // Check for convergence
-        bool converged = true;
-        for (size_t i = 0; i < result->size; i++) {
-            if (bitmask_get(result, i) != bitmask_get(temp, i)) {
-                converged = false;
-                break;
-            }
-        }
-        
-        bitmask_destroy(temp);
-        bitmask_destroy(current);
-        current = next;
-        
-        if (converged) break;
-    }
-    
-    bitmask_destroy(current);
-    return result;
-}
-
 static void plus_destroy(regex_element_t *self) {
     if (self) {
         if (self->left) self->left->destroy(self->left);
@@ -377,33 +248,12 @@ regex_element_t *question_create(regex_element_t *inner) {
     elem->data = NULL;
     elem->left = inner;
     elem->right = NULL;
-    elem->apply = question_apply;
     elem->destroy = question_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *question_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    if (debug) {
-        printf("Question:\n");
-    }
-    
-    // Copy input (zero matches)
-    bitmask_t *result = bitmask_copy(input);
-    if (!result) return NULL;
-    
-    // Apply inner element (one match)
-    bitmask_t *one_match = self->left->apply(self->left, input, text, debug, opt_text);
-    if (one_match) {
-        bitmask_or(result, one_match);
-        bitmask_destroy(one_match);
-    }
-    
-    return result;
-}
-
 static void question_destroy(regex_element_t *self) {
     if (self) {
         if (self->left) self->left->destroy(self->left);
@@ -420,47 +270,120 @@ regex_element_t *any_char_create(void) {
     elem->data = NULL;
     elem->left = NULL;
     elem->right = NULL;
-    elem->apply = any_char_apply;
     elem->destroy = any_char_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bitmask_t *any_char_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
-    
-    size_t text_len = strlen(text);
-    bitmask_t *output = bitmask_create(input->size);
-    if (!output) return NULL;
-    
-    if (debug) {
-        printf("Any Char (.):\n");
+static void any_char_destroy(regex_element_t *self) {
+    if (self) {
+        free(self);
     }
-    
-    // Check each position where input mask is set
-    size_t count;
-    int *positions = bitmask_get_set_positions(input, &count);
-    if (positions) {
-        for (size_t i = 0; i < count; i++) {
-            int pos = positions[i];
-            if (pos < (int)text_len && text[pos] != '\n') {
-                bitmask_set(output, pos + 1);
-            }
+}
+
+static void class_table_set(uint64_t table[4], unsigned char c) {
+    table[c >> 6] |= 1ULL << (c & 63);
+}
+
+// Add the bytes of a named class (d, s, w, or the complements D, S, W).
+// Returns false if name is not a class name.
+bool char_class_add_named(uint64_t table[4], char name) {
+    bool negate = isupper((unsigned char)name);
+    char lower = (char)tolower((unsigned char)name);
+    if (lower != 'd' && lower != 's' && lower != 'w') return false;
+    
+    for (int c = 0; c < 256; c++) {
+        bool member;
+        if (lower == 'd') {
+            member = isdigit(c);
+        } else if (lower == 's') {
+            member = isspace(c);
+        } else {
+            member = isalnum(c) || c == '_';
         }
-        free(positions);
+        if (member != negate) class_table_set(table, (unsigned char)c);
     }
+    return true;
+}
+
+// Byte denoted by a non-class escape (\n, \t, ... or the character itself)
+static unsigned char escape_byte(char c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default: return (unsigned char)c;
+    }
+}
+
+// Read one bracket item byte at body[*i]; sets *named for \d-style escapes
+static bool class_read_byte(const char *body, size_t len, size_t *i, unsigned char *byte, char *named) {
+    *named = '\0';
+    if (body[*i] != '\\') {
+        *byte = (unsigned char)body[(*i)++];
+        return true;
+    }
+    if (*i + 1 >= len) return false;
     
-    return output;
+    char e = body[*i + 1];
+    *i += 2;
+    if (strchr("dDsSwW", e)) {
+        *named = e;
+    } else {
+        *byte = escape_byte(e);
+    }
+    return true;
 }
 
-static void any_char_destroy(regex_element_t *self) {
-    if (self) {
-        free(self);
+// Compile a bracket expression body (the text between '[' and ']') into a
+// 256-bit membership table: a leading '^' negates, a-z ranges, a '-' at
+// either end is literal, escapes as outside brackets (\d \s \w and their
+// complements, \n \t \r \f \v, otherwise the escaped character).
+// Returns false for a reversed range, a class as a range end, or a
+// dangling backslash.
+bool char_class_compile(const char *body, size_t len, uint64_t table[4], bool *negated) {
+    memset(table, 0, 4 * sizeof(uint64_t));
+    
+    size_t i = 0;
+    bool negate = len > 0 && body[0] == '^';
+    if (negate) i++;
+    
+    while (i < len) {
+        unsigned char lo = 0, hi = 0;
+        char named;
+        if (!class_read_byte(body, len, &i, &lo, &named)) return false;
+        
+        if (named) {
+            char_class_add_named(table, named);
+            if (i + 1 < len && body[i] == '-') return false;
+            continue;
+        }
+        
+        // Range, unless the '-' is the last character of the body
+        if (i + 1 < len && body[i] == '-') {
+            i++;
+            if (!class_read_byte(body, len, &i, &hi, &named) || named || hi < lo) return false;
+            for (int c = lo; c <= hi; c++) {
+                class_table_set(table, (unsigned char)c);
+            }
+        } else {
+            class_table_set(table, lo);
+        }
     }
+    
+    if (negate) {
+        for (int w = 0; w < 4; w++) table[w] = ~table[w];
+    }
+    if (negated) *negated = negate;
+    return true;
 }
 
-// Character class element (simplified)
-regex_element_t *char_class_create(const char *pattern) {
+// Character class element over a precompiled 256-bit table. pattern is kept
+// for debug output only.
+regex_element_t *char_class_create_table(const uint64_t table[4], const char *pattern, bool negated) {
     regex_element_t *elem = malloc(sizeof(regex_element_t));
     if (!elem) return NULL;
     
@@ -471,78 +394,84 @@ regex_element_t *char_class_create(const char *pattern) {
     }
     
     data->pattern = strdup(pattern);
-    data->negated = (pattern[0] == '^');
+    if (!data->pattern) {
+        free(data);
+        free(elem);
+        return NULL;
+    }
+    data->negated = negated;
+    memcpy(data->table, table, sizeof(data->table));
     
     elem->type = REGEX_CHAR_CLASS;
     elem->data = data;
     elem->left = NULL;
     elem->right = NULL;
-    elem->apply = char_class_apply;
     elem->destroy = char_class_destroy;
+    regex_element_rehash(elem);
     
     return elem;
 }
 
-static bool char_matches_class(char c, const char *pattern) {
-    // Simplified character class matching
-    // This is a basic implementation - full implementation would handle ranges, etc.
-    
-    if (strcmp(pattern, "d") == 0) {
-        return isdigit(c);
-    } else if (strcmp(pattern, "D") == 0) {
-        return !isdigit(c);
-    } else if (strcmp(pattern, "s") == 0) {
-        return isspace(c);
-    } else if (strcmp(pattern, "S") == 0) {
-        return !isspace(c);
-    } else if (strcmp(pattern, "w") == 0) {
-        return isalnum(c) || c == '_';
-    } else if (strcmp(pattern, "W") == 0) {
-        return !(isalnum(c) || c == '_');
-    }
+// Character class element: a class name ("d", "S", ...) or a bracket body
+regex_element_t *char_class_create(const char *pattern) {
+    uint64_t table[4] = {0, 0, 0, 0};
+    bool negated = false;
     
-    // For other patterns, just check if character is in the pattern
-    return strchr(pattern, c) != NULL;
+    if (!(pattern[0] && !pattern[1] && char_class_add_named(table, pattern[0])) &&
+        !char_class_compile(pattern, strlen(pattern), table, &negated)) {
+        return NULL;
+    }
+    return char_class_create_table(table, pattern, negated);
 }
 
-static bitmask_t *char_class_apply(regex_element_t *self, bitmask_t *input, const char *text, bool debug, optimized_text_t *opt_text) {
-    if (!self || !input || !text) return NULL;
+static void char_class_destroy(regex_element_t *self) {
+    if (self) {
+        char_class_data_t *data = (char_class_data_t *)self->data;
+        if (data) {
+            free(data->pattern);
+            free(data);
+        }
+        free(self);
+    }
+}
+
+// String element: consecutive single-character steps, fused
+regex_element_t *string_create(const uint64_t (*sets)[4], size_t length) {
+    if (!sets || length == 0 || length > REGEX_STRING_MAX) return NULL;
     
-    char_class_data_t *data = (char_class_data_t *)self->data;
-    size_t text_len = strlen(text);
-    bitmask_t *output = bitmask_create(input->size);
-    if (!output) return NULL;
+    regex_element_t *elem = malloc(sizeof(regex_element_t));
+    if (!elem) return NULL;
     
-    if (debug) {
-        printf("Character Class [%s]:\n", data->pattern);
+    string_data_t *data = malloc(sizeof(string_data_t));
+    if (!data) {
+        free(elem);
+        return NULL;
     }
     
-    // Check each position where input mask is set
-    size_t count;
-    int *positions = bitmask_get_set_positions(input, &count);
-    if (positions) {
-        for (size_t i = 0; i < count; i++) {
-            int pos = positions[i];
-            if (pos < (int)text_len) {
-                bool matches = char_matches_class(text[pos], data->pattern);
-                if (data->negated) matches = !matches;
-                
-                if (matches) {
-                    bitmask_set(output, pos + 1);
-                }
-            }
-        }
-        free(positions);
+    data->sets = malloc(length * sizeof(data->sets[0]));
+    if (!data->sets) {
+        free(data);
+        free(elem);
+        return NULL;
     }
+    memcpy(data->sets, sets, length * sizeof(data->sets[0]));
+    data->length = length;
+    
+    elem->type = REGEX_STRING;
+    elem->data = data;
+    elem->left = NULL;
+    elem->right = NULL;
+    elem->destroy = string_destroy;
+    regex_element_rehash(elem);
     
-    return output;
+    return elem;
 }
 
-static void char_class_destroy(regex_element_t *self) {
+static void string_destroy(regex_element_t *self) {
     if (self) {
-        char_class_data_t *data = (char_class_data_t *)self->data;
+        string_data_t *data = (string_data_t *)self->data;
         if (data) {
-            free(data->pattern);
+            free(data->sets);
             free(data);
         }
         free(self);
@@ -0,0 +1,224 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Pattern sets.
+//
+// All patterns are compiled into one program: the start mask and every
+// literal / class mask are built once per block and read by every pattern
+// that needs them, and each pattern leaves its ends in its own output. The
+// text is scanned once, block by block, carrying state across block
+// boundaries exactly like the streaming matcher, so all patterns run over a
+// block while it is in cache instead of making one pass over memory each.
+
+flowregex_set_t *flowregex_set_create(const char *const *patterns, size_t count, flowregex_error_t *error) {
+    if (!patterns || count == 0 || !error) {
+        if (error) *error = FLOWREGEX_ERROR_INVALID_PATTERN;
+        return NULL;
+    }
+    
+    *error = FLOWREGEX_OK;
+    
+    flowregex_set_t *set = calloc(1, sizeof(flowregex_set_t));
+    if (!set) {
+        *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    set->count = count;
+    set->patterns = calloc(count, sizeof(char *));
+    set->roots = calloc(count, sizeof(regex_element_t *));
+    set->outputs = calloc(count, sizeof(bitmask_t *));
+    if (!set->patterns || !set->roots || !set->outputs) {
+        flowregex_set_destroy(set);
+        *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    for (size_t k = 0; k < count; k++) {
+        if (!patterns[k]) {
+            flowregex_set_destroy(set);
+            *error = FLOWREGEX_ERROR_INVALID_PATTERN;
+            return NULL;
+        }
+        set->patterns[k] = strdup(patterns[k]);
+        if (!set->patterns[k]) {
+            flowregex_set_destroy(set);
+            *error = FLOWREGEX_ERROR_MEMORY;
+            return NULL;
+        }
+        set->roots[k] = parse_regex(patterns[k], error);
+        if (!set->roots[k]) {
+            flowregex_set_destroy(set);
+            return NULL;
+        }
+        set->roots[k] = regex_optimize(set->roots[k]);
+        if (!set->roots[k]) {
+            flowregex_set_destroy(set);
+            *error = FLOWREGEX_ERROR_MEMORY;
+            return NULL;
+        }
+    }
+    
+    set->program = program_compile_set(set->roots, count, error);
+    if (!set->program) {
+        flowregex_set_destroy(set);
+        return NULL;
+    }
+    
+    size_t length = set->program->carry_count;
+    set->ctx = flowregex_ctx_create();
+    set->carry_in = calloc(length ? length : 1, sizeof(uint8_t));
+    set->carry_out = calloc(length ? length : 1, sizeof(uint8_t));
+    if (!set->ctx || !set->carry_in || !set->carry_out) {
+        flowregex_set_destroy(set);
+        *error = FLOWREGEX_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    return set;
+}
+
+void flowregex_set_destroy(flowregex_set_t *set) {
+    if (!set) return;
+    
+    for (size_t k = 0; k < set->count; k++) {
+        if (set->patterns) free(set->patterns[k]);
+        if (set->roots && set->roots[k]) set->roots[k]->destroy(set->roots[k]);
+        if (set->outputs) bitmask_destroy(set->outputs[k]);
+    }
+    free(set->patterns);
+    free(set->roots);
+    free(set->outputs);
+    program_destroy(set->program);
+    flowregex_ctx_destroy(set->ctx);
+    free(set->carry_in);
+    free(set->carry_out);
+    free(set);
+}
+
+// Called after every block with the outputs filled in; offset is the
+// block's text position. Returns false to end the scan early.
+typedef bool (*set_block_fn)(flowregex_set_t *set, size_t offset, bool first, void *data);
+
+static bool set_resize_outputs(flowregex_set_t *set, size_t size) {
+    if (set->outputs[0] && set->outputs[0]->size == size) return true;
+    
+    for (size_t k = 0; k < set->count; k++) {
+        bitmask_destroy(set->outputs[k]);
+        set->outputs[k] = bitmask_create(size);
+        if (!set->outputs[k]) return false;
+    }
+    return true;
+}
+
+// Run every pattern over text one FLOWREGEX_SET_BLOCK block at a time
+static bool set_scan(flowregex_set_t *set, const char *text, size_t text_len, set_block_fn visit, void *data) {
+    flowregex_ctx_t *ctx = set->ctx;
+    size_t length = set->program->carry_count;
+    size_t offset = 0;
+    bool first = true;
+    
+    // An empty text still has position 0
+    while (first || offset < text_len) {
+        size_t n = text_len - offset < FLOWREGEX_SET_BLOCK ? text_len - offset : FLOWREGEX_SET_BLOCK;
+        if (!flowregex_ctx_bind_text(ctx, text + offset, n) || !set_resize_outputs(set, n + 1)) {
+            return false;
+        }
+        
+        memset(set->carry_out, 0, length);
+        ctx->carry_in = first ? NULL : set->carry_in;
+        ctx->carry_out = set->carry_out;
+        bool ok = program_run_outputs(set->program, ctx, set->outputs);
+        ctx->carry_in = NULL;
+        ctx->carry_out = NULL;
+        if (!ok) return false;
+        
+        uint8_t *tmp = set->carry_in;
+        set->carry_in = set->carry_out;
+        set->carry_out = tmp;
+        
+        if (!visit(set, offset, first, data)) break;
+        offset += n;
+        first = false;
+    }
+    return true;
+}
+
+static bool collect_block(flowregex_set_t *set, size_t offset, bool first, void *data) {
+    match_result_t **results = data;
+    
+    for (size_t k = 0; k < set->count; k++) {
+        bitmask_iter_t it;
+        size_t pos;
+        bitmask_iter_init(&it, set->outputs[k]);
+        while (bitmask_iter_next(&it, &pos)) {
+            // Position 0 of a later block is the previous block's last
+            if (pos == 0 && !first) continue;
+            match_result_add(results[k], offset + pos);
+        }
+    }
+    return true;
+}
+
+// Match every pattern over text; returns one result per pattern (free with
+// flowregex_set_results_destroy), or NULL on allocation failure
+match_result_t **flowregex_set_match(flowregex_set_t *set, const char *text, size_t text_len) {
+    if (!set || !text) return NULL;
+    
+    match_result_t **results = calloc(set->count, sizeof(match_result_t *));
+    if (!results) return NULL;
+    
+    bool ok = true;
+    for (size_t k = 0; ok && k < set->count; k++) {
+        results[k] = match_result_create();
+        ok = results[k] != NULL;
+    }
+    
+    if (!ok || !set_scan(set, text, text_len, collect_block, results)) {
+        flowregex_set_results_destroy(results, set->count);
+        return NULL;
+    }
+    return results;
+}
+
+void flowregex_set_results_destroy(match_result_t **results, size_t count) {
+    if (!results) return;
+    
+    for (size_t k = 0; k < count; k++) {
+        match_result_destroy(results[k]);
+    }
+    free(results);
+}
+
+typedef struct {
+    uint64_t *matched;
+    size_t remaining;
+} matched_state_t;
+
+static bool mark_block(flowregex_set_t *set, size_t offset, bool first, void *data) {
+    matched_state_t *state = data;
+    (void)offset;
+    
+    for (size_t k = 0; k < set->count; k++) {
+        if ((state->matched[k / 64] >> (k % 64)) & 1) continue;
+        if (!first) bitmask_clear(set->outputs[k], 0);
+        if (bitmask_any(set->outputs[k])) {
+            state->matched[k / 64] |= 1ULL << (k % 64);
+            state->remaining--;
+        }
+    }
+    // Nothing left to learn once every pattern has matched
+    return state->remaining > 0;
+}
+
+// Which patterns match anywhere in text: bit k of matched (an array of
+// (count + 63) / 64 words) is set for pattern k. The scan stops as soon as
+// every pattern has matched.
+bool flowregex_set_matched(flowregex_set_t *set, const char *text, size_t text_len, uint64_t *matched) {
+    if (!set || !text || !matched) return false;
+    
+    memset(matched, 0, (set->count + 63) / 64 * sizeof(uint64_t));
+    matched_state_t state = {matched, set->count};
+    return set_scan(set, text, text_len, mark_block, &state);
+}
@@ -0,0 +1,100 @@
+#include "flowregex.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Streaming matcher.
+//
+// Each chunk is matched on its own (local position j is global position
+// offset + j), so masks never exceed FLOWREGEX_STREAM_BLOCK + 1 bits. The
+// last position of a chunk is position 0 of the next one; the only state
+// carried across is one bit per consuming instruction, telling whether its
+// output reached that shared position (see chunk_boundary in program.c).
+// Values at a position depend only on the bytes before it, so every end
+// position up to the chunk's last one is final when the chunk is done.
+
+flowregex_stream_t *flowregex_stream_open(flowregex_t *regex, flowregex_match_fn on_match, void *user_data) {
+    if (!regex || !on_match) return NULL;
+    
+    flowregex_stream_t *stream = malloc(sizeof(flowregex_stream_t));
+    if (!stream) return NULL;
+    
+    size_t length = regex->program->carry_count;
+    stream->regex = regex;
+    stream->on_match = on_match;
+    stream->user_data = user_data;
+    stream->offset = 0;
+    stream->started = false;
+    stream->ctx = flowregex_ctx_create();
+    stream->carry_in = calloc(length ? length : 1, sizeof(uint8_t));
+    stream->carry_out = calloc(length ? length : 1, sizeof(uint8_t));
+    
+    if (!stream->ctx || !stream->carry_in || !stream->carry_out) {
+        flowregex_ctx_destroy(stream->ctx);
+        free(stream->carry_in);
+        free(stream->carry_out);
+        free(stream);
+        return NULL;
+    }
+    
+    return stream;
+}
+
+// Match one block and report its end positions (position 0 only for the
+// first block; later blocks share it with their predecessor)
+static bool stream_block(flowregex_stream_t *stream, const char *block, size_t len) {
+    flowregex_ctx_t *ctx = stream->ctx;
+    size_t length = stream->regex->program->carry_count;
+    
+    memset(stream->carry_out, 0, length);
+    ctx->carry_in = stream->started ? stream->carry_in : NULL;
+    ctx->carry_out = stream->carry_out;
+    
+    const bitmask_t *result = flowregex_match_mask(stream->regex, ctx, block, len);
+    ctx->carry_in = NULL;
+    ctx->carry_out = NULL;
+    if (!result) return false;
+    
+    bitmask_iter_t it;
+    size_t pos;
+    bitmask_iter_init(&it, result);
+    while (bitmask_iter_next(&it, &pos)) {
+        if (pos == 0 && stream->started) continue;
+        stream->on_match(stream->offset + pos, stream->user_data);
+    }
+    
+    // This block's outgoing carries feed the next one
+    uint8_t *tmp = stream->carry_in;
+    stream->carry_in = stream->carry_out;
+    stream->carry_out = tmp;
+    stream->offset += len;
+    stream->started = true;
+    return true;
+}
+
+// Feed the next len bytes of the text. Matches ending inside the data fed so
+// far are reported before this returns. Returns false on allocation failure.
+bool flowregex_stream_feed(flowregex_stream_t *stream, const char *chunk, size_t len) {
+    if (!stream || (!chunk && len > 0)) return false;
+    
+    while (len > 0) {
+        size_t n = len < FLOWREGEX_STREAM_BLOCK ? len : FLOWREGEX_STREAM_BLOCK;
+        if (!stream_block(stream, chunk, n)) return false;
+        chunk += n;
+        len -= n;
+    }
+    return true;
+}
+
+// End of text: report what is still pending and release the stream
+bool flowregex_stream_finish(flowregex_stream_t *stream) {
+    if (!stream) return false;
+    
+    // An empty text still has position 0
+    bool ok = stream->started || stream_block(stream, "", 0);
+    
+    flowregex_ctx_destroy(stream->ctx);
+    free(stream->carry_in);
+    free(stream->carry_out);
+    free(stream);
+    return ok;
+}
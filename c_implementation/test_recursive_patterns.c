@@ -28,7 +28,7 @@ static bool check_match_result(match_result_t *result, int *expected, size_t exp
     for (size_t i = 0; i < expected_count; i++) {
         bool found = false;
         for (size_t j = 0; j < result->count; j++) {
-            if (result->positions[j] == expected[i]) {
+            if (result->positions[j] == (size_t)expected[i]) {
                 found = true;
                 break;
             }
@@ -60,7 +60,7 @@ TEST(nested_kleene_stars) {
     assert(result2 != NULL);
     printf("Text 'b' - Match count: %zu, Positions: ", result2->count);
     for (size_t i = 0; i < result2->count; i++) {
-        printf("%d ", result2->positions[i]);
+        printf("%zu ", result2->positions[i]);
     }
     printf("\n");
     match_result_destroy(result2);
@@ -70,7 +70,7 @@ TEST(nested_kleene_stars) {
     assert(result3 != NULL);
     printf("Text 'abb' - Match count: %zu, Positions: ", result3->count);
     for (size_t i = 0; i < result3->count; i++) {
-        printf("%d ", result3->positions[i]);
+        printf("%zu ", result3->positions[i]);
     }
     printf("\n");
     match_result_destroy(result3);
@@ -136,7 +136,7 @@ TEST(multiple_quantifiers) {
     assert(result2 != NULL);
     printf("Text 'aab' - Match count: %zu, Positions: ", result2->count);
     for (size_t i = 0; i < result2->count; i++) {
-        printf("%d ", result2->positions[i]);
+        printf("%zu ", result2->positions[i]);
     }
     printf("\n");
     match_result_destroy(result2);
@@ -146,7 +146,7 @@ TEST(multiple_quantifiers) {
     assert(result3 != NULL);
     printf("Text 'aabbc' - Match count: %zu, Positions: ", result3->count);
     for (size_t i = 0; i < result3->count; i++) {
-        printf("%d ", result3->positions[i]);
+        printf("%zu ", result3->positions[i]);
     }
     printf("\n");
     match_result_destroy(result3);
@@ -205,7 +205,7 @@ TEST(empty_match_cases) {
     assert(result1 != NULL);
     printf("Pattern 'a*' on 'bbb' - Match count: %zu, Positions: ", result1->count);
     for (size_t i = 0; i < result1->count; i++) {
-        printf("%d ", result1->positions[i]);
+        printf("%zu ", result1->positions[i]);
     }
     printf("\n");
     match_result_destroy(result1);
@@ -220,7 +220,7 @@ TEST(empty_match_cases) {
     assert(result2 != NULL);
     printf("Pattern '(a|b)*' on 'ab' - Match count: %zu, Positions: ", result2->count);
     for (size_t i = 0; i < result2->count; i++) {
-        printf("%d ", result2->positions[i]);
+        printf("%zu ", result2->positions[i]);
     }
     printf("\n");
     match_result_destroy(result2);
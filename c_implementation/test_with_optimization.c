@@ -28,7 +28,7 @@ static bool check_match_result(match_result_t *result, int *expected, size_t exp
     for (size_t i = 0; i < expected_count; i++) {
         bool found = false;
         for (size_t j = 0; j < result->count; j++) {
-            if (result->positions[j] == expected[i]) {
+            if (result->positions[j] == (size_t)expected[i]) {
                 found = true;
                 break;
             }
@@ -43,64 +43,24 @@ match_result_t *flowregex_match_optimized(flowregex_t *regex, const char *text,
     if (!regex || !text) return NULL;
     
     size_t text_len = strlen(text);
-    if (text_len > FLOWREGEX_MAX_TEXT_LENGTH) {
-        return NULL;
-    }
     
-    if (debug) {
-        printf("=== FlowRegex Matching Debug (Optimized) ===\n");
-        printf("Text: '%s'\n", text);
-        printf("Pattern: %s\n", regex->pattern);
-        printf("Initial mask: ");
-    }
+    // Create OptimizedText indexing the bytes the pattern reads
+    optimized_text_t *opt_text = optimized_text_create_for_regex(regex, text, text_len);
     
-    // Create OptimizedText
-    optimized_text_t *opt_text = optimized_text_create(text, regex->pattern);
-    
-    // Create initial bitmask with all positions set
-    bitmask_t *initial_mask = bitmask_create(text_len + 1);
-    if (!initial_mask) {
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    if (!ctx) {
         if (opt_text) optimized_text_destroy(opt_text);
         return NULL;
     }
     
-    for (size_t i = 0; i <= text_len; i++) {
-        bitmask_set(initial_mask, i);
-    }
-    
-    if (debug) {
-        printf("\n");
-    }
-    
     // Apply the regex with OptimizedText
-    bitmask_t *result_mask = regex->root->apply(regex->root, initial_mask, text, debug, opt_text);
-    bitmask_destroy(initial_mask);
-    if (opt_text) optimized_text_destroy(opt_text);
+    flowregex_ctx_set_optimized_text(ctx, opt_text);
+    ctx->debug = debug;
+    match_result_t *match_result = flowregex_match_ctx(regex, ctx, text, text_len);
     
-    if (!result_mask) return NULL;
-    
-    if (debug) {
-        printf("Final result: ");
-        printf("\n=== End Debug ===\n");
-    }
-    
-    // Convert bitmask to match result
-    match_result_t *match_result = match_result_create();
-    if (!match_result) {
-        bitmask_destroy(result_mask);
-        return NULL;
-    }
-    
-    size_t count;
-    int *positions = bitmask_get_set_positions(result_mask, &count);
-    if (positions) {
-        for (size_t i = 0; i < count; i++) {
-            match_result_add(match_result, positions[i]);
-        }
-        free(positions);
-    }
+    flowregex_ctx_destroy(ctx);
+    if (opt_text) optimized_text_destroy(opt_text);
     
-    bitmask_destroy(result_mask);
     return match_result;
 }
 
@@ -119,7 +79,7 @@ TEST(literal_matching_optimized) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     }
@@ -146,7 +106,7 @@ TEST(kleene_star_optimized) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     }
@@ -173,7 +133,7 @@ TEST(complex_pattern_optimized) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     }
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 // Test framework
 static int tests_run = 0;
@@ -20,7 +21,7 @@ static int tests_passed = 0;
     static void test_##name(void)
 
 // Helper function to check match results
-static bool check_match_result(match_result_t *result, int *expected, size_t expected_count) {
+static bool check_match_result(match_result_t *result, const size_t *expected, size_t expected_count) {
     if (!result && expected_count == 0) return true;
     if (!result || result->count != expected_count) return false;
     
@@ -37,6 +38,86 @@ static bool check_match_result(match_result_t *result, int *expected, size_t exp
     return true;
 }
 
+// Reference matcher: output[p] for every p reached from an input position
+// by a match of elem, taken position by position straight from the text (no
+// masks, no program), to check the matcher's strategies against
+static void reference_ends(const regex_element_t *elem, const char *text, size_t len, const bool *input,
+                           bool *output) {
+    uint64_t set[4];
+    memset(output, 0, len + 1);
+    
+    if (regex_element_byte_set(elem, set) || elem->type == REGEX_STRING) {
+        const string_data_t *data = elem->type == REGEX_STRING ? (const string_data_t *)elem->data : NULL;
+        size_t steps = data ? data->length : 1;
+        for (size_t p = 0; p + steps <= len; p++) {
+            size_t k = 0;
+            while (input[p] && k < steps) {
+                const uint64_t *step = data ? data->sets[k] : set;
+                unsigned char c = (unsigned char)text[p + k];
+                if (!((step[c >> 6] >> (c & 63)) & 1)) break;
+                k++;
+            }
+            if (input[p] && k == steps) output[p + steps] = true;
+        }
+        return;
+    }
+    
+    bool *left = malloc(len + 1);
+    bool *right = malloc(len + 1);
+    assert(left != NULL && right != NULL);
+    switch (elem->type) {
+        case REGEX_CONCAT:
+            reference_ends(elem->left, text, len, input, left);
+            reference_ends(elem->right, text, len, left, output);
+            break;
+        case REGEX_ALTERNATION:
+            reference_ends(elem->left, text, len, input, left);
+            reference_ends(elem->right, text, len, input, right);
+            for (size_t p = 0; p <= len; p++) output[p] = left[p] || right[p];
+            break;
+        case REGEX_QUESTION:
+            reference_ends(elem->left, text, len, input, left);
+            for (size_t p = 0; p <= len; p++) output[p] = left[p] || input[p];
+            break;
+        default: {
+            // Star and plus: add rounds of the inner element until one adds
+            // nothing
+            bool star = elem->type == REGEX_KLEENE_STAR;
+            memcpy(left, input, len + 1);
+            if (star) memcpy(output, input, len + 1);
+            for (bool grew = true; grew;) {
+                reference_ends(elem->left, text, len, left, right);
+                grew = false;
+                for (size_t p = 0; p <= len; p++) {
+                    left[p] = right[p] && !output[p];
+                    output[p] |= left[p];
+                    grew |= left[p];
+                }
+            }
+            break;
+        }
+    }
+    free(left);
+    free(right);
+}
+
+// The end positions of the matches of root starting anywhere in the text
+// bound to ctx
+static void reference_match(const regex_element_t *root, const flowregex_ctx_t *ctx, bitmask_t *output) {
+    size_t len = ctx->text_len;
+    bool *starts = malloc(len + 1);
+    bool *ends = malloc(len + 1);
+    assert(starts != NULL && ends != NULL);
+    memset(starts, true, len + 1);
+    reference_ends(root, ctx->text, len, starts, ends);
+    bitmask_clear_all(output);
+    for (size_t p = 0; p <= len; p++) {
+        if (ends[p]) bitmask_set(output, p);
+    }
+    free(starts);
+    free(ends);
+}
+
 // Test basic literal matching
 TEST(literal_matching) {
     flowregex_error_t error;
@@ -52,14 +133,14 @@ TEST(literal_matching) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     } else {
         printf("No matches found\n");
     }
     
-    int expected[] = {4};
+    size_t expected[] = {4};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
@@ -81,14 +162,14 @@ TEST(alternation) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     } else {
         printf("No matches found\n");
     }
     
-    int expected[] = {2};
+    size_t expected[] = {2};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
@@ -110,14 +191,14 @@ TEST(kleene_star) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     } else {
         printf("No matches found\n");
     }
     
-    int expected[] = {4};
+    size_t expected[] = {4};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
@@ -134,7 +215,7 @@ TEST(plus_quantifier) {
     match_result_t *result = flowregex_match(regex, "aaa", false);
     assert(result != NULL);
     
-    int expected[] = {1, 2, 3};
+    size_t expected[] = {1, 2, 3};
     assert(check_match_result(result, expected, 3));
     
     match_result_destroy(result);
@@ -156,14 +237,14 @@ TEST(question_quantifier) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     } else {
         printf("No matches found\n");
     }
     
-    int expected[] = {2};
+    size_t expected[] = {2};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
@@ -180,7 +261,7 @@ TEST(any_character) {
     match_result_t *result = flowregex_match(regex, "abc", false);
     assert(result != NULL);
     
-    int expected[] = {3};
+    size_t expected[] = {3};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
@@ -197,13 +278,140 @@ TEST(character_classes) {
     match_result_t *result = flowregex_match(regex, "abc123def", false);
     assert(result != NULL);
     
-    int expected[] = {4, 5, 6};
+    size_t expected[] = {4, 5, 6};
     assert(check_match_result(result, expected, 3));
     
     match_result_destroy(result);
     flowregex_destroy(regex);
 }
 
+// Test bracket expressions
+TEST(bracket_expressions) {
+    struct {
+        const char *pattern;
+        const char *text;
+        size_t expected[8];
+        size_t count;
+    } cases[] = {
+        { "[ACGT]+", "xAGy", {2, 3}, 2 },
+        { "[0-9a-f][0-9a-f]", "0x1fZ", {4}, 1 },
+        { "[^\\n]", "a\nb", {1, 3}, 2 },
+        { "[]a]", "]b", {1}, 1 },
+        { "[^]a]", "]ab", {3}, 1 },
+        { "[a\\-z]", "b-", {2}, 1 },
+        { "[a-]", "-b", {1}, 1 },
+        { "[\\d_]x", "1x_xax", {2, 4}, 2 },
+        { "[^\\s\\d]", "1 a", {3}, 1 },
+        { "[\\]\\\\]", "a]\\", {2, 3}, 2 },
+    };
+    flowregex_error_t error;
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        flowregex_t *regex = flowregex_create(cases[i].pattern, &error);
+        assert(regex != NULL);
+        assert(error == FLOWREGEX_OK);
+        
+        match_result_t *result = flowregex_match(regex, cases[i].text, false);
+        assert(check_match_result(result, cases[i].expected, cases[i].count));
+        match_result_destroy(result);
+        flowregex_destroy(regex);
+    }
+    
+    // Malformed brackets
+    const char *invalid[] = { "[abc", "[]", "[z-a]", "[a\\", "[\\d-z]" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(flowregex_create(invalid[i], &error) == NULL);
+        assert(error == FLOWREGEX_ERROR_PARSE);
+    }
+    
+    // Class masks built from OptimizedText byte masks match the table scan
+    const char *text = "ACGTTGCA\nNNACGX\nacgt";
+    const char *patterns[] = { "[ACGT]+", "[^\\n]+", "[^ACGT\\n]", "[AC]G" };
+    optimized_text_t *opt_text = optimized_text_create(text, "ACGTN\n");
+    assert(opt_text != NULL);
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(ctx != NULL);
+    
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        
+        match_result_t *plain = flowregex_match(regex, text, false);
+        flowregex_ctx_set_optimized_text(ctx, opt_text);
+        match_result_t *indexed = flowregex_match_ctx(regex, ctx, text, strlen(text));
+        assert(plain != NULL && indexed != NULL);
+        assert(check_match_result(indexed, plain->positions, plain->count));
+        
+        match_result_destroy(plain);
+        match_result_destroy(indexed);
+        flowregex_destroy(regex);
+    }
+    
+    flowregex_ctx_destroy(ctx);
+    optimized_text_destroy(opt_text);
+}
+
+// Test the pattern-driven OptimizedText index and its one-pass builder
+TEST(optimized_text_index) {
+    // One-pass byte masks agree with a per-position scan, tail included
+    char text[300];
+    for (size_t i = 0; i < sizeof(text) - 1; i++) {
+        text[i] = "ACGTx7\n"[(i * 7 + i / 5) % 7];
+    }
+    text[sizeof(text) - 1] = '\0';
+    size_t text_len = strlen(text);
+    
+    for (size_t len = 0; len <= text_len; len += 37) {
+        unsigned char bytes[3] = { 'A', 'x', '\n' };
+        bitmask_t *masks[3];
+        for (int k = 0; k < 3; k++) {
+            masks[k] = bitmask_create(len + 1);
+            bitmask_set_all(masks[k]);
+        }
+        bitmask_match_bytes(masks, bytes, 3, text, len);
+        for (int k = 0; k < 3; k++) {
+            for (size_t pos = 0; pos <= len; pos++) {
+                assert(bitmask_get(masks[k], pos) == (pos < len && text[pos] == (char)bytes[k]));
+            }
+            bitmask_destroy(masks[k]);
+        }
+    }
+    
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("[ACGT]+x|\\d.", &error);
+    assert(regex != NULL);
+    
+    optimized_text_t *opt_text = optimized_text_create_for_regex(regex, text, text_len);
+    assert(opt_text != NULL);
+    
+    // Literals and small classes are indexed, nothing is built up front;
+    // '.' is indexed through its one excluded byte
+    assert(optimized_text_has_match_mask(opt_text, 'G'));
+    assert(optimized_text_has_match_mask(opt_text, 'x'));
+    assert(optimized_text_has_match_mask(opt_text, '5'));
+    assert(optimized_text_has_match_mask(opt_text, '\n'));
+    assert(!optimized_text_has_match_mask(opt_text, 'N'));
+    assert(opt_text->match_masks['G'] == NULL);
+    assert(optimized_text_get_match_mask(opt_text, 'N') == NULL);
+    
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(ctx != NULL);
+    flowregex_ctx_set_optimized_text(ctx, opt_text);
+    match_result_t *indexed = flowregex_match_ctx(regex, ctx, text, text_len);
+    match_result_t *plain = flowregex_match(regex, text, false);
+    assert(indexed != NULL && plain != NULL && plain->count > 0);
+    assert(check_match_result(indexed, plain->positions, plain->count));
+    
+    // The first lookup built every indexed mask in one pass
+    assert(opt_text->match_masks['G'] != NULL && opt_text->match_masks['7'] != NULL);
+    
+    match_result_destroy(indexed);
+    match_result_destroy(plain);
+    flowregex_ctx_destroy(ctx);
+    optimized_text_destroy(opt_text);
+    flowregex_destroy(regex);
+}
+
 // Test grouping
 TEST(grouping) {
     flowregex_error_t error;
@@ -214,7 +422,7 @@ TEST(grouping) {
     match_result_t *result = flowregex_match(regex, "ababab", false);
     assert(result != NULL);
     
-    int expected[] = {2, 4, 6};
+    size_t expected[] = {2, 4, 6};
     assert(check_match_result(result, expected, 3));
     
     match_result_destroy(result);
@@ -236,20 +444,1155 @@ TEST(complex_pattern) {
     if (result->count > 0) {
         printf("Positions: ");
         for (size_t i = 0; i < result->count; i++) {
-            printf("%d ", result->positions[i]);
+            printf("%zu ", result->positions[i]);
         }
         printf("\n");
     } else {
         printf("No matches found\n");
     }
     
-    int expected[] = {6};
+    size_t expected[] = {6};
     assert(check_match_result(result, expected, 1));
     
     match_result_destroy(result);
     flowregex_destroy(regex);
 }
 
+// Test single-character elements across 64-bit word boundaries
+TEST(word_boundaries) {
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("x.\\d", &error);
+    assert(regex != NULL);
+    assert(error == FLOWREGEX_OK);
+    
+    // Matches straddle the word boundaries at 64 and 128; '.' rejects newline
+    char text[201];
+    memset(text, '-', 200);
+    text[200] = '\0';
+    memcpy(text + 62, "xy7", 3);
+    memcpy(text + 126, "xz9", 3);
+    memcpy(text + 190, "x\n8", 3);
+    
+    match_result_t *result = flowregex_match(regex, text, false);
+    assert(result != NULL);
+    
+    size_t expected[] = {65, 129};
+    assert(check_match_result(result, expected, 2));
+    
+    match_result_destroy(result);
+    flowregex_destroy(regex);
+}
+
+// Test that star/plus fixpoints are exact beyond 100 repetitions
+TEST(long_repetition) {
+    flowregex_error_t error;
+    flowregex_t *star = flowregex_create("X(AT)*G", &error);
+    flowregex_t *plus = flowregex_create("X(AT)+G", &error);
+    assert(star != NULL && plus != NULL);
+    
+    // "X" + "AT" * 150 + "G"
+    char text[303];
+    text[0] = 'X';
+    for (int i = 0; i < 150; i++) {
+        text[1 + 2 * i] = 'A';
+        text[2 + 2 * i] = 'T';
+    }
+    text[301] = 'G';
+    text[302] = '\0';
+    
+    size_t expected[] = {302};
+    
+    match_result_t *result = flowregex_match(star, text, false);
+    assert(check_match_result(result, expected, 1));
+    match_result_destroy(result);
+    
+    result = flowregex_match(plus, text, false);
+    assert(check_match_result(result, expected, 1));
+    match_result_destroy(result);
+    
+    flowregex_destroy(star);
+    flowregex_destroy(plus);
+}
+
+// Test texts beyond the former 100,000-byte limit
+TEST(long_text) {
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("GA(TT)+C|\\d\\d", &error);
+    assert(regex != NULL);
+    
+    size_t len = 3 * 1000 * 1000;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    memset(text, 'a', len);
+    text[len] = '\0';
+    memcpy(text + 10, "GATTC", 5);
+    memcpy(text + 2500000, "GATTTTC", 7);
+    memcpy(text + len - 2, "42", 2);
+    
+    size_t expected[] = {15, 2500007, len};
+    match_result_t *result = flowregex_match(regex, text, false);
+    assert(check_match_result(result, expected, 3));
+    match_result_destroy(result);
+    
+    free(text);
+    flowregex_destroy(regex);
+}
+
+// Collects streamed end positions into a match result
+static void collect_match(size_t end, void *user_data) {
+    match_result_add((match_result_t *)user_data, end);
+}
+
+// Streaming in chunks of any size finds the same ends as one whole-text match
+TEST(streaming_match) {
+    const char *patterns[] = {
+        "(ab|c)*d", "((ab|c)+d)*e?", "a+b", "x.*y", "[ACGT]+", "a?", "(ab)+(cd)*|b+",
+        "ababcdcd", "(ab.|xcd)+y"
+    };
+    const char *text = "abcabd xcdy aab ACGTTGA ababcdcd xx\nyy abcccd";
+    size_t text_len = strlen(text);
+    size_t chunk_sizes[] = {1, 2, 3, 7, 64};
+    flowregex_error_t error;
+    
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        match_result_t *whole = flowregex_match(regex, text, false);
+        assert(whole != NULL);
+        
+        for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+            match_result_t *streamed = match_result_create();
+            flowregex_stream_t *stream = flowregex_stream_open(regex, collect_match, streamed);
+            assert(stream != NULL);
+            for (size_t pos = 0; pos < text_len; pos += chunk_sizes[c]) {
+                size_t n = text_len - pos < chunk_sizes[c] ? text_len - pos : chunk_sizes[c];
+                assert(flowregex_stream_feed(stream, text + pos, n));
+            }
+            assert(flowregex_stream_finish(stream));
+            assert(check_match_result(streamed, whole->positions, whole->count));
+            match_result_destroy(streamed);
+        }
+        match_result_destroy(whole);
+        flowregex_destroy(regex);
+    }
+    
+    // An empty stream still reports position 0 for patterns matching ""
+    flowregex_t *regex = flowregex_create("a*", &error);
+    match_result_t *streamed = match_result_create();
+    flowregex_stream_t *stream = flowregex_stream_open(regex, collect_match, streamed);
+    assert(flowregex_stream_finish(stream));
+    size_t expected_empty[] = {0};
+    assert(check_match_result(streamed, expected_empty, 1));
+    match_result_destroy(streamed);
+    
+    // A single large feed is split into blocks internally
+    size_t len = 3 * FLOWREGEX_STREAM_BLOCK / 2;
+    char *long_text = malloc(len);
+    assert(long_text != NULL);
+    memset(long_text, 'a', len);
+    streamed = match_result_create();
+    stream = flowregex_stream_open(regex, collect_match, streamed);
+    assert(flowregex_stream_feed(stream, long_text, len));
+    assert(flowregex_stream_finish(stream));
+    assert(streamed->count == len + 1);
+    match_result_destroy(streamed);
+    free(long_text);
+    flowregex_destroy(regex);
+}
+
+// Chunked matching across threads, bounded and unbounded patterns
+TEST(parallel_match) {
+    flowregex_error_t error;
+    
+    // Static maximum match length
+    const char *bounded[] = {"abc", "a|bcd", "a?b", "(ab)?c", "[ab].\\d"};
+    size_t lengths[] = {3, 3, 2, 3, 3};
+    for (size_t i = 0; i < sizeof(bounded) / sizeof(bounded[0]); i++) {
+        flowregex_t *regex = flowregex_create(bounded[i], &error);
+        assert(regex != NULL);
+        assert(regex->max_length == lengths[i]);
+        flowregex_destroy(regex);
+    }
+    flowregex_t *unbounded = flowregex_create("a(b|c*)", &error);
+    assert(unbounded != NULL && unbounded->max_length == SIZE_MAX);
+    flowregex_destroy(unbounded);
+    
+    // A DNA-like text spanning several chunks
+    size_t len = 3 * FLOWREGEX_PARALLEL_CHUNK + 12345;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "ACGT"[(seed >> 16) & 3];
+    }
+    text[len] = '\0';
+    // Plant matches across the chunk boundaries
+    memcpy(text + FLOWREGEX_PARALLEL_CHUNK - 3, "GATTACA", 7);
+    memcpy(text + 2 * FLOWREGEX_PARALLEL_CHUNK - 6, "GATTACA", 7);
+    
+    // Unbounded patterns carry their state across the chunk boundaries
+    const char *patterns[] = {"GATTACA", "A(C|G)T?", "[CG]", "T?", "GA+T", "GATTA.*TTAG", "C(AC|GT)*G+A"};
+    size_t thread_counts[] = {1, 3, 0};
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        match_result_t *whole = flowregex_match(regex, text, false);
+        assert(whole != NULL);
+        
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            match_result_t *result = flowregex_match_parallel(regex, text, thread_counts[t]);
+            assert(result != NULL && result->count == whole->count);
+            for (size_t j = 0; j < whole->count; j++) {
+                assert(result->positions[j] == whole->positions[j]);
+            }
+            match_result_destroy(result);
+        }
+        match_result_destroy(whole);
+        flowregex_destroy(regex);
+    }
+    free(text);
+}
+
+// One compiled pattern matched by several threads at once
+typedef struct {
+    flowregex_t *regex;
+    const char *text;
+    const match_result_t *want;
+    bool same;
+} shared_match_t;
+
+static void *shared_match_worker(void *arg) {
+    shared_match_t *job = arg;
+    job->same = true;
+    for (int run = 0; run < 20 && job->same; run++) {
+        match_result_t *result = flowregex_match(job->regex, job->text, false);
+        job->same = result != NULL && result->count == job->want->count &&
+                    memcmp(result->positions, job->want->positions, result->count * sizeof(size_t)) == 0;
+        match_result_destroy(result);
+    }
+    return NULL;
+}
+
+// Test that flowregex_match keeps no state in the regex between calls
+TEST(shared_regex_threads) {
+    // Texts of different lengths, so a shared context would be rebound
+    const char *texts[] = {
+        "GATTACA ACGTGATTACA", "xxGATTACAxx", "ACGTACGT GATTACA GATTACA GATTACA", "GATTACAGATTACA"
+    };
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("GATTA(C|G)A", &error);
+    assert(regex != NULL);
+    
+    match_result_t *want[4];
+    shared_match_t jobs[4];
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; i++) {
+        want[i] = flowregex_match(regex, texts[i], false);
+        assert(want[i] != NULL && want[i]->count > 0);
+        jobs[i] = (shared_match_t){regex, texts[i], want[i], false};
+    }
+    for (size_t i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, shared_match_worker, &jobs[i]) == 0);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        assert(jobs[i].same);
+        match_result_destroy(want[i]);
+    }
+    flowregex_destroy(regex);
+}
+
+// Patterns compiled together match like each one alone
+TEST(pattern_set) {
+    const char *patterns[] = {
+        "GATTACA", "A(C|G)T?", "GATTA.*TTAG", "[CG]+", "a?", "C(AC|GT)*G+A", "GATTACA", "zz"
+    };
+    size_t count = sizeof(patterns) / sizeof(patterns[0]);
+    flowregex_error_t error;
+    
+    flowregex_set_t *set = flowregex_set_create(patterns, count, &error);
+    assert(set != NULL && error == FLOWREGEX_OK);
+    
+    // Long enough to span several blocks
+    size_t len = 2 * FLOWREGEX_SET_BLOCK + 777;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 7;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "ACGT"[(seed >> 16) & 3];
+    }
+    text[len] = '\0';
+    memcpy(text + FLOWREGEX_SET_BLOCK - 4, "GATTACA", 7);
+    
+    match_result_t **results = flowregex_set_match(set, text, len);
+    assert(results != NULL);
+    for (size_t k = 0; k < count; k++) {
+        flowregex_t *regex = flowregex_create(patterns[k], &error);
+        assert(regex != NULL);
+        match_result_t *alone = flowregex_match(regex, text, false);
+        assert(alone != NULL && results[k]->count == alone->count);
+        for (size_t j = 0; j < alone->count; j++) {
+            assert(results[k]->positions[j] == alone->positions[j]);
+        }
+        match_result_destroy(alone);
+        flowregex_destroy(regex);
+    }
+    flowregex_set_results_destroy(results, count);
+    
+    // Which patterns matched: all but "zz"
+    uint64_t matched[1];
+    assert(flowregex_set_matched(set, text, len, matched));
+    assert(matched[0] == 0x7F);
+    assert(flowregex_set_matched(set, "", 0, matched));
+    assert(matched[0] == 0x10);    // only "a?" matches the empty text
+    
+    // Invalid patterns are reported like flowregex_create
+    const char *bad[] = {"abc", "(ab"};
+    assert(flowregex_set_create(bad, 2, &error) == NULL);
+    assert(error == FLOWREGEX_ERROR_PARSE);
+    
+    free(text);
+    flowregex_set_destroy(set);
+}
+
+// Equal subtrees applied to the same value are compiled once
+static size_t count_ops(const program_t *program, program_op_t op) {
+    size_t count = 0;
+    for (size_t pc = 0; pc < program->length; pc++) {
+        if (program->code[pc].op == op) count++;
+    }
+    return count;
+}
+
+TEST(common_subexpressions) {
+    flowregex_error_t error;
+    
+    struct {
+        const char *pattern;
+        program_op_t op;
+        size_t count;
+        const char *text;
+        size_t expected[4];
+        size_t expected_count;
+    } cases[] = {
+        {"abc|abd", OP_AND_SHIFT, 4, "abcabd", {3, 6}, 2},
+        {"(ab)*c|(ab)*d", OP_FIX_BEGIN, 1, "ababcd", {5, 6}, 2},
+        {"((ab|ab)c)+", OP_AND_SHIFT, 3, "abcabcx", {3, 6}, 2},
+        {"x[a]|xa", OP_AND_SHIFT, 2, "xaxb", {2}, 1},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        // Compiled straight from the parse tree, before the optimizer
+        // factors the branches
+        regex_element_t *root = parse_regex(cases[i].pattern, &error);
+        assert(root != NULL);
+        program_t *program = program_compile(root, &error);
+        assert(program != NULL);
+        assert(count_ops(program, cases[i].op) == cases[i].count);
+        program_destroy(program);
+        root->destroy(root);
+        
+        flowregex_t *regex = flowregex_create(cases[i].pattern, &error);
+        assert(regex != NULL);
+        match_result_t *result = flowregex_match(regex, cases[i].text, false);
+        assert(check_match_result(result, cases[i].expected, cases[i].expected_count));
+        match_result_destroy(result);
+        flowregex_destroy(regex);
+    }
+    
+    // Identical patterns in a set share their output
+    const char *patterns[] = {"a(b|c)+", "x", "a(b|c)+"};
+    flowregex_set_t *set = flowregex_set_create(patterns, 3, &error);
+    assert(set != NULL);
+    assert(set->program->output_slots[0] == set->program->output_slots[2]);
+    match_result_t **results = flowregex_set_match(set, "abcxab", 6);
+    assert(results != NULL);
+    size_t expected_ab[] = {2, 3, 6};
+    assert(check_match_result(results[0], expected_ab, 3));
+    assert(check_match_result(results[2], expected_ab, 3));
+    flowregex_set_results_destroy(results, 3);
+    flowregex_set_destroy(set);
+}
+
+// Runs of single-character factors compile to one fused string step
+TEST(fused_strings) {
+    flowregex_error_t error;
+    
+    flowregex_t *regex = flowregex_create("GATTACA", &error);
+    assert(regex != NULL);
+    assert(regex->root->type == REGEX_STRING);
+    assert(regex->max_length == 7);
+    assert(count_ops(regex->program, OP_STRING) == 1);
+    assert(count_ops(regex->program, OP_AND_SHIFT) == 0);
+    match_result_t *result = flowregex_match(regex, "GATTACATTGATTACA", false);
+    size_t expected[] = {7, 16};
+    assert(check_match_result(result, expected, 2));
+    match_result_destroy(result);
+    flowregex_destroy(regex);
+    
+    // Classes and '.' fuse too; the run stops at a repeat
+    regex = flowregex_create("x\\d.[ab]y*", &error);
+    assert(regex != NULL);
+    assert(regex->root->type == REGEX_CONCAT && regex->root->left->type == REGEX_STRING);
+    result = flowregex_match(regex, "x1\nax7-byy", false);
+    size_t expected_class[] = {8, 9, 10};
+    assert(check_match_result(result, expected_class, 3));
+    match_result_destroy(result);
+    flowregex_destroy(regex);
+    
+    // Longer runs are split into strings of REGEX_STRING_MAX steps
+    char pattern[2 * REGEX_STRING_MAX + 11];
+    char text[4 * REGEX_STRING_MAX];
+    size_t n = sizeof(pattern) - 1;
+    for (size_t i = 0; i < n; i++) pattern[i] = "ab"[i % 3 == 2];
+    pattern[n] = '\0';
+    memset(text, 'z', sizeof(text));
+    memcpy(text + 5, pattern, n);
+    text[sizeof(text) - 1] = '\0';
+    regex = flowregex_create(pattern, &error);
+    assert(regex != NULL);
+    assert(count_ops(regex->program, OP_STRING) == 3);
+    result = flowregex_match(regex, text, false);
+    size_t expected_long[] = {5 + n};
+    assert(check_match_result(result, expected_long, 1));
+    match_result_destroy(result);
+    flowregex_destroy(regex);
+    
+    // Over many blocks the fused step agrees with the step-by-step elements
+    size_t big_len = 40000;
+    char *big = malloc(big_len);
+    assert(big != NULL);
+    uint32_t seed = 7;
+    for (size_t i = 0; i < big_len; i++) {
+        seed = seed * 1103515245 + 12345;
+        big[i] = "ab"[(seed >> 16) & 1];
+    }
+    regex = flowregex_create("ab[ab]ba.a", &error);
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(regex != NULL && ctx != NULL);
+    const bitmask_t *mask = flowregex_match_mask(regex, ctx, big, big_len);
+    assert(mask != NULL && bitmask_any(mask));
+    bitmask_t *reference = bitmask_create(big_len + 1);
+    reference_match(regex->root, ctx, reference);
+    for (size_t pos = 0; pos <= big_len; pos++) {
+        assert(bitmask_get(mask, pos) == bitmask_get(reference, pos));
+    }
+    bitmask_destroy(reference);
+    flowregex_ctx_destroy(ctx);
+    flowregex_destroy(regex);
+    free(big);
+}
+
+// The optimizer hands the compiler a smaller tree that matches the same way
+TEST(pattern_rewrites) {
+    flowregex_error_t error;
+    
+    struct {
+        const char *pattern;
+        regex_element_type_t root;
+        regex_element_type_t right;
+        const char *text;
+        size_t expected[4];
+        size_t expected_count;
+    } cases[] = {
+        {"(a*)*", REGEX_KLEENE_STAR, 0, "ab", {0, 1, 2}, 3},
+        {"(a+)?", REGEX_KLEENE_STAR, 0, "ba", {0, 1, 2}, 3},
+        {"((a|b)+)+", REGEX_PLUS, 0, "abc", {1, 2}, 2},
+        {"a|b|[cd]|a", REGEX_CHAR_CLASS, 0, "axd", {1, 3}, 2},
+        {"ab|ac", REGEX_STRING, 0, "abac", {2, 4}, 2},
+        {"ab|a", REGEX_CONCAT, REGEX_QUESTION, "abx", {1, 2}, 2},
+        {"aa*", REGEX_PLUS, 0, "baa", {2, 3}, 2},
+        {"(ab)*ab", REGEX_PLUS, 0, "abab", {2, 4}, 2},
+        {"a*a+a?", REGEX_PLUS, 0, "aab", {1, 2}, 2},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        flowregex_t *regex = flowregex_create(cases[i].pattern, &error);
+        assert(regex != NULL);
+        assert(regex->root->type == cases[i].root);
+        if (cases[i].right) assert(regex->root->right->type == cases[i].right);
+        match_result_t *result = flowregex_match(regex, cases[i].text, false);
+        assert(check_match_result(result, cases[i].expected, cases[i].expected_count));
+        match_result_destroy(result);
+        flowregex_destroy(regex);
+    }
+}
+
+// A literal prefix is found first and only its occurrences start the run
+TEST(literal_prefilter) {
+    flowregex_error_t error;
+    
+    struct {
+        const char *pattern;
+        const char *prefix;
+    } prefixes[] = {
+        {"ERROR: \\d+", "ERROR: "},
+        {"(ab|ac)d", "a"},
+        {"xy(z|w)*", "xy"},
+        {"abcdefghijklmnopqrstuvwxyz", "abcdefghijklmnop"},
+        {"\\d+x", ""},
+        {"a*b", ""},
+        {"a|b", ""},
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        flowregex_t *regex = flowregex_create(prefixes[i].pattern, &error);
+        assert(regex != NULL);
+        assert(regex->program->prefix_length == strlen(prefixes[i].prefix));
+        assert(memcmp(regex->program->prefix, prefixes[i].prefix, regex->program->prefix_length) == 0);
+        flowregex_destroy(regex);
+    }
+    
+    // The substring search agrees with a byte-by-byte scan, up to the text's end
+    size_t len = 3000;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 11;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "ab"[(seed >> 16) & 1];
+    }
+    text[len] = '\0';
+    const char *needles[] = {"b", "ab", "abba", "aabbaabbab"};
+    bitmask_t *found = bitmask_create(len + 1);
+    assert(found != NULL);
+    for (size_t k = 0; k < sizeof(needles) / sizeof(needles[0]); k++) {
+        size_t n = strlen(needles[k]);
+        size_t count = bitmask_find_string(found, text, len, (const unsigned char *)needles[k], n, 0);
+        size_t expected = 0;
+        for (size_t pos = 0; pos <= len; pos++) {
+            bool at = pos + n <= len && memcmp(text + pos, needles[k], n) == 0;
+            assert(bitmask_get(found, pos) == at);
+            expected += at;
+        }
+        assert(count == expected);
+        // Far denser than one per 64 positions: the scan gives up
+        if (n <= 4) assert(bitmask_find_string(found, text, len, (const unsigned char *)needles[k], n, 64) == SIZE_MAX);
+    }
+    bitmask_destroy(found);
+    free(text);
+    
+    // Sparse occurrences in a long text, at window edges and at the very end
+    len = 5 * 4096 + 100;
+    text = malloc(len + 1);
+    assert(text != NULL);
+    memset(text, '.', len);
+    text[len] = '\0';
+    size_t starts[] = {0, 4090, 8192, 12280, 16383, len - 16};
+    size_t expected_ends[6];
+    for (size_t i = 0; i < 6; i++) {
+        memcpy(text + starts[i], i % 2 ? "ERROR: code=404" : "ERROR: code=52x", 15);
+        expected_ends[i] = starts[i] + 15;
+    }
+    flowregex_t *regex = flowregex_create("ERROR: code=\\d(\\d\\d|2x)", &error);
+    assert(regex != NULL);
+    match_result_t *result = flowregex_match(regex, text, false);
+    assert(check_match_result(result, expected_ends, 6));
+    match_result_destroy(result);
+    
+    // No occurrence: nothing runs and nothing matches
+    memset(text, '.', len);
+    result = flowregex_match(regex, text, false);
+    assert(result != NULL && result->count == 0);
+    match_result_destroy(result);
+    flowregex_destroy(regex);
+    free(text);
+}
+
+// Test matching from a required literal factor inside the pattern
+TEST(required_factors) {
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("\\d+-ERROR-\\w+", &error);
+    assert(regex != NULL);
+    assert(regex->factor_count == 1);
+    const regex_factor_t *factor = &regex->factors[0];
+    assert(factor->from->prefix_length == 7 && memcmp(factor->from->prefix, "-ERROR-", 7) == 0);
+    assert(factor->before != NULL && factor->before_length == 1);
+    flowregex_destroy(regex);
+    
+    // Noise with the factors planted, some with and some without what goes
+    // before them, across more than four windows
+    size_t len = 6 * 4096 + 77;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 5;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "abcdxyw 01239@."[(seed >> 16) % 15];
+    }
+    const char *plants[] = {"7-ERROR-ab", " -ERROR-x", "cdQQyw", "x@example.com", "QQ", "aQQ"};
+    for (size_t i = 0; i < 24; i++) {
+        const char *plant = plants[i % 6];
+        size_t at = i * 1000 + (i * 37) % 90;
+        if (i == 23) at = len - strlen(plant);
+        memcpy(text + at, plant, strlen(plant));
+    }
+    text[len] = '\0';
+    
+    const char *patterns[] = {
+        "\\d+-ERROR-\\w+", "[a-z]+@example\\.com", "(ab|cd)x?QQ(y|w)*", "a*QQ", "x+QQ.*"
+    };
+    optimized_text_t *opt_text = optimized_text_create(text, "QE@-");
+    assert(opt_text != NULL);
+    flowregex_ctx_t *plain = flowregex_ctx_create();
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(plain != NULL && ctx != NULL);
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(expected != NULL);
+    
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL && regex->factor_count > 0);
+        
+        const bitmask_t *mask = flowregex_match_mask(regex, plain, text, len);
+        assert(mask != NULL);
+        reference_match(regex->root, plain, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        
+        // Ranked by the counts of an OptimizedText instead
+        flowregex_ctx_set_optimized_text(ctx, opt_text);
+        mask = flowregex_match_mask(regex, ctx, text, len);
+        assert(mask != NULL);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(plain);
+    flowregex_ctx_destroy(ctx);
+    optimized_text_destroy(opt_text);
+    free(text);
+}
+
+// Test whole-text matches of a long text, run one tile at a time
+TEST(tiled_evaluation) {
+    // Runs that cross tile edges, and one that spans whole tiles
+    size_t len = 5 * FLOWREGEX_TILE + 333;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 3;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "abcd x\n"[(seed >> 16) % 7];
+    }
+    for (size_t i = 1; i <= 4; i++) {
+        memset(text + i * FLOWREGEX_TILE - 40, 'b', 80);
+    }
+    memset(text + FLOWREGEX_TILE / 2, 'c', 2 * FLOWREGEX_TILE);
+    text[len] = '\0';
+    
+    const char *patterns[] = {"a(b|c)*d", "(ab|bb)+x?", ".*x", "bbbc", "[^\\n]+\\n", "x(a|b|c|d| )*"};
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(ctx != NULL && expected != NULL);
+    flowregex_error_t error;
+    
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        
+        const bitmask_t *mask = flowregex_match_mask(regex, ctx, text, len);
+        assert(mask != NULL && bitmask_any(mask));
+        
+        // No scratch mask spans the whole text
+        assert(ctx->pool->allocated == 0);
+        
+        reference_match(regex->root, ctx, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(ctx);
+    free(text);
+}
+
+// Test steps taken from the text at sparse live positions
+TEST(sparse_steps) {
+    size_t len = 5000;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 17;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = "ACGT"[(seed >> 16) & 3];
+    }
+    text[len] = '\0';
+    flowregex_error_t error;
+    
+    // The prefix occurs about once per 256 positions: too often for
+    // windows, rarely enough that no text mask is ever built
+    flowregex_t *regex = flowregex_create("TATA[AT]A[AT]", &error);
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(regex != NULL && ctx != NULL);
+    const bitmask_t *mask = flowregex_match_mask(regex, ctx, text, len);
+    assert(mask != NULL);
+    assert(ctx->pool->allocated == 0);
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(expected != NULL);
+    reference_match(regex->root, ctx, expected);
+    for (size_t pos = 0; pos <= len; pos++) {
+        assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+    }
+    flowregex_destroy(regex);
+    
+    // Closures and strings run on from sparse values, mixed with dense steps
+    const char *patterns[] = {"GATC(A|C)*T", "TTT[AG]+C", "CCCC.*GG", "(ACGTA|TTTT)(C|G)+A?T"};
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        mask = flowregex_match_mask(regex, ctx, text, len);
+        assert(mask != NULL && bitmask_any(mask));
+        reference_match(regex->root, ctx, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(ctx);
+    free(text);
+}
+
+// Test that a rare motif in a long text keeps its masks as positions: no
+// mask of the match is ever stored as text-length words
+TEST(rare_motif_positions) {
+    size_t len = 1 << 22;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    memset(text, 'a', len);
+    size_t at[] = {100, 70000, 1 << 21, len - 9};
+    for (size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++) {
+        memcpy(text + at[i], "GATTACA", 7);
+    }
+    text[len] = '\0';
+    flowregex_error_t error;
+    
+    flowregex_t *regex = flowregex_create("GATTA(C|G)A", &error);
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(regex != NULL && ctx != NULL);
+    const bitmask_t *mask = flowregex_match_mask(regex, ctx, text, len);
+    assert(mask != NULL && bitmask_count(mask) == sizeof(at) / sizeof(at[0]));
+    for (size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++) {
+        assert(bitmask_get(mask, at[i] + 7));
+    }
+    assert(ctx->initial->kind == BITMASK_FULL && ctx->initial->bits == NULL);
+    assert(ctx->starts->kind == BITMASK_ARRAY && ctx->starts->bits == NULL);
+    assert(mask->kind == BITMASK_ARRAY && mask->bits == NULL);
+    
+    flowregex_ctx_destroy(ctx);
+    flowregex_destroy(regex);
+    free(text);
+}
+
+// Test the strategies the planner picks from byte statistics, sampled from
+// the text or counted in an OptimizedText, against the reference matches
+TEST(match_plan) {
+    // The same length of DNA and of lowercase words
+    size_t len = 6 * 4096 + 77;
+    char *dna = malloc(len + 1);
+    char *words = malloc(len + 1);
+    assert(dna != NULL && words != NULL);
+    uint32_t seed = 11;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        dna[i] = "ACGT"[(seed >> 16) & 3];
+        words[i] = "etaoin shrdlu cmfwyp"[(seed >> 16) % 20];
+    }
+    memcpy(words + 9000, "42-ERROR-disk", 13);
+    memcpy(words + 20000, "TAG", 3);
+    dna[len] = '\0';
+    words[len] = '\0';
+    
+    struct {
+        const char *pattern;
+        const char *text;
+        plan_strategy_t strategy;
+        plan_strategy_t indexed;    // with the OptimizedText's masks
+    } cases[] = {
+        {"\\d+-ERROR-\\w+", words, PLAN_FACTOR, PLAN_FACTOR},   // rare factor after a class
+        {"e\\w+", words, PLAN_DFA, PLAN_DFA},                     // the prefix is everywhere
+        {"TA[CG]", words, PLAN_PREFIX, PLAN_PREFIX},               // rare in words...
+        {"TA[CG]", dna, PLAN_DFA, PLAN_DENSE},                     // ...common in DNA
+        {"GATTACA[AT]", dna, PLAN_PREFIX, PLAN_DENSE},
+    };
+    optimized_text_t *opt_words = optimized_text_create(words, "e-");
+    optimized_text_t *opt_dna = optimized_text_create(dna, "ACGT");
+    assert(opt_words != NULL && opt_dna != NULL);
+    flowregex_ctx_t *plain = flowregex_ctx_create();
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(plain != NULL && ctx != NULL);
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(expected != NULL);
+    flowregex_error_t error;
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        flowregex_t *regex = flowregex_create(cases[i].pattern, &error);
+        assert(regex != NULL);
+        const bitmask_t *mask = flowregex_match_mask(regex, plain, cases[i].text, len);
+        assert(mask != NULL);
+        assert(plain->plan.strategy == cases[i].strategy && plain->plan.sampled);
+        reference_match(regex->root, plain, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        
+        // Planned from the counts of an OptimizedText instead
+        flowregex_ctx_set_optimized_text(ctx, cases[i].text == dna ? opt_dna : opt_words);
+        mask = flowregex_match_mask(regex, ctx, cases[i].text, len);
+        assert(mask != NULL);
+        assert(ctx->plan.strategy == cases[i].indexed && !ctx->plan.sampled);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(plain);
+    flowregex_ctx_destroy(ctx);
+    optimized_text_destroy(opt_words);
+    optimized_text_destroy(opt_dna);
+    free(words);
+    free(dna);
+}
+
+// Test a loop the planner runs as its subtree's NFA (OP_NFA): long chains
+// from rare starts, across tile and window boundaries, against the
+// reference, while a loop from every position keeps its fixpoint
+TEST(planned_nfa_loops) {
+    size_t len = 5 * FLOWREGEX_TILE + 123;
+    char *text = malloc(len + 1);
+    assert(text != NULL);
+    uint32_t seed = 5;
+    for (size_t pos = 0; pos < len;) {
+        seed = seed * 1103515245 + 12345;
+        size_t n = (seed >> 16) % 40;
+        if (pos == 2 * FLOWREGEX_TILE - 100) n = 10000;    // one string across boundaries
+        const char *open = "{\"name\": \"";
+        for (size_t k = 0; open[k] && pos < len; k++) text[pos++] = open[k];
+        for (size_t k = 0; k < n && pos < len; k++) {
+            seed = seed * 1103515245 + 12345;
+            text[pos++] = k % 7 == 3 ? '\\' : "ab\"c d"[(seed >> 16) % 6];
+        }
+        if (pos < len) text[pos++] = '"';
+        if (pos < len) text[pos++] = '\n';
+    }
+    text[len] = '\0';
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(ctx != NULL && expected != NULL);
+    flowregex_error_t error;
+    
+    struct {
+        const char *pattern;
+        plan_engine_t engine;   // planned for the loop's OP_NFA
+    } cases[] = {
+        {"\"name\": \"([^\"\\\\]|\\\\.)*\"", ENGINE_NFA},
+        {"([a-d]+ )+\"", ENGINE_NONE},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        flowregex_t *regex = flowregex_create(cases[i].pattern, &error);
+        assert(regex != NULL && count_ops(regex->program, OP_NFA) == 1);
+        const bitmask_t *mask = flowregex_match_mask(regex, ctx, text, len);
+        assert(mask != NULL && bitmask_any(mask));
+        
+        const flowregex_plan_t *plan = &ctx->plan;
+        assert(plan->program == regex->program && plan->engines != NULL);
+        for (size_t pc = 0; pc < regex->program->length; pc++) {
+            if (regex->program->code[pc].op == OP_NFA) assert(plan->engines[pc] == cases[i].engine);
+        }
+        reference_match(regex->root, ctx, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    
+    // From starts alone, no state is entered that only the unmasked shift
+    // of nfa_run would reach (a first state it enters anyway)
+    flowregex_t *loop = flowregex_create("(([ab][^a][ab]*.?|b+ ?[^a]|[^a])a)+", &error);
+    assert(loop != NULL && loop->nfa != NULL && loop->nfa->plain_shift);
+    bitmask_t *input = bitmask_create(7);
+    bitmask_t *output = bitmask_create(7);
+    assert(input != NULL && output != NULL);
+    bitmask_set(input, 1);
+    uint64_t state = 0;
+    assert(nfa_run_from(loop->nfa, "bb c a", 6, input, &state, output) && !bitmask_any(output));
+    bitmask_set(input, 4);
+    assert(nfa_run_from(loop->nfa, "bb c a", 6, input, &state, output) && bitmask_get(output, 6));
+    bitmask_destroy(input);
+    bitmask_destroy(output);
+    flowregex_destroy(loop);
+    
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(ctx);
+    free(text);
+}
+
+// Test the Glushkov NFA of small patterns: its shape, the 64-state limit,
+// whole-text runs against the reference, and the plan choosing it
+TEST(bit_parallel_nfa) {
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("GA.TA[CG]A", &error);
+    assert(regex != NULL && regex->nfa != NULL);
+    assert(regex->nfa->states == 7 && regex->nfa->jump_count == 0 && regex->nfa->plain_shift);
+    flowregex_destroy(regex);
+    
+    // One state per step: 65 steps do not fit
+    char long_pattern[66];
+    memset(long_pattern, 'a', 65);
+    long_pattern[65] = '\0';
+    regex = flowregex_create(long_pattern, &error);
+    assert(regex != NULL && regex->nfa == NULL);
+    flowregex_destroy(regex);
+    
+    // Loops, alternatives and empty matches, across several output words
+    const char *text = "abcbd aabbd xx12y x3y acbcbcbd\nab\tcd a1b2c3 dddd abcabcabd xyxyxy 7y";
+    size_t len = strlen(text);
+    const char *patterns[] = {
+        "a(b|c)*d", "(ab|cd)+", "x\\d+y", "[a-c]+d?", "a*", "(a|b)?c", "\\s\\w", "(xy)*x", ".b.", "d+|y"
+    };
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    bitmask_t *output = bitmask_create(len + 1);
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(ctx != NULL && output != NULL && expected != NULL);
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL && regex->nfa != NULL);
+        nfa_run(regex->nfa, text, len, output);
+        assert(flowregex_ctx_bind_text(ctx, text, len));
+        reference_match(regex->root, ctx, expected);
+        for (size_t pos = 0; pos <= len; pos++) {
+            assert(bitmask_get(output, pos) == bitmask_get(expected, pos));
+        }
+        flowregex_destroy(regex);
+    }
+    flowregex_ctx_destroy(ctx);
+    bitmask_destroy(output);
+    bitmask_destroy(expected);
+    
+    // Chosen on its own for a long class-heavy motif over DNA too short to
+    // fill a DFA cache, with no scratch masks at all
+    len = 5000;
+    char *dna = malloc(len + 1);
+    assert(dna != NULL);
+    uint32_t seed = 3;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        dna[i] = "ACGT"[(seed >> 16) & 3];
+    }
+    memcpy(dna + 2500, "GACTAGACGTTACGGAATCATAG", 23);
+    dna[len] = '\0';
+    regex = flowregex_create("GA.TA[CG]ACGT.A[CT]GGA.TC[AG]TAG", &error);
+    ctx = flowregex_ctx_create();
+    assert(regex != NULL && ctx != NULL);
+    const bitmask_t *mask = flowregex_match_mask(regex, ctx, dna, len);
+    assert(mask != NULL && bitmask_any(mask));
+    assert(ctx->plan.strategy == PLAN_NFA);
+    assert(ctx->pool->allocated == 0);
+    expected = bitmask_create(len + 1);
+    assert(expected != NULL);
+    reference_match(regex->root, ctx, expected);
+    for (size_t pos = 0; pos <= len; pos++) {
+        assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+    }
+    bitmask_destroy(expected);
+    
+    // Too short to plan: matched from every position without estimates
+    mask = flowregex_match_mask(regex, ctx, dna + 2000, 1000);
+    assert(mask != NULL && bitmask_get(mask, 523));
+    assert(ctx->plan.strategy == PLAN_DENSE && !ctx->plan.sampled && ctx->plan.engines == NULL);
+    flowregex_ctx_destroy(ctx);
+    flowregex_destroy(regex);
+    free(dna);
+}
+
+// Test the lazy DFA against the NFA across lanes and with a shared cache,
+// the plan choosing it, and the fallback once its cache thrashes
+TEST(lazy_dfa) {
+    // Random DNA, with no G in the middle three quarters: a state entered
+    // before a lane boundary there stays live far into the next lane
+    size_t len = 3 * 65536 + 123;
+    char *dna = malloc(len + 1);
+    assert(dna != NULL);
+    uint32_t seed = 5;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        dna[i] = i >= len / 8 && i < len / 8 * 7 ? "ACT"[(seed >> 16) % 3] : "ACGT"[(seed >> 16) & 3];
+    }
+    dna[len] = '\0';
+    
+    const char *patterns[] = {
+        "GATTACA", "[AC]+GT[AG]*C", "G[ACT]*T", "A[^T]*T", "(AC|GT)*TTT", "G.....C", "A(C|G)+T", "T+", "A*"
+    };
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    bitmask_t *output = bitmask_create(len + 1);
+    bitmask_t *expected = bitmask_create(len + 1);
+    assert(ctx != NULL && output != NULL && expected != NULL);
+    flowregex_error_t error;
+    bool thrashed;
+    
+    // One context's cache serves each pattern in turn, from empty and again
+    // from what the first run left in it
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL && regex->nfa != NULL);
+        nfa_run(regex->nfa, dna, len, expected);
+        for (int run = 0; run < 2; run++) {
+            assert(dfa_run(regex->nfa, ctx, dna, len, output));
+            for (size_t pos = 0; pos <= len; pos++) {
+                assert(bitmask_get(output, pos) == bitmask_get(expected, pos));
+            }
+        }
+        assert(regex->nfa->nullable || dfa_cached(ctx, regex->nfa, &thrashed) > 0);
+        assert(!thrashed);
+        
+        // Too short for lanes
+        bitmask_t *short_output = bitmask_create(101);
+        bitmask_t *short_expected = bitmask_create(101);
+        assert(short_output != NULL && short_expected != NULL);
+        nfa_run(regex->nfa, dna, 100, short_expected);
+        assert(dfa_run(regex->nfa, ctx, dna, 100, short_output));
+        for (size_t pos = 0; pos <= 100; pos++) {
+            assert(bitmask_get(short_output, pos) == bitmask_get(short_expected, pos));
+        }
+        bitmask_destroy(short_output);
+        bitmask_destroy(short_expected);
+        flowregex_destroy(regex);
+    }
+    
+    // Chosen for a looping motif over a long text, where the NFA's table
+    // lookups cost more
+    flowregex_t *regex = flowregex_create("[AC]+GT[AG]*C", &error);
+    assert(regex != NULL);
+    const bitmask_t *mask = flowregex_match_mask(regex, ctx, dna, len);
+    assert(mask != NULL && bitmask_any(mask));
+    assert(ctx->plan.strategy == PLAN_DFA);
+    reference_match(regex->root, ctx, expected);
+    for (size_t pos = 0; pos <= len; pos++) {
+        assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+    }
+    flowregex_destroy(regex);
+    
+    // A set of 2^16 NFA states overflows the cache again and again: the
+    // match falls back to the program, and the pattern is not planned for
+    // the DFA again
+    regex = flowregex_create("[AC]...............G", &error);
+    assert(regex != NULL && regex->nfa != NULL);
+    mask = flowregex_match_mask(regex, ctx, dna, len);
+    assert(mask != NULL);
+    assert(ctx->plan.strategy == PLAN_DENSE);
+    assert(dfa_cached(ctx, regex->nfa, &thrashed) > 0 && thrashed);
+    nfa_run(regex->nfa, dna, len, expected);
+    for (size_t pos = 0; pos <= len; pos++) {
+        assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+    }
+    assert(!dfa_run(regex->nfa, ctx, dna, len, output));
+    mask = flowregex_match_mask(regex, ctx, dna, len);
+    assert(mask != NULL && ctx->plan.strategy != PLAN_DFA);
+    flowregex_destroy(regex);
+    
+    bitmask_destroy(output);
+    bitmask_destroy(expected);
+    flowregex_ctx_destroy(ctx);
+    free(dna);
+}
+
+// Test single-character closures whose runs carry across several words
+TEST(single_char_closure) {
+    flowregex_error_t error;
+    flowregex_t *star = flowregex_create("Xa*b", &error);
+    flowregex_t *plus = flowregex_create("X\\d+b", &error);
+    flowregex_t *any = flowregex_create("X.*", &error);
+    assert(star != NULL && plus != NULL && any != NULL);
+    
+    // "X" + "a" * 200 + "b", then "X" + "7" * 150 + "b" + "\n"
+    char text[360];
+    size_t len = 0;
+    text[len++] = 'X';
+    for (int i = 0; i < 200; i++) text[len++] = 'a';
+    text[len++] = 'b';
+    text[len++] = 'X';
+    for (int i = 0; i < 150; i++) text[len++] = '7';
+    text[len++] = 'b';
+    text[len++] = '\n';
+    text[len] = '\0';
+    
+    size_t expected_star[] = {202};
+    match_result_t *result = flowregex_match(star, text, false);
+    assert(check_match_result(result, expected_star, 1));
+    match_result_destroy(result);
+    
+    size_t expected_plus[] = {354};
+    result = flowregex_match(plus, text, false);
+    assert(check_match_result(result, expected_plus, 1));
+    match_result_destroy(result);
+    
+    // X.* matches from each X up to (not across) the newline
+    result = flowregex_match(any, text, false);
+    assert(result != NULL && result->count == 354);
+    match_result_destroy(result);
+    
+    flowregex_destroy(star);
+    flowregex_destroy(plus);
+    flowregex_destroy(any);
+}
+
+// Test the compiled program against the element tree it was lowered from
+TEST(compiled_program) {
+    const char *patterns[] = {
+        "abc", "a|bc", "(ab|c)*d", "((ab|c)+d)*e?", "(a(b|c)*)+", "(a|b)?c+",
+        ".\\d*(\\s|x)+", "((a|b)*)*", "(ab)+(cd)*|b+"
+    };
+    const char *text = "abcdabcab cdd 12x ab\nbbccab";
+    size_t text_len = strlen(text);
+    flowregex_error_t error;
+    
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        flowregex_t *regex = flowregex_create(patterns[i], &error);
+        assert(regex != NULL);
+        program_t *program = regex->program;
+        assert(program != NULL && program->length > 0);
+        assert(program->input_slot != program->output_slot);
+        
+        // Every text-derived mask is hoisted in front of the evaluation
+        size_t pc = 0;
+        while (pc < program->length &&
+               (program->code[pc].op == OP_LITERAL_MASK || program->code[pc].op == OP_CLASS_MASK)) {
+            pc++;
+        }
+        for (; pc < program->length; pc++) {
+            assert(program->code[pc].op != OP_LITERAL_MASK && program->code[pc].op != OP_CLASS_MASK);
+            assert(program->code[pc].dst < program->slot_count);
+        }
+        
+        flowregex_ctx_t *ctx = flowregex_ctx_create();
+        assert(ctx != NULL);
+        const bitmask_t *mask = flowregex_match_mask(regex, ctx, text, text_len);
+        assert(mask != NULL);
+        
+        // Register slots are the only scratch masks a run needs
+        assert(ctx->pool->allocated == program->slot_count - 2);
+        
+        bitmask_t *expected = bitmask_create(text_len + 1);
+        reference_match(regex->root, ctx, expected);
+        for (size_t pos = 0; pos <= text_len; pos++) {
+            assert(bitmask_get(mask, pos) == bitmask_get(expected, pos));
+        }
+        bitmask_destroy(expected);
+        
+        flowregex_ctx_destroy(ctx);
+        flowregex_destroy(regex);
+    }
+}
+
 // Test error handling
 TEST(error_handling) {
     flowregex_error_t error;
@@ -304,6 +1647,392 @@ TEST(bitmask_operations) {
     bitmask_destroy(mask3);
 }
 
+// Test the vectorized word kernels against per-bit expectations
+TEST(bitmask_simd_kernels) {
+    printf("[%s] ", bitmask_simd_level());
+    
+    size_t size = 1000;
+    bitmask_t *src = bitmask_create(size);
+    bitmask_t *match = bitmask_create(size);
+    bitmask_t *dest = bitmask_create(size);
+    assert(src != NULL && match != NULL && dest != NULL);
+    
+    for (size_t i = 0; i < size; i++) {
+        if (i % 3 != 1) bitmask_set(src, i);
+        if (i % 7 != 2 || i % 64 == 63) bitmask_set(match, i);
+    }
+    
+    bitmask_and_shift(dest, src, match);
+    for (size_t i = 0; i < size; i++) {
+        bool expected = i > 0 && bitmask_get(src, i - 1) && bitmask_get(match, i - 1);
+        assert(bitmask_get(dest, i) == expected);
+    }
+    
+    bitmask_andnot_shift(dest, src, match);
+    for (size_t i = 0; i < size; i++) {
+        bool expected = i > 0 && bitmask_get(src, i - 1) && !bitmask_get(match, i - 1);
+        assert(bitmask_get(dest, i) == expected);
+    }
+    
+    // In place: dest aliases src
+    bitmask_t *copy = bitmask_copy(src);
+    assert(copy != NULL);
+    bitmask_and_shift(src, src, match);
+    for (size_t i = 0; i < size; i++) {
+        bool expected = i > 0 && bitmask_get(copy, i - 1) && bitmask_get(match, i - 1);
+        assert(bitmask_get(src, i) == expected);
+    }
+    
+    // (copy | src) & src == src
+    bitmask_or(copy, src);
+    bitmask_and(copy, src);
+    for (size_t i = 0; i < size; i++) {
+        assert(bitmask_get(copy, i) == bitmask_get(src, i));
+    }
+    
+    bitmask_destroy(src);
+    bitmask_destroy(match);
+    bitmask_destroy(dest);
+    bitmask_destroy(copy);
+}
+
+// Test ctz-based set-bit iteration and popcount
+TEST(bitmask_iteration) {
+    bitmask_t *mask = bitmask_create(300);
+    assert(mask != NULL);
+    
+    size_t positions[] = {0, 1, 63, 64, 127, 128, 200, 299};
+    size_t n = sizeof(positions) / sizeof(positions[0]);
+    for (size_t i = 0; i < n; i++) {
+        bitmask_set(mask, positions[i]);
+    }
+    assert(bitmask_count(mask) == n);
+    
+    bitmask_iter_t it;
+    size_t pos;
+    size_t idx = 0;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        assert(idx < n);
+        assert(pos == positions[idx]);
+        idx++;
+    }
+    assert(idx == n);
+    
+    size_t count;
+    size_t *array = bitmask_get_set_positions(mask, &count);
+    assert(array != NULL && count == n);
+    for (size_t i = 0; i < n; i++) {
+        assert(array[i] == positions[i]);
+    }
+    free(array);
+    
+    bitmask_clear_all(mask);
+    assert(bitmask_count(mask) == 0);
+    bitmask_iter_init(&it, mask);
+    assert(!bitmask_iter_next(&it, &pos));
+    
+    bitmask_destroy(mask);
+}
+
+// Test positions past 2^32, as positions and as 512MB of words (that part
+// skipped if it cannot be allocated)
+TEST(bitmask_positions_past_32_bits) {
+    size_t size = ((size_t)1 << 32) + 200;
+    bitmask_t *mask = bitmask_create(size);
+    assert(mask != NULL);
+    
+    size_t positions[] = {5, (size_t)UINT32_MAX - 1, UINT32_MAX, (size_t)UINT32_MAX + 1,
+                          ((size_t)1 << 32) + 130, size - 1};
+    size_t n = sizeof(positions) / sizeof(positions[0]);
+    for (size_t i = 0; i < n; i++) {
+        bitmask_set(mask, positions[i]);
+    }
+    bitmask_set(mask, size);   // out of range: ignored
+    assert(bitmask_count(mask) == n);
+    for (size_t i = 0; i < n; i++) {
+        assert(bitmask_get(mask, positions[i]));
+    }
+    assert(!bitmask_get(mask, (size_t)UINT32_MAX - 2));
+    assert(!bitmask_get(mask, (size_t)UINT32_MAX + 2));
+    assert(!bitmask_get(mask, (size_t)1 << 33));
+    
+    bitmask_iter_t it;
+    size_t pos;
+    size_t idx = 0;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        assert(idx < n && pos == positions[idx]);
+        idx++;
+    }
+    assert(idx == n);
+    
+    size_t count;
+    size_t *array = bitmask_get_set_positions(mask, &count);
+    assert(array != NULL && count == n);
+    for (size_t i = 0; i < n; i++) {
+        assert(array[i] == positions[i]);
+    }
+    free(array);
+    
+    bitmask_clear(mask, UINT32_MAX);
+    assert(!bitmask_get(mask, UINT32_MAX) && bitmask_get(mask, (size_t)UINT32_MAX + 1));
+    assert(bitmask_count(mask) == n - 1);
+    assert(mask->kind == BITMASK_ARRAY && mask->bits == NULL);
+    
+    uint64_t *words = bitmask_words(mask);
+    if (!words) {
+        printf("(words skipped) ");
+        bitmask_destroy(mask);
+        return;
+    }
+    assert(mask->kind == BITMASK_DENSE);
+    assert(words[((size_t)UINT32_MAX + 1) / 64] == 1);
+    assert(words[(size - 1) / 64] == 1ULL << ((size - 1) % 64));
+    assert(bitmask_count(mask) == n - 1);
+    assert(bitmask_next(mask, 6) == (size_t)UINT32_MAX - 1);
+    assert(bitmask_next(mask, UINT32_MAX) == (size_t)UINT32_MAX + 1);
+    bitmask_destroy(mask);
+}
+
+static uint32_t next_random(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// Mask of the given representation holding ref[0..size), drawn at random
+// to suit it. A dense mask gets zero stretches, left out of its summary.
+static bitmask_t *kind_mask(bool *ref, size_t size, bitmask_kind_t kind, uint32_t *seed) {
+    bitmask_t *mask = bitmask_create(size);
+    assert(mask != NULL);
+    memset(ref, 0, size);
+    size_t words = (size + 63) / 64;
+    
+    if (kind == BITMASK_FULL) {
+        memset(ref, 1, size);
+        bitmask_set_all(mask);
+    } else if (kind == BITMASK_ARRAY) {
+        size_t n = next_random(seed) % (words + 1);
+        for (size_t i = 0; i < n; i++) {
+            size_t pos = next_random(seed) % size;
+            ref[pos] = true;
+            bitmask_set(mask, pos);
+        }
+        assert(mask->kind == BITMASK_ARRAY);
+    } else if (kind == BITMASK_RUNS) {
+        size_t n = 1 + next_random(seed) % ((words + 1) / 2);
+        for (size_t i = 0; i < n; i++) {
+            size_t from = next_random(seed) % size;
+            size_t to = from + 2 + next_random(seed) % 300;
+            if (to > size) to = size;
+            if (to - from < 2) continue;
+            memset(ref + from, 1, to - from);
+            bitmask_set_range(mask, from, to);
+        }
+        assert(mask->kind != BITMASK_DENSE);
+    } else {
+        uint32_t density = 1 + next_random(seed) % 3;
+        for (size_t i = 0; i < size; i++) {
+            ref[i] = (i / 5000) % 3 != 1 && next_random(seed) % 4 < density;
+        }
+        bitmask_clear_all(mask);
+        uint64_t *bits = bitmask_words(mask);
+        assert(bits != NULL);
+        for (size_t i = 0; i < size; i++) {
+            if (ref[i]) bits[i / 64] |= 1ULL << (i % 64);
+        }
+        // and-not with zero words drops the zero blocks from the summary
+        bitmask_t *zero = bitmask_create(size);
+        assert(zero != NULL && bitmask_words(zero) != NULL);
+        bitmask_andnot(mask, zero);
+        bitmask_destroy(zero);
+        assert(mask->kind == BITMASK_DENSE);
+    }
+    return mask;
+}
+
+static void assert_mask(const bitmask_t *mask, const bool *ref, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) {
+        assert(bitmask_get(mask, i) == ref[i]);
+        count += ref[i];
+    }
+    assert(bitmask_count(mask) == count);
+    assert(bitmask_any(mask) == (count > 0));
+    
+    bitmask_iter_t it;
+    size_t pos;
+    size_t last = 0;
+    size_t seen = 0;
+    bitmask_iter_init(&it, mask);
+    while (bitmask_iter_next(&it, &pos)) {
+        assert(pos < size && ref[pos] && (seen == 0 || pos > last));
+        last = pos;
+        seen++;
+    }
+    assert(seen == count);
+    
+    size_t next = SIZE_MAX;
+    for (size_t i = size; i-- > 0;) {
+        if (ref[i]) next = i;
+        if (i % 37 == 0 || i + 1 == size) assert(bitmask_next(mask, i) == next);
+    }
+}
+
+// Test every primitive over every mix of representations against a per-bit
+// reference, with and without the destination aliasing an operand
+TEST(bitmask_representations) {
+    const size_t sizes[] = {1, 63, 64, 65, 700, 4096, 4097, 9000, 20000};
+    const bitmask_kind_t kinds[] = {BITMASK_ARRAY, BITMASK_RUNS, BITMASK_DENSE, BITMASK_FULL};
+    uint32_t seed = 5;
+    
+    for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+        size_t size = sizes[si];
+        bool *a = malloc(size);
+        bool *b = malloc(size);
+        bool *c = malloc(size);
+        bool *want = malloc(size);
+        assert(a != NULL && b != NULL && c != NULL && want != NULL);
+        
+        for (size_t ka = 0; ka < 4; ka++) {
+            for (size_t kb = 0; kb < 4; kb++) {
+                for (int op = 0; op < 12; op++) {
+                    bitmask_t *x = kind_mask(a, size, kinds[ka], &seed);
+                    bitmask_t *y = kind_mask(b, size, kinds[kb], &seed);
+                    bitmask_t *z = kind_mask(c, size, kinds[(ka + kb + op) % 4], &seed);
+                    assert_mask(x, a, size);
+                    assert_mask(y, b, size);
+                    bool alias = op % 2 == 1;
+                    bitmask_t *dest = alias ? x : z;
+                    bool at_least_one = op % 4 == 1;
+                    
+                    switch (op / 2) {
+                        case 0:
+                            assert(bitmask_and_shift(dest, x, y));
+                            for (size_t i = 0; i < size; i++) want[i] = i > 0 && a[i - 1] && b[i - 1];
+                            break;
+                        case 1:
+                            // Here the alias is the excluded mask
+                            dest = alias ? y : z;
+                            assert(bitmask_andnot_shift(dest, x, y));
+                            for (size_t i = 0; i < size; i++) want[i] = i > 0 && a[i - 1] && !b[i - 1];
+                            break;
+                        case 2:
+                            // X* for op 4, X+ for op 5
+                            assert(bitmask_closure(dest, x, y, at_least_one));
+                            for (size_t i = 0; i < size; i++) {
+                                bool step = i > 0 && b[i - 1] && (want[i - 1] || a[i - 1]);
+                                want[i] = at_least_one ? step : a[i] || (i > 0 && b[i - 1] && want[i - 1]);
+                            }
+                            break;
+                        case 3: {
+                            // Steps over y, z and y, dest aliasing the input or a step's mask
+                            const bitmask_t *masks[] = {y, z, y};
+                            const bool *refs[] = {b, c, b};
+                            dest = alias ? y : x;
+                            assert(bitmask_and_shift_string(dest, x, masks, 3));
+                            memcpy(want, a, size);
+                            for (int k = 0; k < 3; k++) {
+                                for (size_t i = size; i-- > 0;) want[i] = i > 0 && want[i - 1] && refs[k][i - 1];
+                            }
+                            break;
+                        }
+                        case 4:
+                            dest = x;
+                            if (alias) {
+                                assert(bitmask_andnot(x, y) && bitmask_not(x));
+                                for (size_t i = 0; i < size; i++) want[i] = !(a[i] && !b[i]);
+                            } else {
+                                assert(bitmask_or(x, y) && bitmask_and(x, z));
+                                for (size_t i = 0; i < size; i++) want[i] = (a[i] || b[i]) && c[i];
+                            }
+                            break;
+                        default: {
+                            // Windows, ranges and conversions: big = x at size + 3
+                            // and ~y at 50; the window is big from 50 on
+                            bitmask_t *big = bitmask_create(2 * size + 70);
+                            bitmask_t *window = bitmask_create(size);
+                            assert(big != NULL && window != NULL);
+                            assert(bitmask_copy_into(z, y) && bitmask_not(z));
+                            assert(bitmask_or_at(big, x, size + 3) && bitmask_or_at(big, z, 50));
+                            assert(bitmask_copy_range(window, big, 50));
+                            for (size_t i = 0; i < size; i++) {
+                                size_t j = i + 47 - size;
+                                want[i] = !b[i] || (i + 47 >= size && j < size && a[j]);
+                            }
+                            assert_mask(window, want, size);
+                            bitmask_destroy(big);
+                            
+                            size_t from = next_random(&seed) % size;
+                            size_t to = from + next_random(&seed) % (size - from + 1);
+                            assert(bitmask_set_range(window, from, to) && bitmask_clear(window, size / 2));
+                            for (size_t i = from; i < to; i++) want[i] = true;
+                            want[size / 2] = false;
+                            assert_mask(window, want, size);
+                            bitmask_optimize(window);
+                            assert_mask(window, want, size);
+                            if (alias) {
+                                bitmask_sparse(window);
+                            } else {
+                                assert(bitmask_words(window) != NULL && window->kind == BITMASK_DENSE);
+                            }
+                            bitmask_destroy(x);
+                            x = dest = window;
+                            break;
+                        }
+                    }
+                    assert_mask(dest, want, size);
+                    
+                    bitmask_destroy(x);
+                    bitmask_destroy(y);
+                    bitmask_destroy(z);
+                }
+            }
+        }
+        
+        free(a);
+        free(b);
+        free(c);
+        free(want);
+    }
+}
+
+// Test that work masks are recycled across repeated matches in one context
+TEST(bitmask_pool_reuse) {
+    flowregex_error_t error;
+    flowregex_t *regex = flowregex_create("(a|b)*c(ab)+", &error);
+    flowregex_ctx_t *ctx = flowregex_ctx_create();
+    assert(regex != NULL && ctx != NULL);
+    
+    const char *text = "abacabab xxcab";
+    match_result_t *result = flowregex_match_ctx(regex, ctx, text, strlen(text));
+    assert(result != NULL);
+    match_result_destroy(result);
+    
+    size_t allocated = ctx->pool->allocated;
+    assert(allocated > 0);
+    
+    // Same length: no new masks
+    for (int i = 0; i < 10; i++) {
+        result = flowregex_match_ctx(regex, ctx, "bbbcababab cab", 14);
+        assert(result != NULL);
+        match_result_destroy(result);
+    }
+    assert(ctx->pool->allocated == allocated);
+    
+    // Pool acquire/release round trip
+    bitmask_pool_t *pool = bitmask_pool_create(100);
+    bitmask_t *mask = bitmask_pool_acquire(pool, 100);
+    assert(mask != NULL && pool->allocated == 1);
+    bitmask_pool_release(pool, mask);
+    assert(bitmask_pool_acquire(pool, 100) == mask);
+    bitmask_pool_release(pool, mask);
+    bitmask_pool_destroy(pool);
+    
+    flowregex_ctx_destroy(ctx);
+    flowregex_destroy(regex);
+}
+
 int main(void) {
     printf("=== FlowRegex C Implementation Tests ===\n\n");
     
@@ -315,10 +2044,38 @@ int main(void) {
     run_test_question_quantifier();
     run_test_any_character();
     run_test_character_classes();
+    run_test_bracket_expressions();
+    run_test_optimized_text_index();
     run_test_grouping();
     run_test_complex_pattern();
+    run_test_word_boundaries();
+    run_test_long_repetition();
+    run_test_long_text();
+    run_test_streaming_match();
+    run_test_parallel_match();
+    run_test_shared_regex_threads();
+    run_test_pattern_set();
+    run_test_single_char_closure();
+    run_test_compiled_program();
+    run_test_common_subexpressions();
+    run_test_pattern_rewrites();
+    run_test_fused_strings();
+    run_test_literal_prefilter();
+    run_test_required_factors();
+    run_test_tiled_evaluation();
+    run_test_sparse_steps();
+    run_test_rare_motif_positions();
+    run_test_match_plan();
+    run_test_planned_nfa_loops();
+    run_test_bit_parallel_nfa();
+    run_test_lazy_dfa();
     run_test_error_handling();
     run_test_bitmask_operations();
+    run_test_bitmask_simd_kernels();
+    run_test_bitmask_iteration();
+    run_test_bitmask_positions_past_32_bits();
+    run_test_bitmask_representations();
+    run_test_bitmask_pool_reuse();
     
     printf("\n=== Test Results ===\n");
     printf("Tests run: %d\n", tests_run);